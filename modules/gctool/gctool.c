@@ -0,0 +1,78 @@
+/*
+ *  gctool.c - Offline inspection of gc snapshots
+ *
+ *  Copyright (C) 2018 Atanas Tulbenski <top4ester@gmail.com>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gc.h"
+
+#define GCTOOL_MAX_BLOCKS	20
+
+static void gctool_usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s show <snapshot> [max_blocks]\n", name);
+	fprintf(stderr, "       %s diff <before> <after> [max_blocks]\n", name);
+	fprintf(stderr, "diff exits with 1 when blocks allocated in between are still alive\n");
+}
+
+static int gctool_show(const char *path, uint32_t max_blocks)
+{
+	gc_snapshot_t *snap;
+
+	snap = gc_snapshot_load(path);
+	if (snap == NULL) {
+		return 2;
+	}
+	gc_snapshot_dump(snap, max_blocks);
+	gc_snapshot_free(snap);
+	return 0;
+}
+
+static int gctool_diff(const char *before_path, const char *after_path, uint32_t max_blocks)
+{
+	gc_snapshot_t *before;
+	gc_snapshot_t *after;
+	gc_snapshot_t *diff = NULL;
+	int ret = 2;
+
+	before = gc_snapshot_load(before_path);
+	after = gc_snapshot_load(after_path);
+	if (before != NULL && after != NULL) {
+		diff = gc_snapshot_diff(before, after);
+	}
+	if (diff != NULL) {
+		printf("%s: %u blocks, %llu B\n", before_path, gc_snapshot_blocks(before, NULL),
+		       (unsigned long long)gc_snapshot_bytes(before));
+		printf("%s: %u blocks, %llu B\n", after_path, gc_snapshot_blocks(after, NULL),
+		       (unsigned long long)gc_snapshot_bytes(after));
+		printf("still alive from in between: %u blocks, %llu B\n",
+		       gc_snapshot_blocks(diff, NULL), (unsigned long long)gc_snapshot_bytes(diff));
+		gc_snapshot_dump(diff, max_blocks);
+		ret = (gc_snapshot_blocks(diff, NULL) != 0) ? 1 : 0;
+	}
+	gc_snapshot_free(diff);
+	gc_snapshot_free(after);
+	gc_snapshot_free(before);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc >= 3 && !strcmp(argv[1], "show")) {
+		return gctool_show(argv[2],
+				   (argc > 3) ? strtoul(argv[3], NULL, 0) : GCTOOL_MAX_BLOCKS);
+	}
+	if (argc >= 4 && !strcmp(argv[1], "diff")) {
+		return gctool_diff(argv[2], argv[3],
+				   (argc > 4) ? strtoul(argv[4], NULL, 0) : GCTOOL_MAX_BLOCKS);
+	}
+	gctool_usage(argv[0]);
+	return 2;
+}
@@ -7,56 +7,82 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <pthread.h>
 
 #include "debug.h"
 #include "gc.h"
+#include "gc_private.h"
 
 DEBUG_CREATE_CTX(GC, DBG_QUIET);
 
-#define GC_POOL_COUNT	100
+/*
+ * Every gc object is linked into one of GC_POOL_SHARDS lists, picked by
+ * its address, so concurrent gc_objnew/gc_objdel calls rarely share a lock.
+ */
+#define GC_POOL_SHARDS	16	/* gc_pool_shard_of() yields 4 bits */
+
+typedef struct gc_pool_shard_s {
+	pthread_mutex_t	lock;
+	gcobj_private_t	*head;
+	uint32_t	count;
+} __attribute__ ((aligned (64))) gc_pool_shard_t;
 
 typedef struct gc_pool_s {
-	gcobj_t *pool[GC_POOL_COUNT];
+	gc_pool_shard_t	shard[GC_POOL_SHARDS];
 } gc_pool_t;
 
-typedef enum gc_mem_type_e {
-	GC_MEM_SYSTEM = 0,
-	GC_MEM_2D,
-} gc_mem_type_t;
-
-typedef struct gc_mem_s {
-	int32_t		size;
-	uint32_t	index;
-	gc_mem_type_t	mem_type;
-	void		*d_ptr;
-	void		*phys_ptr;
-} gc_mem_t;
-
-typedef struct gcobj_private_s {
-	void 		**sp;
-	uint32_t	sp_index;
-	uint32_t	sp_top;
-	uint32_t	memused;
-} gcobj_private_t;
-
-static gc_pool_t gc_pool = { .pool = {NULL, }};
+static gc_pool_t gc_pool = {
+	.shard = {
+		[0 ... GC_POOL_SHARDS - 1] = {
+			.lock = PTHREAD_MUTEX_INITIALIZER,
+			.head = NULL,
+			.count = 0,
+		},
+	},
+};
 
 static int gc_alloc2d_dummy(int w, int h, void **physical_addr_p, void **virtual_addr_p);
 static int gc_free2d_dummy(void *physical_addr_p);
 
+/* Serial of the last gc created */
+static uint64_t gc_serial;
+
 static gc_alloc2d_f alloc2d_cb_p = gc_alloc2d_dummy;
 static gc_free2d_f free2d_cb_p = gc_free2d_dummy;
+static gc_alloc2d_ex_f alloc2d_ex_cb_p = NULL;
+
+static const int gc_pixfmt_bpp[GC_FMT_COUNT] = {
+	[GC_FMT_NONE]		= 1,
+	[GC_FMT_GRAY8]		= 1,
+	[GC_FMT_RGB565]		= 2,
+	[GC_FMT_YUYV]		= 2,
+	[GC_FMT_RGB888]		= 3,
+	[GC_FMT_RGBA8888]	= 4,
+};
 
 static void *gc_malloc(void *this, size_t memsize);
 static void gc_free(void *this, void *memp);
+static void *gc_arena_malloc(void *this, size_t memsize);
+static void gc_arena_free(void *this, void *memp);
 static char *gc_strdup(void *this, const char *str_p);
+static void *gc_realloc(void *this, void *memp, size_t memsize);
+static void *gc_calloc(void *this, size_t count, size_t memsize);
+static void *gc_memalign(void *this, size_t align, size_t memsize);
+static void *gc_arena_realloc(void *this, void *memp, size_t memsize);
+static void *gc_arena_calloc(void *this, size_t count, size_t memsize);
+static void *gc_arena_memalign(void *this, size_t align, size_t memsize);
 
 static int gc_malloc2d(void *this, int w, int h);
 static void gc_free2d(void *this, int id);
+static int gc_malloc2d_ex(void *this, gc_surface_desc_t *desc);
+static const gc_surface_desc_t *gc_lookup2d(void *this, int id);
+static void gc_surface_release(gc_mem2d_t *gc_mem2d);
 
 static int gc_alloc2d_dummy(int w, int h, void **physical_addr_p, void **virtual_addr_p)
 {
@@ -70,47 +96,112 @@ static int gc_free2d_dummy(void *physical_addr_p)
 	return -1;
 }
 
+static uint32_t gc_pool_shard_of(gcobj_t *gc_p)
+{
+	return ((uint32_t)((uintptr_t)gc_p >> 4) * 0x9e3779b1u) >> 28;
+}
+
 static void gc_pool_add(gcobj_t *gc_p)
 {
-	int i;
+	gcobj_private_t *gc_prv_p = (gcobj_private_t *) gc_p->private_p;
+	gc_pool_shard_t *shard;
 
-	for (i = 0; i < GC_POOL_COUNT; i++) {
-		if (gc_pool.pool[i] == NULL) {
-			gc_pool.pool[i] = gc_p;
-			break;
-		}
+	gc_prv_p->gc = gc_p;
+	gc_prv_p->pool_shard = gc_pool_shard_of(gc_p);
+	shard = &gc_pool.shard[gc_prv_p->pool_shard];
+
+	pthread_mutex_lock(&shard->lock);
+	gc_prv_p->pool_prev = NULL;
+	gc_prv_p->pool_next = shard->head;
+	if (shard->head != NULL) {
+		shard->head->pool_prev = gc_prv_p;
 	}
+	shard->head = gc_prv_p;
+	shard->count++;
+	pthread_mutex_unlock(&shard->lock);
 }
 
 static void gc_pool_del(gcobj_t *gc_p)
+{
+	gcobj_private_t *gc_prv_p = (gcobj_private_t *) gc_p->private_p;
+	gc_pool_shard_t *shard;
+
+	shard = &gc_pool.shard[gc_prv_p->pool_shard];
+
+	pthread_mutex_lock(&shard->lock);
+	if (gc_prv_p->pool_prev != NULL) {
+		gc_prv_p->pool_prev->pool_next = gc_prv_p->pool_next;
+	} else {
+		shard->head = gc_prv_p->pool_next;
+	}
+	if (gc_prv_p->pool_next != NULL) {
+		gc_prv_p->pool_next->pool_prev = gc_prv_p->pool_prev;
+	}
+	shard->count--;
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/* Holding every shard lock freezes the registry for a consistent walk */
+static void gc_pool_lock(void)
 {
 	int i;
 
-	for (i = 0; i < GC_POOL_COUNT; i++) {
-		if (gc_pool.pool[i] == gc_p) {
-			gc_pool.pool[i] = NULL;
-			break;
-		}
+	for (i = 0; i < GC_POOL_SHARDS; i++) {
+		pthread_mutex_lock(&gc_pool.shard[i].lock);
 	}
 }
 
-static void gc_dump(void *gcobj_p);
+static void gc_pool_unlock(void)
+{
+	int i;
 
-static void gc_pool_dump(void)
+	for (i = GC_POOL_SHARDS - 1; i >= 0; i--) {
+		pthread_mutex_unlock(&gc_pool.shard[i].lock);
+	}
+}
+
+/*
+ * Calls cb for every registered gc with the registry frozen, so cb must
+ * not create or delete gc objects. Returns the number of objects.
+ */
+uint32_t gc_pool_walk(gc_pool_walk_f cb, void *arg)
 {
 	int i;
-	int total_mem_used = 0;
+	uint32_t total_count = 0;
 	gcobj_private_t *gc_prv_p;
 
-	IPRN("------------------------- GC dump pool start -------------------------\n");
-	for (i = 0; i < GC_POOL_COUNT; i++) {
-		if (gc_pool.pool[i] != NULL) {
-			gc_dump(gc_pool.pool[i]);
-			gc_prv_p = (gcobj_private_t *) gc_pool.pool[i]->private_p;
-			total_mem_used += gc_prv_p->memused;
+	gc_pool_lock();
+	for (i = 0; i < GC_POOL_SHARDS; i++) {
+		for (gc_prv_p = gc_pool.shard[i].head; gc_prv_p != NULL;
+		     gc_prv_p = gc_prv_p->pool_next) {
+			cb(gc_prv_p, arg);
 		}
+		total_count += gc_pool.shard[i].count;
 	}
-	IPRN("TOTAL = %d\n", total_mem_used);
+	gc_pool_unlock();
+	return total_count;
+}
+
+static void gc_dump(void *gcobj_p);
+
+static void gc_pool_dump_one(gcobj_private_t *gc_prv_p, void *arg)
+{
+	uint64_t *total_mem_used = arg;
+
+	gc_dump(gc_prv_p->gc);
+	*total_mem_used += __atomic_load_n(&gc_prv_p->memused, __ATOMIC_RELAXED);
+}
+
+static void gc_pool_dump(void)
+{
+	uint64_t total_mem_used = 0;
+	uint32_t total_count;
+
+	IPRN("------------------------- GC dump pool start -------------------------\n");
+	total_count = gc_pool_walk(gc_pool_dump_one, &total_mem_used);
+	IPRN("OBJECTS = %u\n", total_count);
+	IPRN("TOTAL = %llu\n", (unsigned long long)total_mem_used);
+	gc_budget_dump();
 	IPRN("------------------------- GC dump pool end ---------------------------\n");
 }
 
@@ -125,18 +216,217 @@ static void gc_dump(void *gcobj_p)
 	}
 	gc_prv_p = (gcobj_private_t *) gc_p->private_p;
 	IPRN("\t[%p] GC dump start -------------------------\n", gc_p);
-	IPRN("\tmemused     = %d B\n", gc_prv_p->memused);
+	IPRN("\tmemused     = %llu B\n",
+	     (unsigned long long)__atomic_load_n(&gc_prv_p->memused, __ATOMIC_RELAXED));
 	IPRN("\tsp_top      = %d B\n", gc_prv_p->sp_top);
 	IPRN("\tsp_index    = %d B\n", gc_prv_p->sp_index);
+	IPRN("\tsp_free     = %d\n", (int)gc_prv_p->sp_free);
+	if (gc_prv_p->slab != NULL) {
+		gc_slab_dump(gc_prv_p->slab);
+	}
+	if (gc_prv_p->arena != NULL) {
+		gc_arena_dump(gc_prv_p->arena);
+	}
 	IPRN("\t[%p] GC dump end ---------------------------\n", gc_p);
 }
 
+/*
+ * Grows the slot table to hold cap entries. Growth is geometric, so
+ * filling a gc with n blocks copies the table O(log n) times.
+ */
+static int gc_slots_grow(gcobj_private_t *gc_prv_p, uint32_t cap)
+{
+	void *tempmemp = NULL;
+	uint32_t old_cap = gc_prv_p->sp_top + 1;
+
+	tempmemp = realloc(gc_prv_p->sp_gen, cap * sizeof(uint16_t));
+	if (tempmemp == NULL) {
+		return -1;
+	}
+	gc_prv_p->sp_gen = tempmemp;
+	memset(&gc_prv_p->sp_gen[old_cap], 0, (cap - old_cap) * sizeof(uint16_t));
+	if (gc_prv_p->sp_tag != NULL) {
+		tempmemp = realloc(gc_prv_p->sp_tag, cap * sizeof(uint32_t));
+		if (tempmemp == NULL) {
+			return -1;
+		}
+		gc_prv_p->sp_tag = tempmemp;
+		memset(&gc_prv_p->sp_tag[old_cap], 0, (cap - old_cap) * sizeof(uint32_t));
+	}
+	tempmemp = realloc(gc_prv_p->sp, cap * sizeof(void *));
+	if (tempmemp == NULL) {
+		return -1;
+	}
+	gc_prv_p->sp = tempmemp;
+	memset(&gc_prv_p->sp[old_cap], 0, (cap - old_cap) * sizeof(void *));
+	/* gc_stats reads it from other threads */
+	__atomic_store_n(&gc_prv_p->sp_top, cap - 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int gc_slot_get(gcobj_private_t *gc_prv_p, gc_mem_t *gc_mem)
+{
+	uint32_t cap;
+	uint32_t i;
+
+	/* The slot holds the owner's reference */
+	gc_mem->refs = 1;
+	if (gc_prv_p->sp_free != GC_SLOT_NONE) {
+		i = gc_prv_p->sp_free;
+		gc_prv_p->sp_free = GC_SLOT_NEXT(gc_prv_p->sp[i]);
+		gc_prv_p->sp[i] = gc_mem;
+		gc_mem->index = i;
+		gc_stats_alloc(gc_prv_p, gc_mem->size, gc_mem->mem_type == GC_MEM_2D);
+		if (gc_prv_p->trace != NULL) {
+			gc_trace_alloc(gc_prv_p, i);
+		}
+		return i;
+	}
+
+	if (gc_prv_p->sp_index > gc_prv_p->sp_top) {
+		cap = gc_prv_p->sp_top + 1;
+		if (cap >= GC_SLOT_NONE / 2) {
+			return -1;
+		}
+		if (gc_slots_grow(gc_prv_p, cap + cap / 2 + GC_SLOTS_MIN) < 0) {
+			return -1;
+		}
+	}
+	i = gc_prv_p->sp_index;
+	gc_prv_p->sp[i] = gc_mem;
+	gc_mem->index = i;
+	gc_prv_p->sp_index++;
+	gc_stats_alloc(gc_prv_p, gc_mem->size, gc_mem->mem_type == GC_MEM_2D);
+	if (gc_prv_p->trace != NULL) {
+		gc_trace_alloc(gc_prv_p, i);
+	}
+	return i;
+}
+
+/*
+ * Drops the reference of the gc a block just left. Returns 1 when it was
+ * the last one, otherwise the block now belongs to its retainers alone
+ * and must not be touched any more.
+ */
+static int gc_mem_disown(gcobj_private_t *gc_prv_p, gc_mem_t *gc_mem)
+{
+	uint64_t size = gc_mem->size;
+
+	gc_mem->index = GC_SLOT_NONE;
+	if (__atomic_sub_fetch(&gc_mem->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		return 1;
+	}
+	gc_account_disown(gc_prv_p, size);
+	return 0;
+}
+
+static void gc_mem_release(gcobj_private_t *gc_prv_p, gc_mem_t *gc_mem)
+{
+	const gc_backend_t *backend;
+
+	switch (gc_mem->mem_type) {
+	case GC_MEM_SLAB:
+		gc_slab_free(gc_prv_p->slab, gc_mem, gc_mem->size + sizeof(gc_mem_t));
+		break;
+	case GC_MEM_TCACHE:
+		gc_tcache_free(gc_mem);
+		break;
+	case GC_MEM_ALIGNED:
+		free((uint8_t *)(gc_mem + 1) - ((size_t)1 << gc_mem->aux));
+		break;
+	case GC_MEM_MMAP:
+		gc_mmap_free(gc_mem, gc_mem->size + sizeof(gc_mem_t), gc_mem->aux);
+		break;
+	default:
+		backend = gc_backend_get(gc_mem->aux);
+		backend->free(backend->ctx, gc_mem);
+		break;
+	}
+}
+
+static void gc_slot_put(gcobj_private_t *gc_prv_p, uint32_t i)
+{
+	gc_mem_t *gc_mem = gc_prv_p->sp[i];
+
+	gc_stats_free(gc_prv_p, gc_mem->mem_type == GC_MEM_2D);
+	gc_prv_p->sp_gen[i]++;
+	if (gc_prv_p->sp_tag != NULL) {
+		gc_prv_p->sp_tag[i] = 0;
+	}
+	gc_prv_p->sp[i] = GC_SLOT_LINK(gc_prv_p->sp_free);
+	gc_prv_p->sp_free = i;
+}
+
+/* 2D slots have to fit in the handle */
+static int gc_slot_get_2d(gcobj_private_t *gc_prv_p, gc_mem_t *gc_mem)
+{
+	int i;
+
+	i = gc_slot_get(gc_prv_p, gc_mem);
+	if (i < 0) {
+		return -1;
+	}
+	if ((uint32_t)i > GC_HANDLE_SLOT_MASK) {
+		EPRN("No 2D handle for slot %d\n", i);
+		gc_slot_put(gc_prv_p, i);
+		return -1;
+	}
+	return i;
+}
+
+/*
+ * Releases every block still held in the slot table. With bulk set the
+ * slab blocks are skipped because their pages are about to be dropped.
+ */
+static void gc_slots_release(gcobj_private_t *gc_prv_p, int bulk)
+{
+	uint32_t i;
+	gc_mem_t *gc_mem;
+
+	for (i = 0; i < gc_prv_p->sp_index; i++) {
+		if (GC_SLOT_USED(gc_prv_p->sp[i])) {
+			gc_mem = gc_prv_p->sp[i];
+			if (gc_mem->mem_type == GC_MEM_SLAB) {
+				/* Never shared, the slab goes as a whole on bulk */
+				if (!bulk) {
+					gc_mem_release(gc_prv_p, gc_mem);
+				}
+			} else if (!gc_mem_disown(gc_prv_p, gc_mem)) {
+				/* Retained elsewhere */
+			} else if (gc_mem->mem_type == GC_MEM_2D) {
+				gc_surface_release((gc_mem2d_t *)gc_mem);
+				free(gc_mem);
+			} else {
+				gc_mem_release(gc_prv_p, gc_mem);
+			}
+			gc_prv_p->sp_gen[i]++;
+		}
+		gc_prv_p->sp[i] = NULL;
+	}
+	if (gc_prv_p->sp_tag != NULL) {
+		memset(gc_prv_p->sp_tag, 0, gc_prv_p->sp_index * sizeof(uint32_t));
+	}
+	gc_prv_p->sp_index = 0;
+	gc_prv_p->sp_free = GC_SLOT_NONE;
+	/* Arena blocks have no slot but are counted live until now as well */
+	GC_STAT_ADD(gc_prv_p->frees, __atomic_load_n(&gc_prv_p->live, __ATOMIC_RELAXED));
+	__atomic_store_n(&gc_prv_p->live, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&gc_prv_p->surfaces, 0, __ATOMIC_RELAXED);
+	gc_account_uncharge(gc_prv_p, __atomic_load_n(&gc_prv_p->memused, __ATOMIC_RELAXED));
+	gc_intern_drop(gc_prv_p);
+}
+
 __attribute__ ((visibility ("default")))
-gcobj_t *gc_objnew(void)
+gcobj_t *gc_objnew_ex(const gc_attr_t *attr)
 {
 	gcobj_t *tobj = NULL;
 	gcobj_private_t *gc_prv_p;
+	int backend;
 
+	backend = gc_backend_id((attr != NULL) ? attr->backend : NULL);
+	if (backend < 0) {
+		return NULL;
+	}
 	tobj = malloc(sizeof(gcobj_t));
 	if (tobj == NULL) {
 		return NULL;
@@ -147,50 +437,170 @@ gcobj_t *gc_objnew(void)
 		return NULL;
 	}
 	gc_prv_p = (gcobj_private_t *) tobj->private_p;
+	gc_prv_p->serial = __atomic_add_fetch(&gc_serial, 1, __ATOMIC_RELAXED);
 	gc_prv_p->sp_index = 0;
 	gc_prv_p->memused = 0;
-	gc_prv_p->sp_top = 19;
+	gc_prv_p->budget = (attr != NULL) ? attr->budget : 0;
+	gc_prv_p->peak = 0;
+	gc_prv_p->allocs = 0;
+	gc_prv_p->frees = 0;
+	gc_prv_p->live = 0;
+	gc_prv_p->surfaces = 0;
+	memset(gc_prv_p->size_class, 0, sizeof(gc_prv_p->size_class));
+	gc_prv_p->intern_bytes = 0;
+	gc_prv_p->sp_top = GC_SLOTS_MIN - 1;
+	if (attr != NULL && attr->capacity > GC_SLOTS_MIN && attr->capacity < GC_SLOT_NONE / 2) {
+		gc_prv_p->sp_top = attr->capacity - 1;
+	}
+	gc_prv_p->sp_free = GC_SLOT_NONE;
+	gc_prv_p->sp_tag = NULL;
+	gc_prv_p->flags = (attr != NULL) ? attr->flags : 0;
+	gc_prv_p->backend = backend;
+	gc_prv_p->slab = NULL;
+	gc_prv_p->arena = NULL;
+	gc_prv_p->trace = NULL;
+	gc_prv_p->intern = NULL;
+	gc_prv_p->intern_count = 0;
+	gc_prv_p->intern_cap = 0;
+	gc_prv_p->tree_parent = NULL;
+	gc_prv_p->tree_child = NULL;
+	gc_prv_p->tree_next = NULL;
+	gc_prv_p->tree_prev = NULL;
+	gc_prv_p->tree_used = 0;
 	tobj->dump = gc_dump;
 	tobj->memalloc = gc_malloc;
 	tobj->memfree = gc_free;
 	tobj->stringdup = gc_strdup;
+	tobj->memrealloc = gc_realloc;
+	tobj->memcalloc = gc_calloc;
+	tobj->memalign = gc_memalign;
 	tobj->malloc2d = gc_malloc2d;
 	tobj->free2d = gc_free2d;
+	tobj->malloc2d_ex = gc_malloc2d_ex;
+	tobj->lookup2d = gc_lookup2d;
 	gc_prv_p->sp = calloc(gc_prv_p->sp_top + 1, sizeof(void *));
-	if (gc_prv_p->sp == NULL) {
+	gc_prv_p->sp_gen = calloc(gc_prv_p->sp_top + 1, sizeof(uint16_t));
+	if (gc_prv_p->sp == NULL || gc_prv_p->sp_gen == NULL) {
+		free(gc_prv_p->sp);
+		free(gc_prv_p->sp_gen);
 		free(gc_prv_p);
 		free(tobj);
 		return NULL;
 	}
+	if (gc_prv_p->flags & GC_F_ARENA) {
+		gc_prv_p->arena = gc_arena_new(attr->arena_chunk);
+		if (gc_prv_p->arena == NULL) {
+			free(gc_prv_p->sp);
+			free(gc_prv_p->sp_gen);
+			free(gc_prv_p);
+			free(tobj);
+			return NULL;
+		}
+		tobj->memalloc = gc_arena_malloc;
+		tobj->memfree = gc_arena_free;
+		tobj->memrealloc = gc_arena_realloc;
+		tobj->memcalloc = gc_arena_calloc;
+		tobj->memalign = gc_arena_memalign;
+	} else if (gc_prv_p->flags & GC_F_SLAB) {
+		gc_prv_p->slab = gc_slab_new();
+		if (gc_prv_p->slab == NULL) {
+			free(gc_prv_p->sp);
+			free(gc_prv_p->sp_gen);
+			free(gc_prv_p);
+			free(tobj);
+			return NULL;
+		}
+	}
 	gc_pool_add(tobj);
+	if (attr != NULL && attr->parent != NULL) {
+		gc_set_parent(tobj, attr->parent);
+	}
 	return tobj;
 }
 
+__attribute__ ((visibility ("default")))
+gcobj_t *gc_objnew(void)
+{
+	return gc_objnew_ex(NULL);
+}
+
+static void gc_objdel_one(gcobj_private_t *gc_prv_p)
+{
+	gcobj_t *this = gc_prv_p->gc;
+
+	gc_pool_del(this);
+	gc_prv_p->gc = NULL;
+	free(this);
+	if (gc_reclaim_wanted(gc_prv_p)) {
+		gc_reclaim_push(gc_prv_p);
+	} else {
+		gc_obj_release(gc_prv_p);
+	}
+}
+
+/* Deletes the gc and all of its descendants, see gc_set_parent */
 __attribute__ ((visibility ("default")))
 void gc_objdel(gcobj_t *this)
 {
-	int i;
 	gcobj_private_t *gc_prv_p;
+	gcobj_private_t *desc_p;
+	gcobj_private_t *next_p;
 
+	GC_ATRACE(GC_ATRACE_RESET, this, NULL, 0);
 	gc_prv_p = (gcobj_private_t *) this->private_p;
-	for (i = 0; i < gc_prv_p->sp_index; i++) {
-		if (gc_prv_p->sp[i] != NULL) {
-			free(gc_prv_p->sp[i]);
-			gc_prv_p->sp[i] = NULL;
-		}
+	desc_p = gc_tree_detach(gc_prv_p);
+	gc_objdel_one(gc_prv_p);
+	for (; desc_p != NULL; desc_p = next_p) {
+		next_p = desc_p->tree_next;
+		GC_ATRACE(GC_ATRACE_RESET, desc_p->gc, NULL, 0);
+		gc_objdel_one(desc_p);
 	}
-	gc_pool_del(this);
+}
+
+/* Frees everything of an object already out of the registry */
+void gc_obj_release(gcobj_private_t *gc_prv_p)
+{
+	gc_slots_release(gc_prv_p, 1);
+	gc_slab_del(gc_prv_p->slab);
+	gc_arena_del(gc_prv_p->arena);
+	gc_trace_del(gc_prv_p->trace);
 	free(gc_prv_p->sp);
+	free(gc_prv_p->sp_gen);
+	free(gc_prv_p->sp_tag);
+	free(gc_prv_p->intern);
 	free(gc_prv_p);
-	free(this);
 }
 
-static void *gc_malloc(void *this, size_t memsize)
+/*
+ * Frees everything the object owns but keeps the object itself, so a
+ * per-frame gc can be reused. An arena keeps one chunk around.
+ */
+__attribute__ ((visibility ("default")))
+void gc_objreset(gcobj_t *this)
+{
+	gcobj_private_t *gc_prv_p;
+
+	if (this == NULL) {
+		return;
+	}
+	GC_ATRACE(GC_ATRACE_RESET, this, NULL, 0);
+	gc_prv_p = (gcobj_private_t *) this->private_p;
+	gc_slots_release(gc_prv_p, 0);
+	if (gc_prv_p->trace != NULL) {
+		gc_trace_abort(gc_prv_p);
+	}
+	if (gc_prv_p->arena != NULL) {
+		gc_arena_reset(gc_prv_p->arena);
+	}
+}
+
+/* zero asks for a cleared payload, large libc blocks get it from calloc */
+static void *gc_mem_alloc(void *this, size_t memsize, int zero)
 {
 	void *memres = NULL;
-	void *tempmemp = NULL;
+	uint8_t page_shift;
+	const gc_backend_t *backend;
 	gc_mem_t	*gc_mem = NULL;
-	int i;
 	gcobj_t *this_p = (gcobj_t *)this;
 	gcobj_private_t *gc_prv_p;
 
@@ -200,165 +610,867 @@ static void *gc_malloc(void *this, size_t memsize)
 
 	gc_prv_p = (gcobj_private_t *) this_p->private_p;
 
-	gc_mem = malloc(memsize + sizeof(gc_mem_t));
-	if (gc_mem == NULL) {
+	if (gc_account_charge(gc_prv_p, memsize) < 0) {
 		return NULL;
 	}
-	gc_mem->size = memsize;
-	gc_mem->mem_type = GC_MEM_SYSTEM;
-	memres = gc_mem + 1;
-	gc_mem->d_ptr = memres;
-	for (i = 0; i < gc_prv_p->sp_index; i++) {
-		if (gc_prv_p->sp[i] == NULL) {
-			gc_prv_p->sp[i] = gc_mem;
-			gc_prv_p->memused += memsize;
-			gc_mem->index = i;
-			return memres;
+	if ((gc_prv_p->flags & GC_F_TCACHE) && gc_tcache_fits(memsize + sizeof(gc_mem_t))) {
+		gc_mem = gc_tcache_alloc(memsize + sizeof(gc_mem_t));
+		if (gc_mem == NULL) {
+			gc_account_uncharge(gc_prv_p, memsize);
+			return NULL;
 		}
-	}
-
-	if (gc_prv_p->sp_index > gc_prv_p->sp_top) {
-		tempmemp = realloc(gc_prv_p->sp, (gc_prv_p->sp_top + 1 + 20) * sizeof(void *));
-		if (tempmemp == NULL) {
-			free(gc_mem);
+		gc_mem->mem_type = GC_MEM_TCACHE;
+		if (zero) {
+			memset(gc_mem + 1, 0, memsize);
+		}
+	} else if (gc_prv_p->slab != NULL && gc_slab_fits(memsize + sizeof(gc_mem_t))) {
+		gc_mem = gc_slab_alloc(gc_prv_p->slab, memsize + sizeof(gc_mem_t));
+		if (gc_mem == NULL) {
+			gc_account_uncharge(gc_prv_p, memsize);
+			return NULL;
+		}
+		gc_mem->mem_type = GC_MEM_SLAB;
+		if (zero) {
+			memset(gc_mem + 1, 0, memsize);
+		}
+	} else if (gc_mmap_fits(memsize + sizeof(gc_mem_t))) {
+		/* Fresh mappings are already zeroed */
+		gc_mem = gc_mmap_alloc(memsize + sizeof(gc_mem_t), &page_shift);
+		if (gc_mem == NULL) {
+			gc_account_uncharge(gc_prv_p, memsize);
+			return NULL;
+		}
+		gc_mem->mem_type = GC_MEM_MMAP;
+		gc_mem->aux = page_shift;
+	} else if (zero && gc_prv_p->backend == 0) {
+		gc_mem = calloc(1, memsize + sizeof(gc_mem_t));
+		if (gc_mem == NULL) {
+			gc_account_uncharge(gc_prv_p, memsize);
+			return NULL;
+		}
+		gc_mem->mem_type = GC_MEM_SYSTEM;
+		gc_mem->aux = 0;
+	} else {
+		backend = gc_backend_get(gc_prv_p->backend);
+		gc_mem = backend->alloc(backend->ctx, memsize + sizeof(gc_mem_t));
+		if (gc_mem == NULL) {
+			gc_account_uncharge(gc_prv_p, memsize);
 			return NULL;
 		}
-		gc_prv_p->sp = tempmemp;
-		memset(&gc_prv_p->sp[gc_prv_p->sp_top + 1], 0, 20 * sizeof(void *));
-		gc_prv_p->sp_top += 20;
+		gc_mem->mem_type = GC_MEM_SYSTEM;
+		gc_mem->aux = gc_prv_p->backend;
+		if (zero) {
+			memset(gc_mem + 1, 0, memsize);
+		}
+	}
+	gc_mem->size = memsize;
+	memres = gc_mem + 1;
+	if (gc_slot_get(gc_prv_p, gc_mem) < 0) {
+		gc_mem_release(gc_prv_p, gc_mem);
+		gc_account_uncharge(gc_prv_p, memsize);
+		return NULL;
 	}
-	gc_prv_p->sp[gc_prv_p->sp_index] = gc_mem;
-	gc_prv_p->memused += memsize;
-	gc_mem->index = gc_prv_p->sp_index;
-	gc_prv_p->sp_index++;
 	return memres;
 }
 
-static void gc_free(void *this, void *memp)
-{
-	int i;
-	gcobj_t *this_p = (gcobj_t *)this;
-	gc_mem_t	*gc_mem = NULL;
-	gcobj_private_t *gc_prv_p;
+static void gc_mem_free(void *this, void *memp);
 
-	gc_prv_p = (gcobj_private_t *) this_p->private_p;
+static void *gc_malloc(void *this, size_t memsize)
+{
+	void *memres;
 
-	gc_mem = (gc_mem_t *)memp;
-	gc_mem--;
-	i = gc_mem->index;
-	if (gc_prv_p->sp[i] != NULL) {
-		gc_prv_p->memused -= gc_mem->size;
-		free(gc_prv_p->sp[i]);
-		gc_prv_p->sp[i] = NULL;
+	memres = gc_mem_alloc(this, memsize, 0);
+	if (memres != NULL) {
+		GC_ATRACE(GC_ATRACE_ALLOC, this, memres, memsize);
 	}
+	return memres;
 }
 
-static char *gc_strdup(void *this, const char *str_p)
+static void *gc_calloc(void *this, size_t count, size_t memsize)
 {
-	char *str_rp = NULL;
-	int str_len;
+	void *memres;
 
-	if (str_p == NULL) {
+	if (memsize != 0 && count > SIZE_MAX / memsize) {
 		return NULL;
 	}
-	str_len = strlen(str_p) + 1;
-	str_rp = gc_malloc(this, str_len);
-	if (str_rp) {
-		memcpy(str_rp, str_p, str_len);
+	memres = gc_mem_alloc(this, count * memsize, 1);
+	if (memres != NULL) {
+		GC_ATRACE(GC_ATRACE_ALLOC, this, memres, count * memsize);
 	}
-	return str_rp;
+	return memres;
 }
 
-__attribute__ ((visibility ("default")))
-void gc_register_alloc2d(gc_alloc2d_f alloc2d_cb)
+/*
+ * Blocks aligned beyond the malloc alignment sit align bytes into their
+ * allocation, with the header in the gap.
+ */
+static void *gc_mem_alloc_aligned(void *this, size_t align, size_t memsize)
 {
-	if (alloc2d_cb == NULL) {
-		alloc2d_cb_p = gc_alloc2d_dummy;
-	} else {
-		alloc2d_cb_p = alloc2d_cb;
+	void *base = NULL;
+	gc_mem_t	*gc_mem = NULL;
+	gcobj_t *this_p = (gcobj_t *)this;
+	gcobj_private_t *gc_prv_p;
+
+	if (this_p == NULL || align == 0 || (align & (align - 1))) {
+		return NULL;
 	}
+	if (align <= sizeof(gc_mem_t)) {
+		return gc_mem_alloc(this, memsize, 0);
+	}
+
+	gc_prv_p = (gcobj_private_t *) this_p->private_p;
+
+	if (gc_account_charge(gc_prv_p, memsize) < 0) {
+		return NULL;
+	}
+	if (posix_memalign(&base, align, align + memsize) != 0) {
+		gc_account_uncharge(gc_prv_p, memsize);
+		return NULL;
+	}
+	gc_mem = (gc_mem_t *)((uint8_t *)base + align) - 1;
+	gc_mem->mem_type = GC_MEM_ALIGNED;
+	gc_mem->aux = __builtin_ctzl(align);
+	gc_mem->size = memsize;
+	if (gc_slot_get(gc_prv_p, gc_mem) < 0) {
+		free(base);
+		gc_account_uncharge(gc_prv_p, memsize);
+		return NULL;
+	}
+	return gc_mem + 1;
 }
 
-__attribute__ ((visibility ("default")))
-void gc_register_free2d(gc_free2d_f free2d_cb)
+static void *gc_memalign(void *this, size_t align, size_t memsize)
 {
-	if (free2d_cb == NULL) {
-		free2d_cb_p = gc_free2d_dummy;
-	} else {
-		free2d_cb_p = free2d_cb;
+	void *memres;
+
+	memres = gc_mem_alloc_aligned(this, align, memsize);
+	if (memres != NULL) {
+		GC_ATRACE(GC_ATRACE_ALLOC, this, memres, memsize);
 	}
+	return memres;
 }
 
-static int gc_malloc2d(void *this, int w, int h)
+/*
+ * System blocks are resized by their backend, which may grow them in
+ * place, and keep their slot. Other blocks are moved to a new one.
+ */
+static void *gc_mem_realloc(void *this, void *memp, size_t memsize)
 {
-	void *tempmemp = NULL;
+	void *memres = NULL;
 	gc_mem_t	*gc_mem = NULL;
-	int i;
 	gcobj_t *this_p = (gcobj_t *)this;
 	gcobj_private_t *gc_prv_p;
+	const gc_backend_t *backend;
+	gc_mem_t *gc_new;
+	uint64_t old_size;
+	uint32_t i;
 
 	if (this_p == NULL) {
-		return -1;
+		return NULL;
+	}
+	if (memp == NULL) {
+		return gc_mem_alloc(this, memsize, 0);
 	}
 
 	gc_prv_p = (gcobj_private_t *) this_p->private_p;
 
-	gc_mem = malloc(sizeof(gc_mem_t));
-	if (gc_mem == NULL) {
-		return -1;
-	}
-	gc_mem->size = w * h;
-	gc_mem->mem_type = GC_MEM_2D;
-	if (alloc2d_cb_p(w, h, &gc_mem->phys_ptr, &gc_mem->d_ptr) < 0) {
-		free(gc_mem);
-		return -1;
+	gc_mem = (gc_mem_t *)memp;
+	gc_mem--;
+	i = gc_mem->index;
+	if (i >= gc_prv_p->sp_index || gc_prv_p->sp[i] != gc_mem) {
+		EPRN("%p is not owned by gc %p\n", memp, this_p);
+		return NULL;
+	}
+	old_size = gc_mem->size;
+	if (__atomic_load_n(&gc_mem->refs, __ATOMIC_RELAXED) > 1) {
+		EPRN("%p is shared and can not move\n", memp);
+		return NULL;
 	}
 
-	for (i = 0; i < gc_prv_p->sp_index; i++) {
-		if (gc_prv_p->sp[i] == NULL) {
-			gc_prv_p->sp[i] = gc_mem;
-			gc_prv_p->memused += w * h;
-			gc_mem->index = i;
-			return i;
+	if (gc_mem->mem_type != GC_MEM_SYSTEM) {
+		memres = gc_mem_alloc(this, memsize, 0);
+		if (memres == NULL) {
+			return NULL;
+		}
+		memcpy(memres, memp, (old_size < memsize) ? old_size : memsize);
+		if (gc_prv_p->trace != NULL) {
+			gc_trace_move(gc_prv_p, i, ((gc_mem_t *)memres - 1)->index);
 		}
+		if (gc_prv_p->sp_tag != NULL) {
+			gc_prv_p->sp_tag[((gc_mem_t *)memres - 1)->index] = gc_prv_p->sp_tag[i];
+		}
+		gc_mem_free(this, memp);
+		return memres;
 	}
 
-	if (gc_prv_p->sp_index > gc_prv_p->sp_top) {
-		tempmemp = realloc(gc_prv_p->sp, (gc_prv_p->sp_top + 1 + 20) * sizeof(void *));
-		if (tempmemp == NULL) {
-			free2d_cb_p(gc_mem->phys_ptr);
-			free(gc_mem);
+	if (memsize > old_size && gc_account_charge(gc_prv_p, memsize - old_size) < 0) {
+		return NULL;
+	}
+	backend = gc_backend_get(gc_mem->aux);
+	if (memsize > old_size && backend->usable_size != NULL &&
+	    backend->usable_size(backend->ctx, gc_mem) >= memsize + sizeof(gc_mem_t)) {
+		/* Grows into the slack of the allocation */
+		gc_mem->size = memsize;
+		return memp;
+	}
+	if (backend->realloc != NULL) {
+		gc_mem = backend->realloc(backend->ctx, gc_mem, memsize + sizeof(gc_mem_t));
+	} else if (memsize > old_size) {
+		gc_new = backend->alloc(backend->ctx, memsize + sizeof(gc_mem_t));
+		if (gc_new != NULL) {
+			memcpy(gc_new, gc_mem, old_size + sizeof(gc_mem_t));
+			backend->free(backend->ctx, gc_mem);
+		}
+		gc_mem = gc_new;
+	}
+	if (gc_mem == NULL) {
+		if (memsize > old_size) {
+			gc_account_uncharge(gc_prv_p, memsize - old_size);
+		}
+		return NULL;
+	}
+	if (memsize < old_size) {
+		gc_account_uncharge(gc_prv_p, old_size - memsize);
+	}
+	gc_mem->size = memsize;
+	gc_prv_p->sp[i] = gc_mem;
+	return gc_mem + 1;
+}
+
+static void *gc_realloc(void *this, void *memp, size_t memsize)
+{
+	void *memres;
+
+	memres = gc_mem_realloc(this, memp, memsize);
+	if (memres != NULL) {
+		if (memp != NULL) {
+			GC_ATRACE(GC_ATRACE_FREE, this, memp, 0);
+		}
+		GC_ATRACE(GC_ATRACE_ALLOC, this, memres, memsize);
+	}
+	return memres;
+}
+
+static void gc_mem_free(void *this, void *memp)
+{
+	uint32_t i;
+	gcobj_t *this_p = (gcobj_t *)this;
+	gc_mem_t	*gc_mem = NULL;
+	gcobj_private_t *gc_prv_p;
+
+	gc_prv_p = (gcobj_private_t *) this_p->private_p;
+
+	gc_mem = (gc_mem_t *)memp;
+	gc_mem--;
+	i = gc_mem->index;
+	if (i < gc_prv_p->sp_index && gc_prv_p->sp[i] == gc_mem) {
+		gc_slot_drop(gc_prv_p, i);
+	}
+}
+
+static void gc_free(void *this, void *memp)
+{
+	GC_ATRACE(GC_ATRACE_FREE, this, memp, 0);
+	gc_mem_free(this, memp);
+}
+
+/* Frees the block in slot i, or only lets go of it when it is shared */
+void gc_slot_drop(gcobj_private_t *gc_prv_p, uint32_t i)
+{
+	gc_mem_t *gc_mem = gc_prv_p->sp[i];
+
+	gc_slot_put(gc_prv_p, i);
+	if (gc_mem_disown(gc_prv_p, gc_mem)) {
+		gc_account_uncharge(gc_prv_p, gc_mem->size);
+		gc_mem_release(gc_prv_p, gc_mem);
+	}
+}
+
+static void *gc_arena_mem_alloc(void *this, size_t memsize)
+{
+	void *memres = NULL;
+	gcobj_t *this_p = (gcobj_t *)this;
+	gcobj_private_t *gc_prv_p;
+
+	if (this_p == NULL) {
+		return NULL;
+	}
+
+	gc_prv_p = (gcobj_private_t *) this_p->private_p;
+
+	if (gc_account_charge(gc_prv_p, memsize) < 0) {
+		return NULL;
+	}
+	memres = gc_arena_alloc(gc_prv_p->arena, memsize);
+	if (memres == NULL) {
+		gc_account_uncharge(gc_prv_p, memsize);
+		return NULL;
+	}
+	gc_stats_alloc(gc_prv_p, memsize, 0);
+	return memres;
+}
+
+static void *gc_arena_malloc(void *this, size_t memsize)
+{
+	void *memres;
+
+	memres = gc_arena_mem_alloc(this, memsize);
+	if (memres != NULL) {
+		GC_ATRACE(GC_ATRACE_ALLOC, this, memres, memsize);
+	}
+	return memres;
+}
+
+static void gc_arena_free(void *this, void *memp)
+{
+	/* Arena memory is only released by gc_objreset/gc_objdel */
+}
+
+static void *gc_arena_realloc(void *this, void *memp, size_t memsize)
+{
+	void *memres;
+
+	/* The arena keeps no block sizes, so there is nothing to copy from */
+	if (memp != NULL) {
+		EPRN("memrealloc is not supported on an arena gc\n");
+		return NULL;
+	}
+	memres = gc_arena_mem_alloc(this, memsize);
+	if (memres != NULL) {
+		GC_ATRACE(GC_ATRACE_ALLOC, this, memres, memsize);
+	}
+	return memres;
+}
+
+static void *gc_arena_calloc(void *this, size_t count, size_t memsize)
+{
+	void *memres = NULL;
+
+	if (memsize != 0 && count > SIZE_MAX / memsize) {
+		return NULL;
+	}
+	memres = gc_arena_mem_alloc(this, count * memsize);
+	if (memres != NULL) {
+		memset(memres, 0, count * memsize);
+		GC_ATRACE(GC_ATRACE_ALLOC, this, memres, count * memsize);
+	}
+	return memres;
+}
+
+static void *gc_arena_memalign(void *this, size_t align, size_t memsize)
+{
+	uint8_t *memres = NULL;
+
+	if (align == 0 || (align & (align - 1))) {
+		return NULL;
+	}
+	memres = gc_arena_mem_alloc(this, memsize + align - 1);
+	if (memres == NULL) {
+		return NULL;
+	}
+	memres = (uint8_t *)(((uintptr_t)memres + align - 1) & ~((uintptr_t)align - 1));
+	GC_ATRACE(GC_ATRACE_ALLOC, this, memres, memsize);
+	return memres;
+}
+
+static char *gc_strdup(void *this, const char *str_p)
+{
+	char *str_rp = NULL;
+	gcobj_t *this_p = (gcobj_t *)this;
+	int str_len;
+
+	if (str_p == NULL) {
+		return NULL;
+	}
+	if (((gcobj_private_t *) this_p->private_p)->flags & GC_F_INTERN) {
+		/* Shared and read-only, memfree leaves it alone */
+		return (char *)gc_intern(this_p, str_p);
+	}
+	str_len = strlen(str_p) + 1;
+	str_rp = this_p->memalloc(this_p, str_len);
+	if (str_rp) {
+		memcpy(str_rp, str_p, str_len);
+	}
+	return str_rp;
+}
+
+__attribute__ ((visibility ("default")))
+void gc_register_alloc2d(gc_alloc2d_f alloc2d_cb)
+{
+	if (alloc2d_cb == NULL) {
+		alloc2d_cb_p = gc_alloc2d_dummy;
+	} else {
+		alloc2d_cb_p = alloc2d_cb;
+	}
+}
+
+__attribute__ ((visibility ("default")))
+void gc_register_free2d(gc_free2d_f free2d_cb)
+{
+	/* Cached surfaces belong to the backend being replaced */
+	gc_surface_pool_trim(0);
+	if (free2d_cb == NULL) {
+		free2d_cb_p = gc_free2d_dummy;
+	} else {
+		free2d_cb_p = free2d_cb;
+	}
+}
+
+__attribute__ ((visibility ("default")))
+void gc_register_alloc2d_ex(gc_alloc2d_ex_f alloc2d_ex_cb)
+{
+	alloc2d_ex_cb_p = alloc2d_ex_cb;
+}
+
+/* Fills bpp, stride and size of desc from fmt, w, h, the alignments and layout */
+__attribute__ ((visibility ("default")))
+int gc_surface_layout(gc_surface_desc_t *desc)
+{
+	uint64_t row;
+	uint32_t row_align;
+	uint32_t t;
+
+	if (desc->w <= 0 || desc->h <= 0 || desc->fmt < 0 || desc->fmt >= GC_FMT_COUNT ||
+	    desc->layout >= GC_LAYOUT_COUNT) {
+		return -1;
+	}
+	if ((desc->row_align & (desc->row_align - 1)) != 0 ||
+	    (desc->base_align & (desc->base_align - 1)) != 0) {
+		EPRN("Alignment must be a power of two (row %u, base %u)\n",
+		     desc->row_align, desc->base_align);
+		return -1;
+	}
+	if (desc->bpp <= 0) {
+		desc->bpp = gc_pixfmt_bpp[desc->fmt];
+	}
+	if (desc->layout != GC_LAYOUT_LINEAR) {
+		t = gc_layout_tile(desc->layout);
+		row = (uint64_t)((desc->w + t - 1) / t) * t * t * desc->bpp;
+		if (row > UINT32_MAX) {
 			return -1;
 		}
-		gc_prv_p->sp = tempmemp;
-		memset(&gc_prv_p->sp[gc_prv_p->sp_top + 1], 0, 20 * sizeof(void *));
-		gc_prv_p->sp_top += 20;
+		desc->stride = row;
+		desc->size = row * gc_surface_rows(desc);
+		return 0;
+	}
+	row_align = desc->row_align ? desc->row_align : 1;
+	row = ((uint64_t)desc->w * desc->bpp + row_align - 1) & ~((uint64_t)row_align - 1);
+	if (row > UINT32_MAX) {
+		return -1;
+	}
+	desc->stride = row;
+	desc->size = row * desc->h;
+	return 0;
+}
+
+void gc_backend_free2d(void *phys_ptr)
+{
+	free2d_cb_p(phys_ptr);
+}
+
+/*
+ * Surfaces come from the pool first and go back to it when it has room.
+ * Without a descriptor aware backend the legacy one gets stride x rows bytes
+ * and the base alignment can only be checked afterwards.
+ */
+static int gc_surface_acquire(gc_surface_desc_t *desc)
+{
+	uintptr_t mask;
+
+	if (gc_surface_pool_get(desc) == 0) {
+		return 0;
+	}
+	if (alloc2d_ex_cb_p != NULL) {
+		return alloc2d_ex_cb_p(desc);
+	}
+	if (alloc2d_cb_p(desc->stride, gc_surface_rows(desc), &desc->phys_ptr, &desc->d_ptr) < 0) {
+		return -1;
+	}
+	mask = desc->base_align ? desc->base_align - 1 : 0;
+	if (((uintptr_t)desc->d_ptr & mask) || ((uintptr_t)desc->phys_ptr & mask)) {
+		EPRN("ALLOC2D returned %p, not aligned to %u\n", desc->d_ptr, desc->base_align);
+		free2d_cb_p(desc->phys_ptr);
+		return -1;
+	}
+	return 0;
+}
+
+static void gc_surface_release(gc_mem2d_t *gc_mem2d)
+{
+	if (gc_mem2d->flags & GC_MEM2D_F_IMPORTED) {
+		gc_memfd_free2d(gc_mem2d->desc.phys_ptr);
+		return;
+	}
+	if (gc_surface_pool_put(&gc_mem2d->desc) < 0) {
+		free2d_cb_p(gc_mem2d->desc.phys_ptr);
+	}
+}
+
+static int gc_malloc2d_ex(void *this, gc_surface_desc_t *desc)
+{
+	gc_mem2d_t	*gc_mem2d = NULL;
+	gc_mem_t	*gc_mem = NULL;
+	gcobj_t *this_p = (gcobj_t *)this;
+	gcobj_private_t *gc_prv_p;
+
+	if (this_p == NULL || desc == NULL) {
+		return -1;
+	}
+
+	gc_prv_p = (gcobj_private_t *) this_p->private_p;
+
+	if (gc_surface_layout(desc) < 0) {
+		return -1;
+	}
+	if (gc_account_charge(gc_prv_p, desc->size) < 0) {
+		return -1;
+	}
+	gc_mem2d = malloc(sizeof(gc_mem2d_t));
+	if (gc_mem2d == NULL) {
+		gc_account_uncharge(gc_prv_p, desc->size);
+		return -1;
+	}
+	if (gc_surface_acquire(desc) < 0) {
+		free(gc_mem2d);
+		gc_account_uncharge(gc_prv_p, desc->size);
+		return -1;
+	}
+	gc_mem2d->desc = *desc;
+	gc_mem2d->flags = 0;
+	gc_mem2d->pins = 0;
+	gc_mem = &gc_mem2d->mem;
+	gc_mem->size = desc->size;
+	gc_mem->mem_type = GC_MEM_2D;
+
+	if (gc_slot_get_2d(gc_prv_p, gc_mem) < 0) {
+		gc_surface_release(gc_mem2d);
+		free(gc_mem2d);
+		gc_account_uncharge(gc_prv_p, desc->size);
+		return -1;
+	}
+
+	return GC_HANDLE(gc_mem->index, gc_prv_p->sp_gen[gc_mem->index]);
+}
+
+/* O(1) handle check, NULL for stale, foreign or non 2D handles */
+static gc_mem2d_t *gc_handle_resolve(gcobj_private_t *gc_prv_p, int id)
+{
+	uint32_t slot = GC_HANDLE_SLOT(id);
+	gc_mem_t *gc_mem;
+
+	if (id < 0 || slot >= gc_prv_p->sp_index) {
+		return NULL;
+	}
+	gc_mem = gc_prv_p->sp[slot];
+	if (!GC_SLOT_USED(gc_mem) || gc_mem->mem_type != GC_MEM_2D ||
+	    (gc_prv_p->sp_gen[slot] & GC_HANDLE_GEN_MASK) != GC_HANDLE_GEN(id)) {
+		return NULL;
+	}
+	return (gc_mem2d_t *)gc_mem;
+}
+
+static const gc_surface_desc_t *gc_lookup2d(void *this, int id)
+{
+	gcobj_t *this_p = (gcobj_t *)this;
+	gc_mem2d_t *gc_mem2d;
+
+	if (this_p == NULL) {
+		return NULL;
+	}
+	gc_mem2d = gc_handle_resolve((gcobj_private_t *) this_p->private_p, id);
+	return (gc_mem2d != NULL) ? &gc_mem2d->desc : NULL;
+}
+
+/*
+ * Hands out a new memfd for a surface of a memfd backed gc, together with
+ * its descriptor, to be passed to gc_import2d in another process.
+ */
+__attribute__ ((visibility ("default")))
+int gc_export2d(gcobj_t *this, int id, gc_surface_desc_t *desc)
+{
+	gc_mem2d_t *gc_mem2d;
+	int fd;
+
+	if (this == NULL || desc == NULL) {
+		return -1;
+	}
+	gc_mem2d = gc_handle_resolve((gcobj_private_t *) this->private_p, id);
+	if (gc_mem2d == NULL) {
+		return -1;
+	}
+	fd = gc_memfd_export(gc_mem2d->desc.d_ptr);
+	if (fd < 0) {
+		EPRN("2D surface %d is not memfd backed\n", id);
+		return -1;
+	}
+	*desc = gc_mem2d->desc;
+	return fd;
+}
+
+/*
+ * Maps an exported surface into this gc. The fd is duplicated, so the
+ * caller keeps ownership of its copy. Returns the new 2D id.
+ */
+__attribute__ ((visibility ("default")))
+int gc_import2d(gcobj_t *this, int fd, gc_surface_desc_t *desc)
+{
+	gc_surface_desc_t check;
+	gc_mem2d_t *gc_mem2d;
+	gc_mem_t *gc_mem;
+	gcobj_private_t *gc_prv_p;
+
+	if (this == NULL || desc == NULL) {
+		return -1;
+	}
+	gc_prv_p = (gcobj_private_t *) this->private_p;
+	/* From another process: the layout it claims has to be the one we compute */
+	check = *desc;
+	if (desc->bpp <= 0 || gc_surface_layout(&check) < 0 ||
+	    check.stride != desc->stride || check.size > desc->size) {
+		EPRN("Bad descriptor: %dx%d bpp %d stride %u, %zu B\n", desc->w, desc->h,
+		     desc->bpp, desc->stride, desc->size);
+		return -1;
+	}
+	if (gc_account_charge(gc_prv_p, desc->size) < 0) {
+		return -1;
+	}
+	gc_mem2d = malloc(sizeof(gc_mem2d_t));
+	if (gc_mem2d == NULL) {
+		gc_account_uncharge(gc_prv_p, desc->size);
+		return -1;
+	}
+	if (gc_memfd_import(fd, desc) < 0) {
+		free(gc_mem2d);
+		gc_account_uncharge(gc_prv_p, desc->size);
+		return -1;
+	}
+	gc_mem2d->desc = *desc;
+	gc_mem2d->flags = GC_MEM2D_F_IMPORTED;
+	gc_mem2d->pins = 0;
+	gc_mem = &gc_mem2d->mem;
+	gc_mem->size = desc->size;
+	gc_mem->mem_type = GC_MEM_2D;
+
+	if (gc_slot_get_2d(gc_prv_p, gc_mem) < 0) {
+		gc_surface_release(gc_mem2d);
+		free(gc_mem2d);
+		gc_account_uncharge(gc_prv_p, desc->size);
+		return -1;
 	}
-	gc_prv_p->sp[gc_prv_p->sp_index] = gc_mem;
-	gc_prv_p->memused += w * h;
-	gc_mem->index = gc_prv_p->sp_index;
-	gc_prv_p->sp_index++;
 
-	return gc_mem->index;
+	return GC_HANDLE(gc_mem->index, gc_prv_p->sp_gen[gc_mem->index]);
+}
+
+static int gc_malloc2d(void *this, int w, int h)
+{
+	gc_surface_desc_t desc = {
+		.fmt = GC_FMT_NONE,
+		.w = w,
+		.h = h,
+	};
+
+	return gc_malloc2d_ex(this, &desc);
 }
 
 static void gc_free2d(void *this, int id)
 {
 	gcobj_t *this_p = (gcobj_t *)this;
-	gc_mem_t	*gc_mem = NULL;
+	gc_mem2d_t	*gc_mem2d = NULL;
 	gcobj_private_t *gc_prv_p;
 
 	gc_prv_p = (gcobj_private_t *) this_p->private_p;
 
-	if (gc_prv_p->sp[id] != NULL) {
-		gc_mem = gc_prv_p->sp[id];
-		gc_prv_p->memused -= gc_mem->size;
-		free(gc_prv_p->sp[id]);
-		gc_prv_p->sp[id] = NULL;
-		free2d_cb_p(gc_mem->phys_ptr);
+	gc_mem2d = gc_handle_resolve(gc_prv_p, id);
+	if (gc_mem2d == NULL) {
+		EPRN("Stale or invalid 2D handle %#x\n", id);
+		return;
+	}
+	gc_slot_put(gc_prv_p, gc_mem2d->mem.index);
+	if (gc_mem_disown(gc_prv_p, &gc_mem2d->mem)) {
+		gc_account_uncharge(gc_prv_p, gc_mem2d->mem.size);
+		gc_surface_release(gc_mem2d);
+		free(gc_mem2d);
 	}
 }
 
+static int gc_mem_ref(gc_mem_t *gc_mem)
+{
+	uint16_t refs;
+
+	refs = __atomic_load_n(&gc_mem->refs, __ATOMIC_RELAXED);
+	do {
+		if (refs == 0 || refs == UINT16_MAX) {
+			EPRN("Can not take a reference on a block with %u\n", refs);
+			return -1;
+		}
+	} while (!__atomic_compare_exchange_n(&gc_mem->refs, &refs, refs + 1, 1,
+					      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return 0;
+}
+
+/*
+ * Keeps a block alive past memfree or the end of its gc. Every retain
+ * needs a gc_release, the last reference frees the block. Slab and
+ * arena blocks live and die with their gc and can not be retained.
+ * Interned strings can, gc_release then drops the table reference.
+ */
+__attribute__ ((visibility ("default")))
+void *gc_retain(void *memptr)
+{
+	gc_mem_t *gc_mem;
+
+	if (memptr == NULL) {
+		return NULL;
+	}
+	gc_mem = (gc_mem_t *)memptr - 1;
+	if (gc_mem->mem_type == GC_MEM_SLAB) {
+		EPRN("Slab block %p can not be shared\n", memptr);
+		return NULL;
+	}
+	if (gc_mem->mem_type == GC_MEM_INTERN) {
+		gc_intern_retain(memptr);
+		return memptr;
+	}
+	if (gc_mem_ref(gc_mem) < 0) {
+		return NULL;
+	}
+	return memptr;
+}
+
+__attribute__ ((visibility ("default")))
+void gc_release(void *memptr)
+{
+	gc_mem_t *gc_mem;
+	uint64_t size;
+
+	if (memptr == NULL) {
+		return;
+	}
+	gc_mem = (gc_mem_t *)memptr - 1;
+	if (gc_mem->mem_type == GC_MEM_INTERN) {
+		gc_intern_release(memptr);
+		return;
+	}
+	size = gc_mem->size;
+	if (__atomic_sub_fetch(&gc_mem->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		gc_account_uncharge(NULL, size);
+		gc_mem_release(NULL, gc_mem);
+	}
+}
+
+/*
+ * Same for 2D surfaces. The descriptor stays valid until the matching
+ * gc_release2d, whatever happens to the handle.
+ */
+__attribute__ ((visibility ("default")))
+const gc_surface_desc_t *gc_retain2d(gcobj_t *this, int id)
+{
+	gc_mem2d_t *gc_mem2d;
+
+	if (this == NULL) {
+		return NULL;
+	}
+	gc_mem2d = gc_handle_resolve((gcobj_private_t *) this->private_p, id);
+	if (gc_mem2d == NULL || gc_mem_ref(&gc_mem2d->mem) < 0) {
+		return NULL;
+	}
+	return &gc_mem2d->desc;
+}
+
+/*
+ * Keeps a surface where it is while its pixels are accessed through
+ * d_ptr, gc_compact2d moves only unpinned ones. Pins nest.
+ */
+__attribute__ ((visibility ("default")))
+const gc_surface_desc_t *gc_pin2d(gcobj_t *this, int id)
+{
+	gc_mem2d_t *gc_mem2d;
+
+	if (this == NULL) {
+		return NULL;
+	}
+	gc_mem2d = gc_handle_resolve((gcobj_private_t *) this->private_p, id);
+	if (gc_mem2d == NULL) {
+		return NULL;
+	}
+	gc_region_pin(gc_mem2d, 1);
+	return &gc_mem2d->desc;
+}
+
+__attribute__ ((visibility ("default")))
+void gc_unpin2d(gcobj_t *this, int id)
+{
+	gc_mem2d_t *gc_mem2d;
+
+	if (this == NULL) {
+		return;
+	}
+	gc_mem2d = gc_handle_resolve((gcobj_private_t *) this->private_p, id);
+	if (gc_mem2d == NULL || __atomic_load_n(&gc_mem2d->pins, __ATOMIC_RELAXED) == 0) {
+		EPRN("2D handle %#x is not pinned\n", id);
+		return;
+	}
+	gc_region_pin(gc_mem2d, -1);
+}
+
+__attribute__ ((visibility ("default")))
+void gc_release2d(const gc_surface_desc_t *desc)
+{
+	gc_mem2d_t *gc_mem2d;
+
+	if (desc == NULL) {
+		return;
+	}
+	gc_mem2d = (gc_mem2d_t *)((uint8_t *)desc - offsetof(gc_mem2d_t, desc));
+	if (__atomic_sub_fetch(&gc_mem2d->mem.refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		gc_account_uncharge(NULL, gc_mem2d->mem.size);
+		gc_surface_release(gc_mem2d);
+		free(gc_mem2d);
+	}
+}
+
+static int gc_test_alloc2d(int w, int h, void **physical_addr_p, void **virtual_addr_p)
+{
+	*virtual_addr_p = malloc(w * h);
+	*physical_addr_p = *virtual_addr_p;
+	return (*virtual_addr_p != NULL) ? 0 : -1;
+}
+
+static int gc_test_alloc2d_ex(gc_surface_desc_t *desc)
+{
+	size_t align = desc->base_align ? desc->base_align : sizeof(void *);
+
+	if (posix_memalign(&desc->d_ptr, align, desc->size) != 0) {
+		return -1;
+	}
+	desc->phys_ptr = desc->d_ptr;
+	return 0;
+}
+
+typedef struct gc_test_node_s {
+	struct gc_test_node_s	*next;
+	char			*name;
+} gc_test_node_t;
+
+static void gc_test_trace(gcobj_t *gc, void *memptr)
+{
+	gc_test_node_t *node = memptr;
+
+	gc_mark(gc, node->next);
+	gc_mark(gc, node->name);
+}
+
+static void gc_test_pressure(uint32_t level, uint64_t used, uint64_t budget, void *arg)
+{
+	(*(uint32_t *)arg)++;
+}
+
+static int gc_test_free2d(void *physical_addr_p)
+{
+	free(physical_addr_p);
+	return 0;
+}
+
 int gc_test(void)
 {
 	gcobj_t *tobj = NULL;
@@ -394,6 +1506,551 @@ int gc_test(void)
 	gc_objdel(tobj);
 	gc_pool_dump();
 
+	tobj = gc_objnew_ex(&(gc_attr_t){ .flags = GC_F_SLAB, .capacity = 4002 });
+	for (i = 0; i < 4002; i++) {
+		tmem[i] = tobj->memalloc(tobj, (i % 16) * 64);
+	}
+	for (i = 0; i < 4002; i += 2) {
+		tobj->memfree(tobj, tmem[i]);
+	}
+	gc_pool_dump();
+	gc_objdel(tobj);
+
+	tobj = gc_objnew();
+	{
+		uint8_t *buf = NULL;
+		uint8_t *vec;
+		size_t n;
+
+		for (n = 16; n <= 64 * 1024; n *= 2) {
+			buf = tobj->memrealloc(tobj, buf, n);
+			buf[n - 1] = (uint8_t)n;
+		}
+		vec = tobj->memcalloc(tobj, 1024, 256);
+		tmem[0] = tobj->memalign(tobj, 64, 100);
+		IPRN("realloc %s, calloc %s, memalign %p\n",
+		     (buf[n / 2 - 1] == (uint8_t)(n / 2)) ? "kept data" : "FAILED",
+		     (vec != NULL && vec[1024 * 256 - 1] == 0) ? "zeroed" : "FAILED", tmem[0]);
+		tobj->memfree(tobj, tmem[0]);
+
+		buf = tobj->memcalloc(tobj, 4, 1024 * 1024);
+		IPRN("4 MiB block %s\n", (buf != NULL && buf[4 * 1024 * 1024 - 1] == 0 &&
+		     ((gc_mem_t *)buf - 1)->mem_type == GC_MEM_MMAP) ? "mapped" : "NOT MAPPED");
+		tobj->memfree(tobj, buf);
+	}
+	gc_pool_dump();
+	gc_objdel(tobj);
+
+	tobj = gc_objnew_ex(&(gc_attr_t){ .flags = GC_F_ARENA });
+	for (i = 0; i < 3; i++) {
+		int j;
+
+		for (j = 0; j < 4002; j++) {
+			tmem[j] = tobj->memalloc(tobj, (j % 16) * 64);
+		}
+		tobj->stringdup(tobj, "frame");
+		gc_pool_dump();
+		gc_objreset(tobj);
+	}
+	gc_objdel(tobj);
+
+	{
+		gc_alloc2d_f alloc2d_saved = alloc2d_cb_p;
+		gc_free2d_f free2d_saved = free2d_cb_p;
+		int id[4];
+		int j;
+
+		gc_register_alloc2d(gc_test_alloc2d);
+		gc_register_free2d(gc_test_free2d);
+		gc_surface_pool_setup(2, 4 * 640 * 480);
+		tobj = gc_objnew();
+		for (i = 0; i < 8; i++) {
+			for (j = 0; j < 4; j++) {
+				id[j] = tobj->malloc2d(tobj, 640, (j & 1) ? 480 : 240);
+			}
+			for (j = 0; j < 4; j++) {
+				tobj->free2d(tobj, id[j]);
+			}
+		}
+		gc_surface_pool_dump();
+
+		gc_register_alloc2d_ex(gc_test_alloc2d_ex);
+		{
+			gc_surface_desc_t desc = {
+				.fmt = GC_FMT_RGBA8888,
+				.w = 100,
+				.h = 10,
+				.row_align = 64,
+				.base_align = 4096,
+			};
+
+			id[0] = tobj->malloc2d_ex(tobj, &desc);
+			IPRN("2D id %d: %dx%d bpp %d stride %u size %zu at %p\n", id[0],
+			     desc.w, desc.h, desc.bpp, desc.stride, desc.size, desc.d_ptr);
+			tobj->free2d(tobj, id[0]);
+			id[1] = tobj->malloc2d_ex(tobj, &desc);
+			IPRN("2D id %#x reused as %#x, stale lookup %s\n", id[0], id[1],
+			     tobj->lookup2d(tobj, id[0]) == NULL ? "rejected" : "ACCEPTED");
+			tobj->free2d(tobj, id[0]);
+		}
+		{
+			gc_surface_desc_t desc = {
+				.fmt = GC_FMT_GRAY8,
+				.w = 64,
+				.h = 64,
+			};
+			const gc_surface_desc_t *shared;
+			gcobj_t *producer = gc_objnew();
+			char *blob;
+
+			blob = producer->stringdup(producer, "shared blob");
+			gc_retain(blob);
+			id[0] = producer->malloc2d_ex(producer, &desc);
+			shared = gc_retain2d(producer, id[0]);
+			((uint8_t *)shared->d_ptr)[0] = 0x5a;
+			gc_objdel(producer);
+			IPRN("after producer: \"%s\", %dx%d surface byte %#x\n", blob,
+			     shared->w, shared->h, ((uint8_t *)shared->d_ptr)[0]);
+			gc_release(blob);
+			gc_release2d(shared);
+		}
+		gc_register_alloc2d_ex(NULL);
+		gc_objdel(tobj);
+
+		gc_register_memfd2d();
+		tobj = gc_objnew();
+		{
+			gc_surface_desc_t desc = {
+				.fmt = GC_FMT_YUYV,
+				.w = 320,
+				.h = 240,
+			};
+			gc_surface_desc_t bad;
+			gcobj_t *peer = gc_objnew();
+			uint16_t *pix;
+			int fd;
+			int p[2];
+
+			id[0] = tobj->malloc2d_ex(tobj, &desc);
+			pix = desc.d_ptr;
+			pix[0] = 0xcafe;
+			fd = gc_export2d(tobj, id[0], &desc);
+			bad = desc;
+			bad.w *= 2;
+			if (gc_import2d(peer, fd, &bad) >= 0) {
+				EPRN("memfd: rows wider than the stride should be rejected\n");
+			}
+			id[1] = gc_import2d(peer, fd, &desc);
+			close(fd);
+			pix = desc.d_ptr;
+			IPRN("memfd 2D %d -> %d: %s\n", id[0], id[1],
+			     (id[1] >= 0 && pix[0] == 0xcafe) ? "shared" : "FAILED");
+			if (pipe(p) == 0) {
+				if (gc_import2d(peer, p[0], &desc) >= 0) {
+					EPRN("memfd: an unsealed fd should be rejected\n");
+				}
+				close(p[0]);
+				close(p[1]);
+			}
+			gc_objdel(peer);
+		}
+		gc_objdel(tobj);
+
+		/* Cached surfaces belong to the old backend */
+		gc_surface_pool_trim(0);
+		gc_register_mmap2d();
+		tobj = gc_objnew();
+		{
+			gc_surface_desc_t desc = {
+				.fmt = GC_FMT_RGBA8888,
+				.w = 1920,
+				.h = 1080,
+			};
+
+			id[0] = tobj->malloc2d_ex(tobj, &desc);
+			IPRN("mmap 2D %d: %zu B at %p\n", id[0], desc.size, desc.d_ptr);
+		}
+		gc_objdel(tobj);
+
+		gc_surface_pool_trim(0);
+		if (gc_register_region2d(16 * 65536) == 0) {
+			gc_surface_desc_t desc = {
+				.fmt = GC_FMT_GRAY8,
+				.w = 256,
+				.h = 256,
+			};
+			const gc_surface_desc_t *sd;
+			gc_compact_stats_t cstats;
+			int rid[16];
+
+			tobj = gc_objnew();
+			for (j = 0; j < 16; j++) {
+				rid[j] = tobj->malloc2d_ex(tobj, &desc);
+				((uint8_t *)desc.d_ptr)[0] = j;
+			}
+			/* Every other one goes, the top one is in use */
+			for (j = 0; j < 16; j += 2) {
+				tobj->free2d(tobj, rid[j]);
+			}
+			gc_pin2d(tobj, rid[15]);
+			desc.h = 512;
+			if (tobj->malloc2d_ex(tobj, &desc) >= 0) {
+				EPRN("region: a fragmented region should fail\n");
+			}
+			while ((j = gc_compact2d(10, &cstats)) == 0) {
+			}
+			IPRN("region: %d, moved %u surfaces, %llu B, largest free %llu -> %llu B\n", j,
+			     cstats.surfaces_moved, (unsigned long long)cstats.bytes_moved,
+			     (unsigned long long)cstats.largest_free_before,
+			     (unsigned long long)cstats.largest_free_after);
+			for (j = 1; j < 16; j += 2) {
+				sd = tobj->lookup2d(tobj, rid[j]);
+				if (sd == NULL || ((uint8_t *)sd->d_ptr)[0] != j) {
+					EPRN("region: surface %d lost its pixels\n", j);
+				}
+			}
+			if (cstats.largest_free_after < 8 * 65536 || tobj->malloc2d_ex(tobj, &desc) < 0) {
+				EPRN("region: compaction did not make room\n");
+			}
+			gc_unpin2d(tobj, rid[15]);
+			gc_objdel(tobj);
+		}
+		gc_register_alloc2d_ex(NULL);
+		gc_surface_pool_setup(0, 0);
+		gc_register_free2d(free2d_saved);
+		gc_register_alloc2d(alloc2d_saved);
+	}
+
+	{
+		uint32_t fired = 0;
+
+		tobj = gc_objnew_ex(&(gc_attr_t){ .budget = 1000 });
+		tmem[0] = tobj->memalloc(tobj, 600);
+		tmem[1] = tobj->memalloc(tobj, 600);
+		IPRN("gc budget: %s\n", (tmem[0] != NULL && tmem[1] == NULL) ? "enforced" : "FAILED");
+		gc_set_budget(tobj, 0);
+		gc_set_budget(NULL, gc_memused(NULL) + 4000);
+		gc_register_pressure(50, gc_test_pressure, &fired);
+		for (i = 0; i < 6; i++) {
+			tmem[i] = tobj->memalloc(tobj, 600);
+		}
+		IPRN("global budget: %llu B used, pressure fired %u\n",
+		     (unsigned long long)gc_memused(NULL), fired);
+		if (gc_unregister_pressure(gc_test_pressure, &fired) < 0) {
+			EPRN("pressure: the callback should unregister\n");
+		}
+		gc_set_budget(NULL, 0);
+		gc_objdel(tobj);
+	}
+
+	{
+		uint64_t before = gc_memused(NULL);
+
+		tobj = gc_objnew_ex(&(gc_attr_t){ .flags = GC_F_DEFERRED });
+		for (i = 0; i < 4002; i++) {
+			tmem[i] = tobj->memalloc(tobj, 100);
+		}
+		gc_objdel(tobj);
+		gc_set_deferred(1);
+		tobj = gc_objnew();
+		tobj->stringdup(tobj, "deferred");
+		gc_objdel(tobj);
+		gc_set_deferred(0);
+		gc_deferred_flush();
+		IPRN("deferred delete: %llu -> %llu B\n", (unsigned long long)before,
+		     (unsigned long long)gc_memused(NULL));
+	}
+
+	{
+		gc_test_node_t *head = NULL;
+		gc_test_node_t *node;
+		gc_collect_stats_t stats;
+		int type;
+
+		tobj = gc_objnew();
+		type = gc_trace_type(tobj, gc_test_trace);
+		gc_add_root(tobj, (void **)&head);
+		for (i = 0; i < 1000; i++) {
+			node = tobj->memalloc(tobj, sizeof(gc_test_node_t));
+			gc_set_type(tobj, node, type);
+			node->name = tobj->stringdup(tobj, "node");
+			node->next = head;
+			head = node;
+		}
+		for (node = head, i = 0; i < 499; i++) {
+			node = node->next;
+		}
+		node->next = NULL;
+		while (gc_collect_step(tobj, 50, &stats) == 0) {
+		}
+		IPRN("collected %u blocks (%llu B) in %u steps, %u live\n",
+		     stats.reclaimed_blocks, (unsigned long long)stats.reclaimed_bytes,
+		     stats.steps, stats.live_blocks);
+		gc_objdel(tobj);
+
+		/* A block memrealloc moves to another slot keeps its type */
+		tobj = gc_objnew_ex(&(gc_attr_t){ .flags = GC_F_SLAB });
+		type = gc_trace_type(tobj, gc_test_trace);
+		head = tobj->memcalloc(tobj, 1, sizeof(gc_test_node_t));
+		gc_set_type(tobj, head, type);
+		head->next = tobj->memcalloc(tobj, 1, sizeof(gc_test_node_t));
+		gc_add_root(tobj, (void **)&head);
+		head = tobj->memrealloc(tobj, head, 128);
+		gc_collect_step(tobj, 0, &stats);
+		if (stats.reclaimed_blocks != 0 || stats.live_blocks != 2) {
+			EPRN("collect: a moved block lost its children (%u reclaimed)\n",
+			     stats.reclaimed_blocks);
+		}
+		gc_objdel(tobj);
+	}
+
+	{
+		char *buf;
+		void *shared;
+
+		tobj = gc_objnew_ex(&(gc_attr_t){ .backend = gc_backend_pool() });
+		for (i = 0; i < 1000; i++) {
+			tmem[i] = tobj->memcalloc(tobj, 1, (i % 40) * 128);
+		}
+		buf = NULL;
+		for (i = 1; i <= 8192; i *= 2) {
+			buf = tobj->memrealloc(tobj, buf, i);
+			buf[i - 1] = 1;
+		}
+		shared = gc_retain(tobj->stringdup(tobj, "pool"));
+		gc_objdel(tobj);
+		IPRN("pool backend: %s outlived its gc\n", (char *)shared);
+		gc_release(shared);
+	}
+
+	{
+		gc_stats_t stats;
+		int fd;
+
+		tobj = gc_objnew();
+		for (i = 0; i < 100; i++) {
+			tmem[i] = tobj->memalloc(tobj, i * 10);
+		}
+		for (i = 0; i < 100; i += 2) {
+			tobj->memfree(tobj, tmem[i]);
+		}
+		gc_stats(tobj, &stats);
+		IPRN("stats: %llu allocs, %llu frees, %u live, %llu B, peak %llu B\n",
+		     (unsigned long long)stats.allocs, (unsigned long long)stats.frees,
+		     stats.live_blocks, (unsigned long long)stats.live_bytes,
+		     (unsigned long long)stats.peak_bytes);
+		if (stats.allocs - stats.frees != stats.live_blocks) {
+			EPRN("stats: live blocks do not add up\n");
+		}
+		fd = open("/dev/null", O_WRONLY);
+		if (fd >= 0) {
+			if (gc_stats_export(fd, GC_STATS_JSON) < 0 ||
+			    gc_stats_export(fd, GC_STATS_BINARY) < 0) {
+				EPRN("stats: export failed\n");
+			}
+			close(fd);
+		}
+		gc_objdel(tobj);
+	}
+
+	if (gc_atrace_start(0) == 0) {
+		gc_atrace_site_t top[2];
+
+		tobj = gc_objnew();
+		for (i = 0; i < 200; i++) {
+			tmem[i] = GC_AT(tobj->memalloc(tobj, 1000));
+		}
+		for (i = 0; i < 200; i++) {
+			tmem[i] = tobj->memrealloc(tobj, tmem[i], 10);
+		}
+		gc_atrace_stop();
+		if (gc_atrace_top(top, 2) != 2 || top[0].file != NULL ||
+		    top[0].live_bytes != 2000 || top[1].live_bytes != 0) {
+			EPRN("atrace: unexpected top sites\n");
+		}
+		gc_atrace_dump(2);
+		gc_objdel(tobj);
+
+		/* Nothing is rooted, the collector frees it all */
+		gc_atrace_start(0);
+		tobj = gc_objnew();
+		for (i = 0; i < 100; i++) {
+			tobj->memalloc(tobj, 100);
+		}
+		gc_collect_step(tobj, 0, NULL);
+		gc_atrace_stop();
+		if (gc_atrace_top(top, 1) > 0 && top[0].live_bytes != 0) {
+			EPRN("atrace: swept blocks should not stay live\n");
+		}
+		gc_objdel(tobj);
+	}
+
+	{
+		gc_snapshot_t *before;
+		gc_snapshot_t *after;
+		gc_snapshot_t *diff;
+		const gc_snap_block_t *blk;
+
+		tobj = gc_objnew();
+		for (i = 0; i < 100; i++) {
+			tmem[i] = tobj->memalloc(tobj, 64);
+		}
+		before = gc_snapshot_take(NULL);
+		/* One frame: everything freed but one tagged block */
+		for (i = 0; i < 100; i++) {
+			tobj->memfree(tobj, tmem[i]);
+			tmem[i] = tobj->memalloc(tobj, 64);
+		}
+		for (i = 1; i < 100; i++) {
+			tobj->memfree(tobj, tmem[i]);
+		}
+		gc_set_tag(tobj, tmem[0], 42);
+		after = gc_snapshot_take(NULL);
+		diff = gc_snapshot_diff(before, after);
+		if (diff == NULL || gc_snapshot_blocks(diff, NULL) != 1 ||
+		    gc_snapshot_bytes(diff) != 64) {
+			EPRN("snapshot: diff should hold the one leaked block\n");
+		}
+		if (diff != NULL) {
+			gc_snapshot_dump(diff, 4);
+		}
+		gc_snapshot_free(diff);
+		gc_snapshot_free(after);
+		gc_snapshot_free(before);
+		gc_objdel(tobj);
+
+		/* A new per-frame gc may get the address of the old one */
+		tobj = gc_objnew();
+		tobj->memalloc(tobj, 64);
+		before = gc_snapshot_take(NULL);
+		gc_objdel(tobj);
+		tobj = gc_objnew_ex(&(gc_attr_t){ .flags = GC_F_SLAB });
+		tmem[0] = tobj->memalloc(tobj, 64);
+		gc_set_tag(tobj, tmem[0], 42);
+		tmem[0] = tobj->memrealloc(tobj, tmem[0], 96);
+		tobj->memalloc(tobj, 64);
+		after = gc_snapshot_take(NULL);
+		diff = gc_snapshot_diff(before, after);
+		if (diff == NULL || gc_snapshot_blocks(diff, &blk) != 2 ||
+		    (blk[0].tag != 42 && blk[1].tag != 42)) {
+			EPRN("snapshot: a new gc and a moved tag should show in the diff\n");
+		}
+		gc_snapshot_free(diff);
+		gc_snapshot_free(after);
+		gc_snapshot_free(before);
+		gc_objdel(tobj);
+	}
+
+	{
+		gcobj_t *tobj2;
+		const char *str;
+		char *dup;
+		int shared = 1;
+		gc_stats_t stats;
+
+		tobj = gc_objnew();
+		tobj2 = gc_objnew_ex(&(gc_attr_t){ .flags = GC_F_INTERN });
+		str = gc_intern(tobj, "gc_test interned");
+		for (i = 0; i < 100; i++) {
+			dup = tobj2->stringdup(tobj2, "gc_test interned");
+			shared &= (dup == str);
+			tobj2->memfree(tobj2, dup);
+		}
+		if (!shared || gc_intern_find("gc_test interned") != str) {
+			EPRN("intern: equal strings should share one copy\n");
+		}
+		gc_stats(tobj2, &stats);
+		if (stats.intern_bytes > 64) {
+			EPRN("intern: a gc should hold a string once, not %llu B\n",
+			     (unsigned long long)stats.intern_bytes);
+		}
+		gc_stats(NULL, &stats);
+		IPRN("intern: %llu B as copies, %llu B saved\n",
+		     (unsigned long long)stats.intern_bytes, (unsigned long long)stats.intern_saved);
+		if (stats.intern_saved == 0) {
+			EPRN("intern: nothing saved\n");
+		}
+		gc_retain((void *)str);
+		gc_objdel(tobj);
+		gc_objdel(tobj2);
+		if (gc_intern_find("gc_test interned") != str) {
+			EPRN("intern: a retained string should stay\n");
+		}
+		gc_release((void *)str);
+		if (gc_intern_find("gc_test interned") != NULL) {
+			EPRN("intern: the last reference should free the string\n");
+		}
+	}
+
+	{
+		gc_surface_desc_t desc;
+		uint8_t *lin;
+		uint8_t *back;
+		uint32_t layout, fmt, x, y;
+
+		tobj = gc_objnew();
+		lin = tobj->memalloc(tobj, 37 * 21 * 4);
+		back = tobj->memalloc(tobj, 37 * 21 * 4);
+		for (i = 0; i < 37 * 21 * 4; i++) {
+			lin[i] = i * 7;
+		}
+		for (layout = 0; layout < GC_LAYOUT_COUNT; layout++) {
+			for (fmt = GC_FMT_RGB888; fmt <= GC_FMT_RGBA8888; fmt++) {
+				memset(&desc, 0, sizeof(desc));
+				desc.fmt = fmt;
+				desc.w = 37;
+				desc.h = 21;
+				desc.layout = layout;
+				gc_surface_layout(&desc);
+				desc.d_ptr = tobj->memalloc(tobj, desc.size);
+				gc_surface_from_linear(&desc, lin, 37 * desc.bpp);
+				memset(back, 0, 37 * 21 * 4);
+				gc_surface_to_linear(&desc, back, 37 * desc.bpp);
+				if (memcmp(lin, back, 37 * 21 * desc.bpp) != 0) {
+					EPRN("tile: layout %u bpp %d does not round trip\n", layout, desc.bpp);
+				}
+				for (y = 0; y < 21; y++) {
+					for (x = 0; x < 37; x++) {
+						if (memcmp(gc_surface_pixel(&desc, x, y),
+							   lin + (y * 37 + x) * desc.bpp, desc.bpp) != 0) {
+							EPRN("tile: layout %u pixel %u,%u misplaced\n",
+							     layout, x, y);
+							x = y = 64;
+						}
+					}
+				}
+				tobj->memfree(tobj, desc.d_ptr);
+			}
+		}
+		gc_objdel(tobj);
+	}
+
+	{
+		gcobj_t *child;
+		gcobj_t *grandchild;
+		uint64_t before = gc_memused(NULL);
+
+		tobj = gc_objnew();
+		child = gc_objnew_ex(&(gc_attr_t){ .parent = tobj });
+		grandchild = gc_objnew_ex(&(gc_attr_t){ .parent = child });
+		tobj->memalloc(tobj, 100);
+		child->memalloc(child, 200);
+		tmem[0] = grandchild->memalloc(grandchild, 400);
+		if (gc_subtree_used(tobj) != 700 || gc_subtree_used(child) != 600) {
+			EPRN("tree: subtree usage does not add up\n");
+		}
+		grandchild->memfree(grandchild, tmem[0]);
+		gc_set_parent(grandchild, tobj);
+		grandchild->memalloc(grandchild, 50);
+		if (gc_subtree_used(tobj) != 350 || gc_subtree_used(child) != 200 ||
+		    gc_set_parent(tobj, grandchild) == 0) {
+			EPRN("tree: reparenting went wrong\n");
+		}
+		gc_objdel(tobj);
+		if (gc_memused(NULL) != before) {
+			EPRN("tree: deleting the root should free the subtree\n");
+		}
+	}
 
 	memset(tmem, 0, sizeof(tmem));
 
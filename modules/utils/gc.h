@@ -12,28 +12,337 @@
 #include <stdint.h>
 #include <unistd.h>
 
+typedef enum gc_pixfmt_e {
+	GC_FMT_NONE = 0,	/* Raw bytes, what malloc2d allocates */
+	GC_FMT_GRAY8,
+	GC_FMT_RGB565,
+	GC_FMT_YUYV,
+	GC_FMT_RGB888,
+	GC_FMT_RGBA8888,
+	GC_FMT_COUNT,
+} gc_pixfmt_t;
+
+/*
+ * Pixel order in memory. Tiled surfaces keep every tile contiguous and
+ * the tiles row by row, w and h are padded to whole tiles.
+ */
+typedef enum gc_layout_e {
+	GC_LAYOUT_LINEAR = 0,
+	GC_LAYOUT_TILE16,	/* 16x16 tiles, pixels row by row inside */
+	GC_LAYOUT_TILE64,	/* 64x64 tiles, pixels row by row inside */
+	GC_LAYOUT_ZORDER,	/* 16x16 tiles, pixels in Z (Morton) order inside */
+	GC_LAYOUT_COUNT,
+} gc_layout_t;
+
+/*
+ * Layout of a 2D surface. The caller fills fmt, w, h and optionally bpp
+ * (derived from fmt when 0), row_align and base_align (powers of two, 0
+ * meaning none) and layout; malloc2d_ex fills in the rest. row_align only
+ * applies to linear surfaces.
+ */
+typedef struct gc_surface_desc_s {
+	int		fmt;
+	int		w;
+	int		h;
+	int		bpp;		/* Bytes per pixel */
+	uint32_t	row_align;
+	uint32_t	base_align;
+	uint32_t	stride;		/* Bytes per row, or per row of tiles */
+	size_t		size;
+	void		*d_ptr;		/* Virtual address */
+	void		*phys_ptr;
+	uint32_t	layout;		/* gc_layout_t */
+} gc_surface_desc_t;
+
+/* Tile edge in pixels, 1 for linear surfaces */
+static inline uint32_t gc_layout_tile(uint32_t layout)
+{
+	if (layout == GC_LAYOUT_LINEAR) {
+		return 1;
+	}
+	return (layout == GC_LAYOUT_TILE64) ? 64 : 16;
+}
+
+/* Rows of stride bytes in a surface, pixel rows or rows of tiles */
+static inline uint32_t gc_surface_rows(const gc_surface_desc_t *desc)
+{
+	uint32_t t = gc_layout_tile(desc->layout);
+
+	return (desc->h + t - 1) / t;
+}
+
+/* Interleaves the low 4 bits of x and y, x goes to the even bits */
+static inline uint32_t gc_morton16(uint32_t x, uint32_t y)
+{
+	x = (x | (x << 2)) & 0x33;
+	x = (x | (x << 1)) & 0x55;
+	y = (y | (y << 2)) & 0x33;
+	y = (y | (y << 1)) & 0x55;
+	return x | (y << 1);
+}
+
+/* First byte of tile (tx, ty), t * t pixels in a row from there */
+static inline uint8_t *gc_surface_tile(const gc_surface_desc_t *desc, uint32_t tx, uint32_t ty)
+{
+	uint32_t t = gc_layout_tile(desc->layout);
+
+	return (uint8_t *)desc->d_ptr + (size_t)ty * desc->stride + (size_t)tx * t * t * desc->bpp;
+}
+
+/* Address of pixel (x, y) in any layout */
+static inline uint8_t *gc_surface_pixel(const gc_surface_desc_t *desc, uint32_t x, uint32_t y)
+{
+	uint32_t t;
+
+	switch (desc->layout) {
+	case GC_LAYOUT_LINEAR:
+		return (uint8_t *)desc->d_ptr + (size_t)y * desc->stride + (size_t)x * desc->bpp;
+	case GC_LAYOUT_ZORDER:
+		return gc_surface_tile(desc, x >> 4, y >> 4) +
+		       gc_morton16(x & 15, y & 15) * desc->bpp;
+	default:
+		t = gc_layout_tile(desc->layout);
+		return gc_surface_tile(desc, x / t, y / t) + ((y % t) * t + x % t) * desc->bpp;
+	}
+}
+
 typedef struct gcobj_s {
 	void (*dump)(void *this);
 
 	void *(*memalloc)(void *this, size_t memsize);
 	void (*memfree)(void *this, void *memptr);
 	char *(*stringdup)(void *this, const char *str_p);
+	void *(*memrealloc)(void *this, void *memptr, size_t memsize);
+	void *(*memcalloc)(void *this, size_t count, size_t memsize);
+	void *(*memalign)(void *this, size_t align, size_t memsize);
 
 	int (*malloc2d)(void *this, int w, int h);
 	void (*free2d)(void *this, int id);
+	int (*malloc2d_ex)(void *this, gc_surface_desc_t *desc);
+	const gc_surface_desc_t *(*lookup2d)(void *this, int id);
 
 	void *private_p;
 } gcobj_t;
 
+/* gc_attr_t flags */
+#define GC_F_SLAB		(1 << 0)	/* Small blocks come from per-gc size-class slabs */
+#define GC_F_ARENA		(1 << 1)	/* Bump-pointer arena, memfree is a no-op */
+#define GC_F_TCACHE		(1 << 2)	/* Small blocks recycled through per-thread caches */
+#define GC_F_DEFERRED		(1 << 3)	/* gc_objdel leaves the freeing to a background thread */
+#define GC_F_INTERN		(1 << 4)	/* stringdup returns read-only gc_intern strings */
+
+/*
+ * System memory backend for plain blocks. realloc and usable_size may be
+ * NULL, the gc then copies on every resize.
+ */
+typedef struct gc_backend_s {
+	void *(*alloc)(void *ctx, size_t size);
+	void (*free)(void *ctx, void *ptr);
+	void *(*realloc)(void *ctx, void *ptr, size_t size);
+	size_t (*usable_size)(void *ctx, void *ptr);
+	void *ctx;
+} gc_backend_t;
+
+typedef struct gc_attr_s {
+	uint32_t	flags;
+	size_t		arena_chunk;	/* GC_F_ARENA chunk size, 0 for default */
+	uint64_t	budget;		/* Bytes the object may hold, 0 for no limit */
+	uint32_t	capacity;	/* Expected live blocks, presizes the slot table */
+	const gc_backend_t *backend;	/* NULL for the gc_register_backend default */
+	gcobj_t		*parent;	/* See gc_set_parent, NULL for a root gc */
+} gc_attr_t;
+
 typedef int (*gc_alloc2d_f)(int w, int h, void **physical_addr_p, void **virtual_addr_p);
 typedef int (*gc_free2d_f)(void *physical_addr_p);
+/* Fills d_ptr and phys_ptr for desc->size bytes aligned to desc->base_align */
+typedef int (*gc_alloc2d_ex_f)(gc_surface_desc_t *desc);
+/* level is the crossed watermark in percent of the global budget */
+typedef void (*gc_pressure_f)(uint32_t level, uint64_t used, uint64_t budget, void *arg);
+
+/* Reports the children of a traced block through gc_mark */
+typedef void (*gc_trace_f)(gcobj_t *gc, void *memptr);
+
+typedef struct gc_collect_stats_s {
+	uint64_t	reclaimed_bytes;
+	uint32_t	reclaimed_blocks;
+	uint32_t	live_blocks;
+	uint32_t	steps;
+} gc_collect_stats_t;
+
+typedef struct gc_compact_stats_s {
+	uint64_t	bytes_moved;
+	uint32_t	surfaces_moved;
+	uint32_t	pinned;		/* Surfaces that had to stay in the last step */
+	uint64_t	largest_free_before;	/* Largest free run when the pass started */
+	uint64_t	largest_free_after;
+	uint32_t	steps;
+} gc_compact_stats_t;
+
+#define GC_STATS_CLASSES	16
+
+typedef struct gc_stats_s {
+	gcobj_t		*gc;		/* NULL for the totals of all gc objects */
+	uint64_t	live_bytes;
+	uint64_t	peak_bytes;
+	uint64_t	allocs;
+	uint64_t	frees;
+	uint32_t	live_blocks;
+	uint32_t	surfaces;	/* Live 2D surfaces */
+	uint32_t	slot_capacity;
+	uint32_t	reserved;
+	uint64_t	size_class[GC_STATS_CLASSES];	/* Allocations of up to 16 << i bytes */
+	uint64_t	intern_bytes;	/* What the interned strings held would take as copies */
+	uint64_t	intern_saved;	/* Totals only, intern_bytes of all gcs minus the table */
+} gc_stats_t;
+
+/* gc_stats_export formats */
+#define GC_STATS_JSON		0
+#define GC_STATS_BINARY		1	/* gc_stats_hdr_t and count gc_stats_t, host byte order */
+
+#define GC_STATS_MAGIC		0x54534347	/* "GCST" */
+#define GC_STATS_VERSION	2
+
+typedef struct gc_stats_hdr_s {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	count;		/* Per-gc records after the totals record */
+	uint32_t	record_size;
+} gc_stats_hdr_t;
+
+/* Non zero return stops gc_stats_foreach */
+typedef int (*gc_stats_f)(const gc_stats_t *stats, void *arg);
+
+typedef struct gc_atrace_site_s {
+	const void	*site;		/* Return address in the caller */
+	const char	*file;		/* Set for calls made through GC_AT */
+	uint32_t	line;
+	uint32_t	live_blocks;
+	uint64_t	live_bytes;
+	uint64_t	allocs;
+} gc_atrace_site_t;
+
+extern int gc_atrace_enabled;
+
+/*
+ * Attributes the allocation in __call to this file and line instead of
+ * a return address: GC_AT(gc->memalloc(gc, 64)). While tracing is off
+ * it only tests gc_atrace_enabled.
+ */
+#define GC_AT(__call)										\
+	((void)(__builtin_expect(__atomic_load_n(&gc_atrace_enabled, __ATOMIC_RELAXED), 0) &&	\
+		gc_atrace_here(__FILE__, __LINE__)), (__call))
+
+/* A live block in a snapshot, (serial, slot, gen) identifies it across snapshots */
+typedef struct gc_snap_block_s {
+	uint64_t	gc;		/* Address of the gc object, may be reused */
+	uint64_t	serial;		/* Of the gc object, never reused */
+	uint64_t	addr;		/* Payload, or the virtual address of a 2D surface */
+	uint64_t	size;
+	uint32_t	slot;
+	uint32_t	tag;		/* gc_set_tag value, 0 when untagged */
+	uint16_t	gen;
+	uint8_t		mem_type;
+	uint8_t		reserved[5];
+} gc_snap_block_t;
+
+typedef struct gc_snapshot_s gc_snapshot_t;
+
+typedef struct gc_surface_pool_stats_s {
+	uint64_t	hits;
+	uint64_t	misses;
+	uint64_t	trimmed;
+	uint64_t	cached_bytes;
+	uint32_t	cached_count;
+} gc_surface_pool_stats_t;
 
 gcobj_t *gc_objnew(void);
+gcobj_t *gc_objnew_ex(const gc_attr_t *attr);
 void gc_objdel(gcobj_t *this);
+void gc_objreset(gcobj_t *this);
+int gc_set_parent(gcobj_t *this, gcobj_t *parent);
+gcobj_t *gc_get_parent(gcobj_t *this);
+uint64_t gc_subtree_used(gcobj_t *this);
+void gc_set_deferred(int on);
+
+void *gc_retain(void *memptr);
+void gc_release(void *memptr);
+const gc_surface_desc_t *gc_retain2d(gcobj_t *this, int id);
+void gc_release2d(const gc_surface_desc_t *desc);
+
+int gc_trace_type(gcobj_t *this, gc_trace_f trace_cb);
+int gc_set_type(gcobj_t *this, void *memptr, int type);
+int gc_add_root(gcobj_t *this, void **root);
+void gc_del_root(gcobj_t *this, void **root);
+void gc_mark(gcobj_t *this, void *memptr);
+int gc_collect_step(gcobj_t *this, uint32_t budget_us, gc_collect_stats_t *stats);
+void gc_deferred_flush(void);
+
+void gc_set_budget(gcobj_t *this, uint64_t bytes);
+uint64_t gc_memused(gcobj_t *this);
+int gc_register_pressure(uint32_t level, gc_pressure_f cb, void *arg);
+int gc_unregister_pressure(gc_pressure_f cb, void *arg);
+
+int gc_stats(gcobj_t *this, gc_stats_t *stats);
+int gc_stats_foreach(gc_stats_f cb, void *arg);
+int gc_stats_export(int fd, int format);
+int gc_stats_save(const char *path, int format);
+
+int gc_atrace_start(uint32_t ring_events);
+void gc_atrace_stop(void);
+int gc_atrace_here(const char *file, uint32_t line);
+int gc_atrace_top(gc_atrace_site_t *top, uint32_t n);
+void gc_atrace_dump(uint32_t n);
+
+int gc_set_tag(gcobj_t *this, void *memptr, uint32_t tag);
+gc_snapshot_t *gc_snapshot_take(gcobj_t *this);
+gc_snapshot_t *gc_snapshot_diff(const gc_snapshot_t *before, const gc_snapshot_t *after);
+uint32_t gc_snapshot_blocks(const gc_snapshot_t *snap, const gc_snap_block_t **blocks);
+uint64_t gc_snapshot_bytes(const gc_snapshot_t *snap);
+void gc_snapshot_dump(const gc_snapshot_t *snap, uint32_t max_blocks);
+int gc_snapshot_save(const gc_snapshot_t *snap, const char *path);
+gc_snapshot_t *gc_snapshot_load(const char *path);
+void gc_snapshot_free(gc_snapshot_t *snap);
+
+const char *gc_intern(gcobj_t *this, const char *str);
+const char *gc_intern_find(const char *str);
+
+int gc_register_backend(const gc_backend_t *backend);
+const gc_backend_t *gc_backend_pool(void);
 
 void gc_register_alloc2d(gc_alloc2d_f alloc2d_cb);
 void gc_register_free2d(gc_free2d_f free2d_cb);
+void gc_register_alloc2d_ex(gc_alloc2d_ex_f alloc2d_ex_cb);
+int gc_surface_layout(gc_surface_desc_t *desc);
+int gc_surface_to_linear(const gc_surface_desc_t *src, void *dst, uint32_t dst_stride);
+int gc_surface_from_linear(const gc_surface_desc_t *dst, const void *src, uint32_t src_stride);
+
+int gc_memfd_alloc2d(gc_surface_desc_t *desc);
+int gc_memfd_free2d(void *physical_addr_p);
+void gc_register_memfd2d(void);
+int gc_mmap_alloc2d(gc_surface_desc_t *desc);
+int gc_mmap_free2d(void *physical_addr_p);
+void gc_register_mmap2d(void);
+int gc_region_alloc2d(gc_surface_desc_t *desc);
+int gc_region_free2d(void *physical_addr_p);
+int gc_register_region2d(uint64_t bytes);
+uint64_t gc_region2d_largest_free(void);
+int gc_compact2d(uint32_t budget_us, gc_compact_stats_t *stats);
+const gc_surface_desc_t *gc_pin2d(gcobj_t *this, int id);
+void gc_unpin2d(gcobj_t *this, int id);
+int gc_export2d(gcobj_t *this, int id, gc_surface_desc_t *desc);
+int gc_import2d(gcobj_t *this, int fd, gc_surface_desc_t *desc);
+
+void gc_surface_pool_setup(uint32_t default_cap, uint64_t byte_budget);
+void gc_surface_pool_set_cap(int w, int h, int fmt, uint32_t cap);
+void gc_surface_pool_trim(uint64_t target_bytes);
+void gc_surface_pool_stats(gc_surface_pool_stats_t *stats);
+void gc_surface_pool_dump(void);
 
 int gc_test(void);
+int gc_bench_slots(void);
+int gc_bench_overhead(void);
+int gc_bench_threads(int max_threads);
+int gc_bench_backend(void);
+int gc_bench_tiled(void);
 
 #endif /* __GC_H */
@@ -0,0 +1,139 @@
+/*
+ *  gc_arena.c - Bump-pointer arena backend for the garbage colector
+ *
+ *  Copyright (C) 2018 Atanas Tulbenski <top4ester@gmail.com>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <memory.h>
+
+#include "debug.h"
+#include "gc_private.h"
+
+DEBUG_CREATE_CTX(GC_ARENA, DBG_QUIET);
+
+#define GC_ARENA_CHUNK		(64 * 1024)
+#define GC_ARENA_ALIGN		16
+
+typedef struct gc_arena_chunk_s {
+	struct gc_arena_chunk_s	*next;
+	size_t			size;
+} __attribute__ ((aligned (GC_ARENA_ALIGN))) gc_arena_chunk_t;
+
+struct gc_arena_s {
+	gc_arena_chunk_t	*chunks;
+	uint8_t			*cur_p;
+	uint8_t			*end_p;
+	size_t			chunk_size;
+	uint32_t		chunk_count;
+};
+
+static gc_arena_chunk_t *gc_arena_chunk_new(gc_arena_t *arena, size_t size)
+{
+	gc_arena_chunk_t *chunk;
+
+	chunk = malloc(sizeof(gc_arena_chunk_t) + size);
+	if (chunk == NULL) {
+		return NULL;
+	}
+	chunk->size = size;
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	arena->chunk_count++;
+	return chunk;
+}
+
+gc_arena_t *gc_arena_new(size_t chunk_size)
+{
+	gc_arena_t *arena;
+
+	arena = calloc(1, sizeof(gc_arena_t));
+	if (arena == NULL) {
+		return NULL;
+	}
+	arena->chunk_size = (chunk_size != 0) ? chunk_size : GC_ARENA_CHUNK;
+	return arena;
+}
+
+void gc_arena_del(gc_arena_t *arena)
+{
+	gc_arena_chunk_t *chunk;
+
+	if (arena == NULL) {
+		return;
+	}
+	while (arena->chunks) {
+		chunk = arena->chunks;
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+	free(arena);
+}
+
+void *gc_arena_alloc(gc_arena_t *arena, size_t memsize)
+{
+	gc_arena_chunk_t *chunk;
+	uint8_t *memres;
+
+	memsize = (memsize + GC_ARENA_ALIGN - 1) & ~((size_t)GC_ARENA_ALIGN - 1);
+	if (memsize > (size_t)(arena->end_p - arena->cur_p)) {
+		/*
+		 * Big requests get a chunk of their own so the current one
+		 * keeps serving the small ones.
+		 */
+		if (memsize > arena->chunk_size / 4) {
+			chunk = gc_arena_chunk_new(arena, memsize);
+			if (chunk == NULL) {
+				return NULL;
+			}
+			return chunk + 1;
+		}
+		chunk = gc_arena_chunk_new(arena, arena->chunk_size);
+		if (chunk == NULL) {
+			return NULL;
+		}
+		arena->cur_p = (uint8_t *)(chunk + 1);
+		arena->end_p = arena->cur_p + chunk->size;
+	}
+	memres = arena->cur_p;
+	arena->cur_p += memsize;
+	return memres;
+}
+
+/* Drops everything but one regular chunk, which is rewound for reuse */
+void gc_arena_reset(gc_arena_t *arena)
+{
+	gc_arena_chunk_t *chunk;
+	gc_arena_chunk_t *keep = NULL;
+
+	while (arena->chunks) {
+		chunk = arena->chunks;
+		arena->chunks = chunk->next;
+		if (keep == NULL && chunk->size == arena->chunk_size) {
+			keep = chunk;
+		} else {
+			free(chunk);
+		}
+	}
+	arena->chunk_count = 0;
+	arena->cur_p = NULL;
+	arena->end_p = NULL;
+	if (keep != NULL) {
+		keep->next = NULL;
+		arena->chunks = keep;
+		arena->chunk_count = 1;
+		arena->cur_p = (uint8_t *)(keep + 1);
+		arena->end_p = arena->cur_p + keep->size;
+	}
+}
+
+void gc_arena_dump(gc_arena_t *arena)
+{
+	IPRN("\tarena chunks = %u (%zu B each)\n", arena->chunk_count,
+	     arena->chunk_size);
+	IPRN("\tarena left  = %zu B\n", (size_t)(arena->end_p - arena->cur_p));
+}
@@ -0,0 +1,436 @@
+/*
+ *  gc_atrace.c - Allocation tracing with call-site attribution
+ *
+ *  Copyright (C) 2018 Atanas Tulbenski <top4ester@gmail.com>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "autoconf.h"
+#include "debug.h"
+#include "gc.h"
+#include "gc_private.h"
+
+DEBUG_CREATE_CTX(GC_ATRACE, DBG_QUIET);
+
+#define GC_ATRACE_RING_DEFAULT	(1 << 16)
+
+typedef struct gc_atrace_ev_s {
+	uint64_t	ts;
+	uint64_t	size;
+	const void	*gc;
+	const void	*ptr;
+	const void	*site;
+	const char	*file;
+	uint32_t	line;
+	uint32_t	type;
+} gc_atrace_ev_t;
+
+/*
+ * One ring per thread, written only by its thread. Slots are stored
+ * with relaxed atomics and head is published after them, so a dump can
+ * copy a ring while it is written and throw away what got overwritten.
+ * Rings of exited threads keep their events and go to the next thread.
+ */
+typedef struct gc_atrace_ring_s {
+	struct gc_atrace_ring_s	*next;
+	uint64_t		head;
+	int			orphan;
+	gc_atrace_ev_t		ev[];
+} gc_atrace_ring_t;
+
+__attribute__ ((visibility ("default")))
+int gc_atrace_enabled;
+
+static uint32_t gc_atrace_ring_size;	/* Power of two, fixed by the first start */
+static gc_atrace_ring_t *gc_atrace_rings;
+static pthread_mutex_t gc_atrace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t gc_atrace_key;
+static pthread_once_t gc_atrace_once = PTHREAD_ONCE_INIT;
+
+static __thread gc_atrace_ring_t *gc_atrace_ring;
+static __thread const char *gc_atrace_file;
+static __thread uint32_t gc_atrace_line;
+
+static void gc_atrace_thread_exit(void *arg)
+{
+	gc_atrace_ring_t *ring = arg;
+
+	__atomic_store_n(&ring->orphan, 1, __ATOMIC_RELEASE);
+}
+
+static void gc_atrace_init(void)
+{
+	pthread_key_create(&gc_atrace_key, gc_atrace_thread_exit);
+}
+
+static gc_atrace_ring_t *gc_atrace_ring_get(void)
+{
+	gc_atrace_ring_t *ring;
+
+	pthread_mutex_lock(&gc_atrace_lock);
+	for (ring = gc_atrace_rings; ring != NULL; ring = ring->next) {
+		if (__atomic_load_n(&ring->orphan, __ATOMIC_ACQUIRE)) {
+			ring->orphan = 0;
+			break;
+		}
+	}
+	if (ring == NULL) {
+		ring = malloc(sizeof(gc_atrace_ring_t) +
+			      (size_t)gc_atrace_ring_size * sizeof(gc_atrace_ev_t));
+		if (ring != NULL) {
+			ring->head = 0;
+			ring->orphan = 0;
+			ring->next = gc_atrace_rings;
+			gc_atrace_rings = ring;
+		}
+	}
+	pthread_mutex_unlock(&gc_atrace_lock);
+	if (ring != NULL) {
+		pthread_setspecific(gc_atrace_key, ring);
+	}
+	return ring;
+}
+
+/* Called through GC_ATRACE only, after the gc_atrace_enabled check */
+void gc_atrace_event(uint32_t type, const void *gc, const void *ptr,
+		     uint64_t size, const void *site)
+{
+	gc_atrace_ring_t *ring = gc_atrace_ring;
+	gc_atrace_ev_t *ev;
+	struct timespec ts;
+	uint64_t head;
+
+	if (ring == NULL) {
+		ring = gc_atrace_ring_get();
+		if (ring == NULL) {
+			return;
+		}
+		gc_atrace_ring = ring;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	head = ring->head;
+	ev = &ring->ev[head & (gc_atrace_ring_size - 1)];
+	__atomic_store_n(&ev->ts, (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&ev->size, size, __ATOMIC_RELAXED);
+	__atomic_store_n(&ev->gc, gc, __ATOMIC_RELAXED);
+	__atomic_store_n(&ev->ptr, ptr, __ATOMIC_RELAXED);
+	__atomic_store_n(&ev->site, site, __ATOMIC_RELAXED);
+	__atomic_store_n(&ev->file, gc_atrace_file, __ATOMIC_RELAXED);
+	__atomic_store_n(&ev->line, gc_atrace_line, __ATOMIC_RELAXED);
+	__atomic_store_n(&ev->type, type, __ATOMIC_RELAXED);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	gc_atrace_file = NULL;
+}
+
+/* Names the call site of the next event of this thread, see GC_AT */
+__attribute__ ((visibility ("default")))
+int gc_atrace_here(const char *file, uint32_t line)
+{
+	gc_atrace_file = file;
+	gc_atrace_line = line;
+	return 1;
+}
+
+/*
+ * Starts recording. ring_events (0 for 64Ki) is rounded up to a power
+ * of two and only the first start picks it. A start after gc_atrace_stop
+ * clears the rings, since frees missed while stopped would leave their
+ * blocks live. Fails when the tracing hooks are compiled out.
+ */
+__attribute__ ((visibility ("default")))
+int gc_atrace_start(uint32_t ring_events)
+{
+#ifdef CONFIG_LIBUTILS_GC_ATRACE
+	gc_atrace_ring_t *ring;
+	uint32_t size = 2;
+
+	pthread_once(&gc_atrace_once, gc_atrace_init);
+	pthread_mutex_lock(&gc_atrace_lock);
+	if (gc_atrace_ring_size == 0) {
+		if (ring_events == 0) {
+			ring_events = GC_ATRACE_RING_DEFAULT;
+		}
+		while (size < ring_events && size < (1u << 30)) {
+			size <<= 1;
+		}
+		gc_atrace_ring_size = size;
+	}
+	if (!__atomic_load_n(&gc_atrace_enabled, __ATOMIC_ACQUIRE)) {
+		for (ring = gc_atrace_rings; ring != NULL; ring = ring->next) {
+			__atomic_store_n(&ring->head, 0, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&gc_atrace_lock);
+	__atomic_store_n(&gc_atrace_enabled, 1, __ATOMIC_RELEASE);
+	return 0;
+#else
+	EPRN("Allocation tracing is not compiled in\n");
+	return -1;
+#endif
+}
+
+/* Stops recording, the recorded events stay for gc_atrace_top */
+__attribute__ ((visibility ("default")))
+void gc_atrace_stop(void)
+{
+	__atomic_store_n(&gc_atrace_enabled, 0, __ATOMIC_RELEASE);
+}
+
+/* Copies the events still in every ring, oldest first per ring */
+static int gc_atrace_collect(gc_atrace_ev_t **evs, uint32_t *count)
+{
+	gc_atrace_ring_t *ring;
+	gc_atrace_ev_t *tab = NULL;
+	gc_atrace_ev_t *ev;
+	gc_atrace_ev_t *tmp;
+	uint64_t h1, h2, first, i;
+	uint32_t n = 0, cap = 0;
+
+	pthread_mutex_lock(&gc_atrace_lock);
+	for (ring = gc_atrace_rings; ring != NULL; ring = ring->next) {
+		h1 = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		first = (h1 > gc_atrace_ring_size) ? h1 - gc_atrace_ring_size : 0;
+		if (n + (h1 - first) > cap) {
+			cap = n + (h1 - first);
+			tmp = realloc(tab, (size_t)cap * sizeof(gc_atrace_ev_t));
+			if (tmp == NULL) {
+				pthread_mutex_unlock(&gc_atrace_lock);
+				free(tab);
+				return -1;
+			}
+			tab = tmp;
+		}
+		for (i = first; i < h1; i++) {
+			ev = &ring->ev[i & (gc_atrace_ring_size - 1)];
+			tab[n + i - first].ts = __atomic_load_n(&ev->ts, __ATOMIC_RELAXED);
+			tab[n + i - first].size = __atomic_load_n(&ev->size, __ATOMIC_RELAXED);
+			tab[n + i - first].gc = __atomic_load_n(&ev->gc, __ATOMIC_RELAXED);
+			tab[n + i - first].ptr = __atomic_load_n(&ev->ptr, __ATOMIC_RELAXED);
+			tab[n + i - first].site = __atomic_load_n(&ev->site, __ATOMIC_RELAXED);
+			tab[n + i - first].file = __atomic_load_n(&ev->file, __ATOMIC_RELAXED);
+			tab[n + i - first].line = __atomic_load_n(&ev->line, __ATOMIC_RELAXED);
+			tab[n + i - first].type = __atomic_load_n(&ev->type, __ATOMIC_RELAXED);
+			/* Keeps the order of the ring through the sort by time */
+			if (i != first && tab[n + i - first].ts <= tab[n + i - first - 1].ts) {
+				tab[n + i - first].ts = tab[n + i - first - 1].ts + 1;
+			}
+		}
+		/* Whatever the writer reached meanwhile may be torn */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		h2 = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+		if (h2 >= gc_atrace_ring_size && h2 - gc_atrace_ring_size + 1 > first) {
+			i = h2 - gc_atrace_ring_size + 1 - first;
+			if (i > h1 - first) {
+				i = h1 - first;
+			}
+			memmove(&tab[n], &tab[n + i], (h1 - first - i) * sizeof(gc_atrace_ev_t));
+			n += h1 - first - i;
+		} else {
+			n += h1 - first;
+		}
+	}
+	pthread_mutex_unlock(&gc_atrace_lock);
+	*evs = tab;
+	*count = n;
+	return 0;
+}
+
+static int gc_atrace_ev_cmp(const void *a, const void *b)
+{
+	const gc_atrace_ev_t *ea = a;
+	const gc_atrace_ev_t *eb = b;
+
+	return (ea->ts > eb->ts) - (ea->ts < eb->ts);
+}
+
+static int gc_atrace_site_cmp(const void *a, const void *b)
+{
+	const gc_atrace_site_t *sa = a;
+	const gc_atrace_site_t *sb = b;
+
+	return (sa->live_bytes < sb->live_bytes) - (sa->live_bytes > sb->live_bytes);
+}
+
+static uint32_t gc_atrace_hash(uintptr_t key, uint32_t mask)
+{
+	return (uint32_t)(((uint64_t)key * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+}
+
+/* Live block of the replay, site is an index into the site table */
+typedef struct gc_atrace_live_s {
+	const void	*ptr;
+	const void	*gc;
+	uint64_t	size;
+	uint32_t	site;
+	int		used;
+} gc_atrace_live_t;
+
+/*
+ * Sites are keyed by file:line when the event has one, else by return
+ * address. Returns the index of the site, adding it on first sight.
+ */
+static uint32_t gc_atrace_site_of(gc_atrace_site_t *sites, uint32_t *site_hash,
+				  uint32_t mask, uint32_t *nsites, const gc_atrace_ev_t *ev)
+{
+	uintptr_t key;
+	uint32_t h, s;
+
+	key = (ev->file != NULL) ? (uintptr_t)ev->file ^ ((uintptr_t)ev->line << 40) :
+				   (uintptr_t)ev->site;
+	for (h = gc_atrace_hash(key, mask); site_hash[h] != UINT32_MAX; h = (h + 1) & mask) {
+		s = site_hash[h];
+		if (sites[s].file == ev->file &&
+		    (ev->file != NULL ? sites[s].line == ev->line : sites[s].site == ev->site)) {
+			return s;
+		}
+	}
+	s = (*nsites)++;
+	memset(&sites[s], 0, sizeof(sites[s]));
+	sites[s].site = ev->site;
+	sites[s].file = ev->file;
+	sites[s].line = ev->line;
+	site_hash[h] = s;
+	return s;
+}
+
+static gc_atrace_live_t *gc_atrace_live_find(gc_atrace_live_t *live, uint32_t mask,
+					     const void *ptr)
+{
+	uint32_t h;
+
+	for (h = gc_atrace_hash((uintptr_t)ptr, mask); live[h].used; h = (h + 1) & mask) {
+		if (live[h].used > 0 && live[h].ptr == ptr) {
+			return &live[h];
+		}
+	}
+	return NULL;
+}
+
+static void gc_atrace_live_add(gc_atrace_live_t *live, uint32_t mask, const gc_atrace_ev_t *ev,
+			       uint32_t site)
+{
+	uint32_t h;
+
+	for (h = gc_atrace_hash((uintptr_t)ev->ptr, mask); live[h].used > 0; h = (h + 1) & mask) {
+	}
+	live[h].ptr = ev->ptr;
+	live[h].gc = ev->gc;
+	live[h].size = ev->size;
+	live[h].site = site;
+	live[h].used = 1;
+}
+
+/*
+ * Replays the recorded events and fills up to n call sites holding the
+ * most live bytes, largest first. Blocks allocated before the oldest
+ * event still in a ring are not seen, so a ring too small for the run
+ * under-reports long lived blocks. Returns the number of sites filled.
+ */
+__attribute__ ((visibility ("default")))
+int gc_atrace_top(gc_atrace_site_t *top, uint32_t n)
+{
+	gc_atrace_ev_t *evs;
+	gc_atrace_site_t *sites = NULL;
+	gc_atrace_live_t *live = NULL;
+	gc_atrace_live_t *blk;
+	uint32_t *site_hash = NULL;
+	uint32_t count, mask, nsites = 0;
+	uint32_t i, j, s;
+	int ret = -1;
+
+	if (gc_atrace_collect(&evs, &count) < 0) {
+		return -1;
+	}
+	if (count == 0) {
+		free(evs);
+		return 0;
+	}
+	qsort(evs, count, sizeof(gc_atrace_ev_t), gc_atrace_ev_cmp);
+	for (mask = 1; mask < count * 2; mask <<= 1) {
+	}
+	sites = malloc((size_t)count * sizeof(gc_atrace_site_t));
+	site_hash = malloc((size_t)mask * sizeof(uint32_t));
+	live = calloc(mask, sizeof(gc_atrace_live_t));
+	if (sites == NULL || site_hash == NULL || live == NULL) {
+		goto out;
+	}
+	memset(site_hash, 0xff, (size_t)mask * sizeof(uint32_t));
+	mask--;
+
+	for (i = 0; i < count; i++) {
+		switch (evs[i].type) {
+		case GC_ATRACE_ALLOC:
+			s = gc_atrace_site_of(sites, site_hash, mask, &nsites, &evs[i]);
+			sites[s].allocs++;
+			sites[s].live_blocks++;
+			sites[s].live_bytes += evs[i].size;
+			gc_atrace_live_add(live, mask, &evs[i], s);
+			break;
+		case GC_ATRACE_FREE:
+			blk = gc_atrace_live_find(live, mask, evs[i].ptr);
+			if (blk != NULL) {
+				sites[blk->site].live_blocks--;
+				sites[blk->site].live_bytes -= blk->size;
+				blk->used = -1;
+			}
+			break;
+		case GC_ATRACE_RESET:
+			for (j = 0; j <= mask; j++) {
+				if (live[j].used > 0 && live[j].gc == evs[i].gc) {
+					sites[live[j].site].live_blocks--;
+					sites[live[j].site].live_bytes -= live[j].size;
+					live[j].used = -1;
+				}
+			}
+			break;
+		}
+	}
+	qsort(sites, nsites, sizeof(gc_atrace_site_t), gc_atrace_site_cmp);
+	if (n > nsites) {
+		n = nsites;
+	}
+	memcpy(top, sites, n * sizeof(gc_atrace_site_t));
+	ret = n;
+out:
+	free(live);
+	free(site_hash);
+	free(sites);
+	free(evs);
+	return ret;
+}
+
+/* Prints the n call sites holding the most live bytes */
+__attribute__ ((visibility ("default")))
+void gc_atrace_dump(uint32_t n)
+{
+	gc_atrace_site_t *top;
+	int count, i;
+
+	top = malloc((size_t)n * sizeof(gc_atrace_site_t));
+	if (top == NULL) {
+		return;
+	}
+	count = gc_atrace_top(top, n);
+	IPRN("------------------------- GC top %u call sites -------------------------\n", n);
+	for (i = 0; i < count; i++) {
+		if (top[i].file != NULL) {
+			IPRN("%3d. %s:%u\n", i + 1, top[i].file, top[i].line);
+		} else {
+			IPRN("%3d. %p\n", i + 1, top[i].site);
+		}
+		IPRN("     live %llu B in %u blocks, %llu allocs\n",
+		     (unsigned long long)top[i].live_bytes, top[i].live_blocks,
+		     (unsigned long long)top[i].allocs);
+	}
+	IPRN("------------------------- GC top end ----------------------------------\n");
+	free(top);
+}
@@ -0,0 +1,206 @@
+/*
+ *  gc_backend.c - System memory backends of the garbage colector
+ *
+ *  Copyright (C) 2018 Atanas Tulbenski <top4ester@gmail.com>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <malloc.h>
+#include <pthread.h>
+
+#include "debug.h"
+#include "gc.h"
+#include "gc_private.h"
+
+DEBUG_CREATE_CTX(GC_BACKEND, DBG_QUIET);
+
+/* Ids fit the uint8_t aux field of a system block header */
+#define GC_BACKEND_MAX		256
+
+static void *gc_libc_alloc(void *ctx, size_t size)
+{
+	return malloc(size);
+}
+
+static void gc_libc_free(void *ctx, void *ptr)
+{
+	free(ptr);
+}
+
+static void *gc_libc_realloc(void *ctx, void *ptr, size_t size)
+{
+	return realloc(ptr, size);
+}
+
+static size_t gc_libc_usable_size(void *ctx, void *ptr)
+{
+	return malloc_usable_size(ptr);
+}
+
+static const gc_backend_t gc_backend_libc = {
+	.alloc = gc_libc_alloc,
+	.free = gc_libc_free,
+	.realloc = gc_libc_realloc,
+	.usable_size = gc_libc_usable_size,
+};
+
+/*
+ * Every block remembers the id of the backend it came from, so it can
+ * be freed after its gc is gone. Entries are published once and never
+ * change, lookups go without the lock.
+ */
+static const gc_backend_t *gc_backend_tab[GC_BACKEND_MAX] = {
+	&gc_backend_libc,
+};
+static uint32_t gc_backend_count = 1;
+static uint8_t gc_backend_default;
+static pthread_mutex_t gc_backend_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const gc_backend_t *gc_backend_get(uint8_t id)
+{
+	return gc_backend_tab[id];
+}
+
+/* Id of backend, which gets one on first use. NULL is the process default */
+int gc_backend_id(const gc_backend_t *backend)
+{
+	uint32_t i;
+
+	if (backend == NULL) {
+		return __atomic_load_n(&gc_backend_default, __ATOMIC_RELAXED);
+	}
+	if (backend->alloc == NULL || backend->free == NULL) {
+		EPRN("A backend needs at least alloc and free\n");
+		return -1;
+	}
+	pthread_mutex_lock(&gc_backend_lock);
+	for (i = 0; i < gc_backend_count; i++) {
+		if (gc_backend_tab[i] == backend) {
+			pthread_mutex_unlock(&gc_backend_lock);
+			return i;
+		}
+	}
+	if (i == GC_BACKEND_MAX) {
+		pthread_mutex_unlock(&gc_backend_lock);
+		EPRN("No room for another backend\n");
+		return -1;
+	}
+	__atomic_store_n(&gc_backend_tab[i], backend, __ATOMIC_RELEASE);
+	gc_backend_count++;
+	pthread_mutex_unlock(&gc_backend_lock);
+	return i;
+}
+
+/*
+ * Makes backend the system memory backend of gc objects created from now
+ * on, NULL goes back to libc. It has to stay valid for the life of the
+ * process, blocks may outlive their gc.
+ */
+__attribute__ ((visibility ("default")))
+int gc_register_backend(const gc_backend_t *backend)
+{
+	int id;
+
+	id = (backend != NULL) ? gc_backend_id(backend) : 0;
+	if (id < 0) {
+		return -1;
+	}
+	__atomic_store_n(&gc_backend_default, id, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * Bundled pool backend: power of two classes up to 4 KiB on locked free
+ * lists that never return memory to libc. A 16 byte prefix keeps the
+ * class and the alignment.
+ */
+#define GC_BPOOL_MIN_SHIFT	5
+#define GC_BPOOL_MAX_SHIFT	12
+#define GC_BPOOL_CLASSES	(GC_BPOOL_MAX_SHIFT - GC_BPOOL_MIN_SHIFT + 1)
+#define GC_BPOOL_BIG		0xff
+
+typedef struct gc_bpool_hdr_s {
+	struct gc_bpool_hdr_s	*next;
+	uint8_t			cls;
+} __attribute__ ((aligned (16))) gc_bpool_hdr_t;
+
+static gc_bpool_hdr_t *gc_bpool_free[GC_BPOOL_CLASSES];
+static pthread_mutex_t gc_bpool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int gc_bpool_class(size_t size)
+{
+	int cls = 0;
+
+	while (((size_t)1 << (cls + GC_BPOOL_MIN_SHIFT)) < size) {
+		if (++cls == GC_BPOOL_CLASSES) {
+			return GC_BPOOL_BIG;
+		}
+	}
+	return cls;
+}
+
+static void *gc_bpool_alloc(void *ctx, size_t size)
+{
+	gc_bpool_hdr_t *hdr = NULL;
+	int cls;
+
+	cls = gc_bpool_class(size);
+	if (cls != GC_BPOOL_BIG) {
+		pthread_mutex_lock(&gc_bpool_lock);
+		hdr = gc_bpool_free[cls];
+		if (hdr != NULL) {
+			gc_bpool_free[cls] = hdr->next;
+		}
+		pthread_mutex_unlock(&gc_bpool_lock);
+		size = (size_t)1 << (cls + GC_BPOOL_MIN_SHIFT);
+	}
+	if (hdr == NULL) {
+		hdr = malloc(sizeof(gc_bpool_hdr_t) + size);
+		if (hdr == NULL) {
+			return NULL;
+		}
+		hdr->cls = cls;
+	}
+	return hdr + 1;
+}
+
+static void gc_bpool_release(void *ctx, void *ptr)
+{
+	gc_bpool_hdr_t *hdr = (gc_bpool_hdr_t *)ptr - 1;
+
+	if (hdr->cls == GC_BPOOL_BIG) {
+		free(hdr);
+		return;
+	}
+	pthread_mutex_lock(&gc_bpool_lock);
+	hdr->next = gc_bpool_free[hdr->cls];
+	gc_bpool_free[hdr->cls] = hdr;
+	pthread_mutex_unlock(&gc_bpool_lock);
+}
+
+static size_t gc_bpool_usable_size(void *ctx, void *ptr)
+{
+	gc_bpool_hdr_t *hdr = (gc_bpool_hdr_t *)ptr - 1;
+
+	if (hdr->cls == GC_BPOOL_BIG) {
+		return malloc_usable_size(hdr) - sizeof(gc_bpool_hdr_t);
+	}
+	return (size_t)1 << (hdr->cls + GC_BPOOL_MIN_SHIFT);
+}
+
+static const gc_backend_t gc_backend_bpool = {
+	.alloc = gc_bpool_alloc,
+	.free = gc_bpool_release,
+	.usable_size = gc_bpool_usable_size,
+};
+
+__attribute__ ((visibility ("default")))
+const gc_backend_t *gc_backend_pool(void)
+{
+	return &gc_backend_bpool;
+}
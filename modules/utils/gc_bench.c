@@ -0,0 +1,521 @@
+/*
+ *  gc_bench.c - Simple garbage colector benchmarks
+ *
+ *  Copyright (C) 2018 Atanas Tulbenski <top4ester@gmail.com>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+#include <memory.h>
+#include <malloc.h>
+#include <pthread.h>
+
+#include "debug.h"
+#include "gc.h"
+#include "gc_private.h"
+
+DEBUG_CREATE_CTX(GC_BENCH, DBG_QUIET);
+
+#define GC_BENCH_OPS	1000000
+
+static uint64_t gc_bench_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t gc_bench_rand(uint32_t *seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
+
+/*
+ * Keeps `live` blocks allocated and measures a steady state of
+ * free-random-block + alloc pairs. With O(1) slot handling the cost per
+ * pair must not depend on the number of live blocks.
+ */
+__attribute__ ((visibility ("default")))
+int gc_bench_slots(void)
+{
+	static const uint32_t live_tab[] = { 10, 1000, 100000, 1000000 };
+	gcobj_t *tobj;
+	void **blocks;
+	uint64_t start, elapsed;
+	uint32_t seed = 0x9e3779b9;
+	uint32_t live, i, n;
+	unsigned int t;
+
+	for (t = 0; t < sizeof(live_tab) / sizeof(live_tab[0]); t++) {
+		live = live_tab[t];
+		blocks = malloc(live * sizeof(void *));
+		if (blocks == NULL) {
+			return -1;
+		}
+		tobj = gc_objnew();
+		if (tobj == NULL) {
+			free(blocks);
+			return -1;
+		}
+		for (i = 0; i < live; i++) {
+			blocks[i] = tobj->memalloc(tobj, 64);
+		}
+
+		start = gc_bench_nsec();
+		for (i = 0; i < GC_BENCH_OPS; i++) {
+			n = gc_bench_rand(&seed) % live;
+			tobj->memfree(tobj, blocks[n]);
+			blocks[n] = tobj->memalloc(tobj, 64);
+		}
+		elapsed = gc_bench_nsec() - start;
+
+		IPRN("live %8u blocks: %6.1f ns per free+alloc, %6.2f Mops/s\n",
+		     live, (double)elapsed / GC_BENCH_OPS,
+		     GC_BENCH_OPS * 1000.0 / elapsed);
+
+		gc_objdel(tobj);
+		free(blocks);
+	}
+
+	return 0;
+}
+
+#define GC_BENCH_LEGACY_HDR	32	/* size, index, mem_type, d_ptr and phys_ptr */
+#define GC_BENCH_LEGACY		((uint32_t)-1)
+#define GC_BENCH_COST_BLOCKS	4096
+
+static uint64_t gc_bench_heap(void)
+{
+	struct mallinfo2 mi = mallinfo2();
+
+	return mi.uordblks + mi.hblkhd;
+}
+
+/*
+ * Heap bytes per block beyond the payload p, for a gc with flags or for
+ * a plain malloc with the old header. Only the second half of 2 x n
+ * allocations is counted, so caches and free lists left by an earlier
+ * run are used up first.
+ */
+static int64_t gc_bench_block_cost(uint32_t flags, uint32_t p)
+{
+	gcobj_t *tobj = NULL;
+	void **blocks;
+	uint64_t start = 0;
+	uint32_t n = GC_BENCH_COST_BLOCKS;
+	uint32_t i;
+
+	blocks = calloc(2 * n, sizeof(void *));
+	if (blocks == NULL) {
+		return -1;
+	}
+	if (flags != GC_BENCH_LEGACY) {
+		tobj = gc_objnew_ex(&(gc_attr_t){ .flags = flags, .capacity = 2 * n + 1 });
+		if (tobj == NULL) {
+			free(blocks);
+			return -1;
+		}
+	}
+	for (i = 0; i < 2 * n; i++) {
+		if (i == n) {
+			start = gc_bench_heap();
+		}
+		if (tobj != NULL) {
+			blocks[i] = tobj->memalloc(tobj, p);
+		} else {
+			blocks[i] = malloc(GC_BENCH_LEGACY_HDR + p);
+		}
+	}
+	start = gc_bench_heap() - start;
+	if (tobj != NULL) {
+		gc_objdel(tobj);
+	} else {
+		for (i = 0; i < 2 * n; i++) {
+			free(blocks[i]);
+		}
+	}
+	free(blocks);
+	return (int64_t)(start / n) - p;
+}
+
+/*
+ * What a block really costs beyond its payload, chunk rounding and
+ * headers included, for the old header and for the system, slab and
+ * thread cache paths of a gc.
+ */
+__attribute__ ((visibility ("default")))
+int gc_bench_overhead(void)
+{
+	static const uint32_t payload_tab[] = { 8, 16, 24, 32, 48, 64, 128, 256 };
+	static const uint32_t flags_tab[] = { GC_BENCH_LEGACY, 0, GC_F_SLAB, GC_F_TCACHE };
+	int64_t cost[sizeof(flags_tab) / sizeof(flags_tab[0])];
+	unsigned int t, f;
+	uint32_t p;
+
+	for (t = 0; t < sizeof(payload_tab) / sizeof(payload_tab[0]); t++) {
+		p = payload_tab[t];
+		for (f = 0; f < sizeof(flags_tab) / sizeof(flags_tab[0]); f++) {
+			cost[f] = gc_bench_block_cost(flags_tab[f], p);
+			if (cost[f] < 0) {
+				return -1;
+			}
+		}
+		IPRN("payload %4u B: overhead legacy %3lld, system %3lld, slab %3lld, tcache %3lld B\n",
+		     p, (long long)cost[0], (long long)cost[1], (long long)cost[2], (long long)cost[3]);
+	}
+
+	return 0;
+}
+
+#define GC_BENCH_THREAD_OPS	2000000
+#define GC_BENCH_BATCH		64
+
+#define GC_BENCH_RING		1024
+
+/*
+ * A producer and consumer pair share a gc under lock. The producer
+ * allocates the blocks and the consumer frees them, so each block goes
+ * back through another thread.
+ */
+typedef struct gc_bench_thread_s {
+	pthread_t	tid;
+	pthread_t	peer_tid;
+	uint32_t	flags;
+	gcobj_t		*gc;
+	pthread_mutex_t	lock;
+	void		*ring[GC_BENCH_RING];
+	uint32_t	head __attribute__ ((aligned (64)));
+	uint32_t	tail __attribute__ ((aligned (64)));
+} gc_bench_thread_t;
+
+static void *gc_bench_thread(void *arg)
+{
+	gc_bench_thread_t *bt = arg;
+	gcobj_t *tobj;
+	void *blocks[GC_BENCH_BATCH];
+	uint32_t i, j;
+
+	tobj = gc_objnew_ex(&(gc_attr_t){ .flags = bt->flags });
+	if (tobj == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < GC_BENCH_THREAD_OPS / GC_BENCH_BATCH; i++) {
+		for (j = 0; j < GC_BENCH_BATCH; j++) {
+			blocks[j] = tobj->memalloc(tobj, 16 + (j & 7) * 32);
+		}
+		for (j = 0; j < GC_BENCH_BATCH; j++) {
+			tobj->memfree(tobj, blocks[j]);
+		}
+	}
+	gc_objdel(tobj);
+	return NULL;
+}
+
+static void *gc_bench_producer(void *arg)
+{
+	gc_bench_thread_t *bt = arg;
+	void *blk;
+	uint32_t head;
+	uint32_t i;
+
+	for (i = 0; i <= GC_BENCH_THREAD_OPS; i++) {
+		blk = NULL;
+		if (i < GC_BENCH_THREAD_OPS) {
+			pthread_mutex_lock(&bt->lock);
+			blk = bt->gc->memalloc(bt->gc, 16 + (i & 7) * 32);
+			pthread_mutex_unlock(&bt->lock);
+			if (blk == NULL) {
+				continue;
+			}
+		}
+		/* NULL tells the consumer to stop */
+		head = bt->head;
+		while (head - __atomic_load_n(&bt->tail, __ATOMIC_ACQUIRE) == GC_BENCH_RING) {
+			sched_yield();
+		}
+		bt->ring[head % GC_BENCH_RING] = blk;
+		__atomic_store_n(&bt->head, head + 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static void *gc_bench_consumer(void *arg)
+{
+	gc_bench_thread_t *bt = arg;
+	uint32_t tail = 0;
+	void *blk;
+
+	for (;;) {
+		while (__atomic_load_n(&bt->head, __ATOMIC_ACQUIRE) == tail) {
+			sched_yield();
+		}
+		blk = bt->ring[tail % GC_BENCH_RING];
+		__atomic_store_n(&bt->tail, ++tail, __ATOMIC_RELEASE);
+		if (blk == NULL) {
+			return NULL;
+		}
+		pthread_mutex_lock(&bt->lock);
+		bt->gc->memfree(bt->gc, blk);
+		pthread_mutex_unlock(&bt->lock);
+	}
+}
+
+/* Starts n threads, or n pairs for pipe, and waits for them */
+static int gc_bench_run(gc_bench_thread_t *bt, int n, uint32_t flags, int pipe)
+{
+	int started, i;
+	int ret = 0;
+
+	for (started = 0; started < n; started++) {
+		bt[started].flags = flags;
+		bt[started].head = 0;
+		bt[started].tail = 0;
+		if (!pipe) {
+			if (pthread_create(&bt[started].tid, NULL, gc_bench_thread, &bt[started]) != 0) {
+				break;
+			}
+			continue;
+		}
+		bt[started].gc = gc_objnew_ex(&(gc_attr_t){ .flags = flags });
+		if (bt[started].gc == NULL) {
+			break;
+		}
+		pthread_mutex_init(&bt[started].lock, NULL);
+		if (pthread_create(&bt[started].peer_tid, NULL, gc_bench_consumer, &bt[started]) != 0) {
+			gc_objdel(bt[started].gc);
+			pthread_mutex_destroy(&bt[started].lock);
+			break;
+		}
+		if (pthread_create(&bt[started].tid, NULL, gc_bench_producer, &bt[started]) != 0) {
+			/* Ends the consumer */
+			bt[started].ring[0] = NULL;
+			__atomic_store_n(&bt[started].head, 1, __ATOMIC_RELEASE);
+			pthread_join(bt[started].peer_tid, NULL);
+			gc_objdel(bt[started].gc);
+			pthread_mutex_destroy(&bt[started].lock);
+			break;
+		}
+	}
+	if (started < n) {
+		EPRN("Could only start %d of %d threads\n", started, n);
+		ret = -1;
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(bt[i].tid, NULL);
+		if (pipe) {
+			pthread_join(bt[i].peer_tid, NULL);
+			gc_objdel(bt[i].gc);
+			pthread_mutex_destroy(&bt[i].lock);
+		}
+	}
+	return ret;
+}
+
+/*
+ * Every thread runs batches of alloc+free on its own gc object, with the
+ * plain system backend and with the per-thread caches. The pipe runs
+ * free every block on another thread than the one that allocated it.
+ */
+__attribute__ ((visibility ("default")))
+int gc_bench_threads(int max_threads)
+{
+	static const uint32_t flags_tab[] = { 0, GC_F_TCACHE };
+	static const char *name_tab[] = { "system", "tcache" };
+	gc_bench_thread_t *bt;
+	uint64_t start, elapsed;
+	unsigned int f;
+	int pipe, n;
+	int ret = 0;
+
+	if (max_threads <= 0) {
+		return -1;
+	}
+	bt = calloc(max_threads, sizeof(gc_bench_thread_t));
+	if (bt == NULL) {
+		return -1;
+	}
+	for (pipe = 0; pipe < 2 && ret == 0; pipe++) {
+		for (f = 0; f < sizeof(flags_tab) / sizeof(flags_tab[0]) && ret == 0; f++) {
+			/* Powers of two, then max_threads itself */
+			for (n = 1; n <= max_threads && ret == 0;
+			     n = (n < max_threads && n * 2 > max_threads) ? max_threads : n * 2) {
+				start = gc_bench_nsec();
+				ret = gc_bench_run(bt, n, flags_tab[f], pipe);
+				elapsed = gc_bench_nsec() - start;
+
+				IPRN("%s %s %3d %s: %8.2f Mops/s total, %6.2f Mops/s per %s\n",
+				     name_tab[f], pipe ? "pipe" : "local", n, pipe ? "pairs" : "threads",
+				     (double)n * GC_BENCH_THREAD_OPS * 1000.0 / elapsed,
+				     (double)GC_BENCH_THREAD_OPS * 1000.0 / elapsed,
+				     pipe ? "pair" : "thread");
+			}
+		}
+	}
+	free(bt);
+	return ret;
+}
+
+#define GC_BENCH_BACKEND_BATCH	256
+
+/*
+ * Batches of allocs of random size up to 2 KiB, then frees in random
+ * order, through the libc backend and through the bundled pool backend.
+ */
+__attribute__ ((visibility ("default")))
+int gc_bench_backend(void)
+{
+	const gc_backend_t *backend_tab[] = { NULL, gc_backend_pool() };
+	static const char *name_tab[] = { "libc", "pool" };
+	void *blocks[GC_BENCH_BACKEND_BATCH];
+	void *tmp;
+	gcobj_t *tobj;
+	uint64_t start, elapsed;
+	uint32_t seed;
+	uint32_t i, j, n;
+	unsigned int b;
+
+	for (b = 0; b < sizeof(backend_tab) / sizeof(backend_tab[0]); b++) {
+		tobj = gc_objnew_ex(&(gc_attr_t){ .backend = backend_tab[b] });
+		if (tobj == NULL) {
+			return -1;
+		}
+		seed = 0x9e3779b9;
+		start = gc_bench_nsec();
+		for (i = 0; i < GC_BENCH_OPS / GC_BENCH_BACKEND_BATCH; i++) {
+			for (j = 0; j < GC_BENCH_BACKEND_BATCH; j++) {
+				blocks[j] = tobj->memalloc(tobj, gc_bench_rand(&seed) % 2048);
+			}
+			for (j = GC_BENCH_BACKEND_BATCH; j > 1; j--) {
+				n = gc_bench_rand(&seed) % j;
+				tmp = blocks[n];
+				blocks[n] = blocks[j - 1];
+				blocks[j - 1] = tmp;
+			}
+			for (j = 0; j < GC_BENCH_BACKEND_BATCH; j++) {
+				tobj->memfree(tobj, blocks[j]);
+			}
+		}
+		elapsed = gc_bench_nsec() - start;
+
+		IPRN("%s backend: %6.1f ns per alloc+free, %6.2f Mops/s\n",
+		     name_tab[b], (double)elapsed / GC_BENCH_OPS,
+		     GC_BENCH_OPS * 1000.0 / elapsed);
+		gc_objdel(tobj);
+	}
+
+	return 0;
+}
+
+#define GC_BENCH_TILED_SIZE	2048
+#define GC_BENCH_TILED_ROUNDS	8
+
+/* Sums 16x16 blocks visited column by column, as a rotation kernel does */
+static uint32_t gc_bench_blocks(const gc_surface_desc_t *desc)
+{
+	const uint32_t *p;
+	uint32_t sum = 0;
+	uint32_t bx, by, r, i;
+
+	for (bx = 0; bx < (uint32_t)desc->w; bx += 16) {
+		for (by = 0; by < (uint32_t)desc->h; by += 16) {
+			if (gc_layout_tile(desc->layout) == 16) {
+				/* A block is one tile, the order inside does not matter */
+				p = (const uint32_t *)gc_surface_tile(desc, bx / 16, by / 16);
+				for (i = 0; i < 256; i++) {
+					sum += p[i];
+				}
+				continue;
+			}
+			for (r = 0; r < 16; r++) {
+				p = (const uint32_t *)gc_surface_pixel(desc, bx, by + r);
+				for (i = 0; i < 16; i++) {
+					sum += p[i];
+				}
+			}
+		}
+	}
+	return sum;
+}
+
+/*
+ * Block-wise reads of an RGBA surface in every layout, and the cost of
+ * converting it from and to a linear buffer.
+ */
+__attribute__ ((visibility ("default")))
+int gc_bench_tiled(void)
+{
+	static const char *name_tab[] = { "linear", "tile16", "tile64", "zorder" };
+	gc_surface_desc_t desc;
+	uint32_t *lin;
+	uint64_t start, elapsed;
+	uint64_t pixels;
+	uint32_t sum = 0;
+	uint32_t layout, i;
+	gcobj_t *tobj;
+
+	tobj = gc_objnew();
+	if (tobj == NULL) {
+		return -1;
+	}
+	pixels = (uint64_t)GC_BENCH_TILED_SIZE * GC_BENCH_TILED_SIZE;
+	lin = tobj->memalign(tobj, 64, pixels * 4);
+	if (lin == NULL) {
+		gc_objdel(tobj);
+		return -1;
+	}
+	for (i = 0; i < pixels; i++) {
+		lin[i] = i;
+	}
+	for (layout = 0; layout < GC_LAYOUT_COUNT; layout++) {
+		memset(&desc, 0, sizeof(desc));
+		desc.fmt = GC_FMT_RGBA8888;
+		desc.w = GC_BENCH_TILED_SIZE;
+		desc.h = GC_BENCH_TILED_SIZE;
+		desc.layout = layout;
+		if (gc_surface_layout(&desc) < 0) {
+			break;
+		}
+		desc.d_ptr = tobj->memalign(tobj, 64, desc.size);
+		if (desc.d_ptr == NULL) {
+			break;
+		}
+
+		start = gc_bench_nsec();
+		for (i = 0; i < GC_BENCH_TILED_ROUNDS; i++) {
+			gc_surface_from_linear(&desc, lin, GC_BENCH_TILED_SIZE * 4);
+		}
+		elapsed = gc_bench_nsec() - start;
+		IPRN("%s: from linear %6.2f GB/s\n", name_tab[layout],
+		     (double)pixels * 4 * GC_BENCH_TILED_ROUNDS / elapsed);
+
+		start = gc_bench_nsec();
+		for (i = 0; i < GC_BENCH_TILED_ROUNDS; i++) {
+			sum += gc_bench_blocks(&desc);
+		}
+		elapsed = gc_bench_nsec() - start;
+		IPRN("%s: column-wise 16x16 blocks %6.3f ns per pixel\n", name_tab[layout],
+		     (double)elapsed / (pixels * GC_BENCH_TILED_ROUNDS));
+
+		start = gc_bench_nsec();
+		for (i = 0; i < GC_BENCH_TILED_ROUNDS; i++) {
+			gc_surface_to_linear(&desc, lin, GC_BENCH_TILED_SIZE * 4);
+		}
+		elapsed = gc_bench_nsec() - start;
+		IPRN("%s: to linear %6.2f GB/s\n", name_tab[layout],
+		     (double)pixels * 4 * GC_BENCH_TILED_ROUNDS / elapsed);
+		tobj->memfree(tobj, desc.d_ptr);
+	}
+	/* Keeps the sums from being optimized away */
+	IPRN("checksum %#x\n", sum);
+	gc_objdel(tobj);
+	return (layout == GC_LAYOUT_COUNT) ? 0 : -1;
+}
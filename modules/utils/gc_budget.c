@@ -0,0 +1,240 @@
+/*
+ *  gc_budget.c - Memory accounting, budgets and pressure callbacks
+ *
+ *  Copyright (C) 2018 Atanas Tulbenski <top4ester@gmail.com>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "debug.h"
+#include "gc.h"
+#include "gc_private.h"
+
+DEBUG_CREATE_CTX(GC_BUDGET, DBG_QUIET);
+
+#define GC_PRESSURE_MAX		16
+
+typedef struct gc_pressure_s {
+	uint32_t	seq;		/* Odd while the entry changes */
+	uint32_t	level;
+	gc_pressure_f	cb;		/* NULL for a free entry */
+	void		*arg;
+} gc_pressure_t;
+
+/* Bytes charged by all gc objects and the limit on them, 0 is unlimited */
+static uint64_t gc_budget_used;
+static uint64_t gc_budget_high;
+static uint64_t gc_budget_limit;
+
+/*
+ * Entries change under gc_pressure_lock only, and every change is
+ * bracketed by seq, so the charge path reads them without the lock and
+ * skips an entry that changed while it was read.
+ */
+static gc_pressure_t gc_pressure_tab[GC_PRESSURE_MAX];
+static uint32_t gc_pressure_count;
+static pthread_mutex_t gc_pressure_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Fires every watermark the global usage went across from below */
+static void gc_pressure_check(uint64_t before, uint64_t after)
+{
+	gc_pressure_t *p;
+	gc_pressure_f cb;
+	uint64_t limit;
+	uint64_t mark;
+	uint32_t count;
+	uint32_t level;
+	uint32_t seq;
+	uint32_t i;
+	void *arg;
+
+	limit = __atomic_load_n(&gc_budget_limit, __ATOMIC_RELAXED);
+	if (limit == 0) {
+		return;
+	}
+	count = __atomic_load_n(&gc_pressure_count, __ATOMIC_ACQUIRE);
+	for (i = 0; i < count; i++) {
+		p = &gc_pressure_tab[i];
+		seq = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE);
+		cb = __atomic_load_n(&p->cb, __ATOMIC_RELAXED);
+		level = __atomic_load_n(&p->level, __ATOMIC_RELAXED);
+		arg = __atomic_load_n(&p->arg, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if ((seq & 1) || cb == NULL || __atomic_load_n(&p->seq, __ATOMIC_RELAXED) != seq) {
+			continue;
+		}
+		mark = limit / 100 * level + limit % 100 * level / 100;
+		if (before < mark && after >= mark) {
+			cb(level, after, limit, arg);
+		}
+	}
+}
+
+/*
+ * Accounts bytes to a gc, -1 when that would exceed its or the global
+ * budget. NULL gc_prv_p charges the process only, for shared storage.
+ */
+int gc_account_charge(gcobj_private_t *gc_prv_p, uint64_t bytes)
+{
+	uint64_t used;
+	uint64_t limit;
+
+	if (gc_prv_p != NULL) {
+		used = __atomic_add_fetch(&gc_prv_p->memused, bytes, __ATOMIC_RELAXED);
+		if (gc_prv_p->budget != 0 && used > gc_prv_p->budget) {
+			__atomic_sub_fetch(&gc_prv_p->memused, bytes, __ATOMIC_RELAXED);
+			EPRN("gc budget of %llu B exceeded\n", (unsigned long long)gc_prv_p->budget);
+			return -1;
+		}
+		if (used > gc_prv_p->peak) {
+			__atomic_store_n(&gc_prv_p->peak, used, __ATOMIC_RELAXED);
+		}
+	}
+	used = __atomic_add_fetch(&gc_budget_used, bytes, __ATOMIC_RELAXED);
+	limit = __atomic_load_n(&gc_budget_limit, __ATOMIC_RELAXED);
+	if (limit != 0 && used > limit) {
+		__atomic_sub_fetch(&gc_budget_used, bytes, __ATOMIC_RELAXED);
+		if (gc_prv_p != NULL) {
+			__atomic_sub_fetch(&gc_prv_p->memused, bytes, __ATOMIC_RELAXED);
+		}
+		EPRN("Global budget of %llu B exceeded\n", (unsigned long long)limit);
+		return -1;
+	}
+	gc_pressure_check(used - bytes, used);
+	limit = __atomic_load_n(&gc_budget_high, __ATOMIC_RELAXED);
+	while (used > limit &&
+	       !__atomic_compare_exchange_n(&gc_budget_high, &limit, used, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+	if (gc_prv_p != NULL && __atomic_load_n(&gc_prv_p->tree_parent, __ATOMIC_RELAXED) != NULL) {
+		gc_tree_charge(gc_prv_p, bytes);
+	}
+	return 0;
+}
+
+/* NULL gc_prv_p for blocks no gc owns any more, see gc_account_disown */
+void gc_account_uncharge(gcobj_private_t *gc_prv_p, uint64_t bytes)
+{
+	if (gc_prv_p != NULL) {
+		__atomic_sub_fetch(&gc_prv_p->memused, bytes, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&gc_prv_p->tree_parent, __ATOMIC_RELAXED) != NULL) {
+			gc_tree_charge(gc_prv_p, -(int64_t)bytes);
+		}
+	}
+	__atomic_sub_fetch(&gc_budget_used, bytes, __ATOMIC_RELAXED);
+}
+
+/* A shared block left its gc but stays charged to the process */
+void gc_account_disown(gcobj_private_t *gc_prv_p, uint64_t bytes)
+{
+	__atomic_sub_fetch(&gc_prv_p->memused, bytes, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&gc_prv_p->tree_parent, __ATOMIC_RELAXED) != NULL) {
+		gc_tree_charge(gc_prv_p, -(int64_t)bytes);
+	}
+}
+
+/* Limits what one gc object may hold, 0 removes the limit */
+__attribute__ ((visibility ("default")))
+void gc_set_budget(gcobj_t *this, uint64_t bytes)
+{
+	gcobj_private_t *gc_prv_p;
+
+	if (this == NULL) {
+		__atomic_store_n(&gc_budget_limit, bytes, __ATOMIC_RELAXED);
+		return;
+	}
+	gc_prv_p = (gcobj_private_t *) this->private_p;
+	gc_prv_p->budget = bytes;
+}
+
+/* Bytes held by one gc object, or by all of them for NULL */
+__attribute__ ((visibility ("default")))
+uint64_t gc_memused(gcobj_t *this)
+{
+	gcobj_private_t *gc_prv_p;
+
+	if (this == NULL) {
+		return __atomic_load_n(&gc_budget_used, __ATOMIC_RELAXED);
+	}
+	gc_prv_p = (gcobj_private_t *) this->private_p;
+	return __atomic_load_n(&gc_prv_p->memused, __ATOMIC_RELAXED);
+}
+
+/* Under gc_pressure_lock */
+static void gc_pressure_set(gc_pressure_t *p, uint32_t level, gc_pressure_f cb, void *arg)
+{
+	__atomic_store_n(&p->seq, p->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&p->level, level, __ATOMIC_RELAXED);
+	__atomic_store_n(&p->cb, cb, __ATOMIC_RELAXED);
+	__atomic_store_n(&p->arg, arg, __ATOMIC_RELAXED);
+	__atomic_store_n(&p->seq, p->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * cb runs whenever the global usage rises through level percent of the
+ * global budget. It is called on the allocating thread with no gc lock
+ * held, so it may free memory, trim caches or allocate.
+ */
+__attribute__ ((visibility ("default")))
+int gc_register_pressure(uint32_t level, gc_pressure_f cb, void *arg)
+{
+	uint32_t i;
+
+	if (cb == NULL || level == 0 || level > 100) {
+		return -1;
+	}
+	pthread_mutex_lock(&gc_pressure_lock);
+	for (i = 0; i < gc_pressure_count && gc_pressure_tab[i].cb != NULL; i++) {
+	}
+	if (i >= GC_PRESSURE_MAX) {
+		pthread_mutex_unlock(&gc_pressure_lock);
+		EPRN("No room for another pressure callback\n");
+		return -1;
+	}
+	gc_pressure_set(&gc_pressure_tab[i], level, cb, arg);
+	if (i == gc_pressure_count) {
+		__atomic_store_n(&gc_pressure_count, i + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&gc_pressure_lock);
+	return 0;
+}
+
+/*
+ * Removes a callback registered with the same cb and arg. It may still
+ * be running on another thread when this returns.
+ */
+__attribute__ ((visibility ("default")))
+int gc_unregister_pressure(gc_pressure_f cb, void *arg)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&gc_pressure_lock);
+	for (i = 0; i < gc_pressure_count; i++) {
+		if (gc_pressure_tab[i].cb == cb && gc_pressure_tab[i].arg == arg) {
+			gc_pressure_set(&gc_pressure_tab[i], 0, NULL, NULL);
+			pthread_mutex_unlock(&gc_pressure_lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&gc_pressure_lock);
+	return -1;
+}
+
+/* Highest global usage seen so far */
+uint64_t gc_budget_peak(void)
+{
+	return __atomic_load_n(&gc_budget_high, __ATOMIC_RELAXED);
+}
+
+void gc_budget_dump(void)
+{
+	IPRN("GLOBAL = %llu B of %llu B budget\n",
+	     (unsigned long long)__atomic_load_n(&gc_budget_used, __ATOMIC_RELAXED),
+	     (unsigned long long)__atomic_load_n(&gc_budget_limit, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,361 @@
+/*
+ *  gc_intern.c - Interned strings shared by all gc objects
+ *
+ *  Copyright (C) 2018 Atanas Tulbenski <top4ester@gmail.com>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <pthread.h>
+
+#include "gc.h"
+#include "gc_private.h"
+
+#define GC_INTERN_STRIPES	16	/* Top 4 bits of the hash */
+#define GC_INTERN_BUCKETS_MIN	64
+
+/*
+ * The gc_mem_t in front of the string lets gc_free, gc_retain and
+ * gc_release tell an interned string from a block. Its index is never
+ * a slot, and the entry keeps its own 32 bit count, since thousands of
+ * equal names would overflow the 16 bit block one.
+ */
+struct gc_intern_s {
+	gc_intern_t	*next;
+	uint32_t	hash;
+	uint32_t	refs;		/* Under the stripe lock */
+	gc_mem_t	mem;
+	char		str[];
+};
+
+typedef struct gc_intern_stripe_s {
+	pthread_mutex_t	lock;
+	gc_intern_t	**buckets;
+	uint32_t	nbuckets;
+	uint32_t	count;
+} __attribute__ ((aligned (64))) gc_intern_stripe_t;
+
+static gc_intern_stripe_t gc_intern_tab[GC_INTERN_STRIPES] = {
+	[0 ... GC_INTERN_STRIPES - 1] = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	},
+};
+
+/* Bytes the table holds, and what private copies of all references would take */
+static uint64_t gc_intern_stored;
+static uint64_t gc_intern_requested;
+
+static uint32_t gc_intern_hash(const char *str, size_t *len)
+{
+	const uint8_t *p = (const uint8_t *)str;
+	uint32_t hash = 2166136261u;
+
+	while (*p != '\0') {
+		hash = (hash ^ *p++) * 16777619u;
+	}
+	*len = (const char *)p - str;
+	return hash;
+}
+
+static gc_intern_t *gc_intern_of(const char *str)
+{
+	return (gc_intern_t *)(str - offsetof(gc_intern_t, str));
+}
+
+/* Size of a private gc_strdup copy of the string */
+static uint64_t gc_intern_copy_size(const gc_intern_t *entry)
+{
+	return entry->mem.size + sizeof(gc_mem_t);
+}
+
+static void gc_intern_grow(gc_intern_stripe_t *stripe)
+{
+	gc_intern_t **buckets;
+	gc_intern_t *entry;
+	gc_intern_t *next;
+	uint32_t nbuckets;
+	uint32_t i, b;
+
+	nbuckets = stripe->nbuckets ? stripe->nbuckets * 2 : GC_INTERN_BUCKETS_MIN;
+	buckets = calloc(nbuckets, sizeof(gc_intern_t *));
+	if (buckets == NULL) {
+		/* Longer chains, but still correct */
+		return;
+	}
+	for (i = 0; i < stripe->nbuckets; i++) {
+		for (entry = stripe->buckets[i]; entry != NULL; entry = next) {
+			next = entry->next;
+			b = entry->hash & (nbuckets - 1);
+			entry->next = buckets[b];
+			buckets[b] = entry;
+		}
+	}
+	free(stripe->buckets);
+	stripe->buckets = buckets;
+	stripe->nbuckets = nbuckets;
+}
+
+/* Under the stripe lock */
+static gc_intern_t *gc_intern_lookup(gc_intern_stripe_t *stripe, const char *str,
+				     uint32_t hash, size_t len)
+{
+	gc_intern_t *entry;
+
+	if (stripe->nbuckets == 0) {
+		return NULL;
+	}
+	for (entry = stripe->buckets[hash & (stripe->nbuckets - 1)]; entry != NULL;
+	     entry = entry->next) {
+		if (entry->hash == hash && entry->mem.size == len + 1 &&
+		    memcmp(entry->str, str, len) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * The canonical entry of str with a reference taken, created on first use.
+ * A new entry is charged with the stripe unlocked, since pressure callbacks
+ * may intern strings themselves, so another thread can insert it meanwhile.
+ */
+static gc_intern_t *gc_intern_get(const char *str, uint32_t hash, size_t len)
+{
+	gc_intern_stripe_t *stripe = &gc_intern_tab[hash >> 28];
+	gc_intern_t *entry;
+	gc_intern_t *found;
+	size_t size = sizeof(gc_intern_t) + len + 1;
+
+	pthread_mutex_lock(&stripe->lock);
+	entry = gc_intern_lookup(stripe, str, hash, len);
+	if (entry != NULL) {
+		entry->refs++;
+		pthread_mutex_unlock(&stripe->lock);
+		return entry;
+	}
+	pthread_mutex_unlock(&stripe->lock);
+
+	if (gc_account_charge(NULL, size) < 0) {
+		return NULL;
+	}
+	entry = malloc(size);
+	if (entry == NULL) {
+		gc_account_uncharge(NULL, size);
+		return NULL;
+	}
+	entry->hash = hash;
+	entry->refs = 1;
+	entry->mem.size = len + 1;
+	entry->mem.index = GC_SLOT_NONE;
+	entry->mem.mem_type = GC_MEM_INTERN;
+	entry->mem.aux = 0;
+	entry->mem.refs = 0;
+	memcpy(entry->str, str, len + 1);
+
+	pthread_mutex_lock(&stripe->lock);
+	found = gc_intern_lookup(stripe, str, hash, len);
+	if (found == NULL && stripe->count >= stripe->nbuckets) {
+		gc_intern_grow(stripe);
+	}
+	if (found != NULL || stripe->nbuckets == 0) {
+		if (found != NULL) {
+			found->refs++;
+		}
+		pthread_mutex_unlock(&stripe->lock);
+		gc_account_uncharge(NULL, size);
+		free(entry);
+		return found;
+	}
+	entry->next = stripe->buckets[hash & (stripe->nbuckets - 1)];
+	stripe->buckets[hash & (stripe->nbuckets - 1)] = entry;
+	stripe->count++;
+	pthread_mutex_unlock(&stripe->lock);
+	__atomic_add_fetch(&gc_intern_stored, size, __ATOMIC_RELAXED);
+	return entry;
+}
+
+static void gc_intern_put(gc_intern_t *entry)
+{
+	gc_intern_stripe_t *stripe = &gc_intern_tab[entry->hash >> 28];
+	gc_intern_t **entry_pp;
+	uint64_t size;
+
+	pthread_mutex_lock(&stripe->lock);
+	if (--entry->refs != 0) {
+		pthread_mutex_unlock(&stripe->lock);
+		return;
+	}
+	for (entry_pp = &stripe->buckets[entry->hash & (stripe->nbuckets - 1)];
+	     *entry_pp != entry; entry_pp = &(*entry_pp)->next) {
+	}
+	*entry_pp = entry->next;
+	stripe->count--;
+	pthread_mutex_unlock(&stripe->lock);
+
+	size = sizeof(gc_intern_t) + entry->mem.size;
+	__atomic_sub_fetch(&gc_intern_stored, size, __ATOMIC_RELAXED);
+	gc_account_uncharge(NULL, size);
+	free(entry);
+}
+
+/*
+ * The entries a gc holds form an open addressed set keyed by the string
+ * hash, so a gc keeps one reference per string however often it asks.
+ */
+static gc_intern_t **gc_intern_held(gcobj_private_t *gc_prv_p, const char *str,
+				    uint32_t hash, size_t len)
+{
+	gc_intern_t **held;
+	uint32_t i;
+
+	for (i = hash & (gc_prv_p->intern_cap - 1); ; i = (i + 1) & (gc_prv_p->intern_cap - 1)) {
+		held = &gc_prv_p->intern[i];
+		if (*held == NULL || ((*held)->hash == hash && (*held)->mem.size == len + 1 &&
+				      memcmp((*held)->str, str, len) == 0)) {
+			return held;
+		}
+	}
+}
+
+static int gc_intern_held_grow(gcobj_private_t *gc_prv_p)
+{
+	gc_intern_t **old = gc_prv_p->intern;
+	uint32_t old_cap = gc_prv_p->intern_cap;
+	uint32_t cap = old_cap ? old_cap * 2 : 8;
+	uint32_t i;
+
+	gc_prv_p->intern = calloc(cap, sizeof(gc_intern_t *));
+	if (gc_prv_p->intern == NULL) {
+		gc_prv_p->intern = old;
+		return -1;
+	}
+	gc_prv_p->intern_cap = cap;
+	for (i = 0; i < old_cap; i++) {
+		if (old[i] != NULL) {
+			*gc_intern_held(gc_prv_p, old[i]->str, old[i]->hash,
+					old[i]->mem.size - 1) = old[i];
+		}
+	}
+	free(old);
+	return 0;
+}
+
+/*
+ * Returns the canonical copy of str, so equal strings interned through
+ * any gc object compare equal by pointer. The string is read-only and
+ * stays valid until this gc is reset or deleted, memfree ignores it.
+ */
+__attribute__ ((visibility ("default")))
+const char *gc_intern(gcobj_t *this, const char *str)
+{
+	gcobj_private_t *gc_prv_p;
+	gc_intern_t **held;
+	gc_intern_t *entry;
+	uint32_t hash;
+	size_t len;
+
+	if (this == NULL || str == NULL) {
+		return NULL;
+	}
+	gc_prv_p = (gcobj_private_t *) this->private_p;
+	hash = gc_intern_hash(str, &len);
+
+	/* Kept at most 3/4 full */
+	if ((gc_prv_p->intern_count + 1) * 4 > gc_prv_p->intern_cap * 3 &&
+	    gc_intern_held_grow(gc_prv_p) < 0) {
+		return NULL;
+	}
+	held = gc_intern_held(gc_prv_p, str, hash, len);
+	if (*held != NULL) {
+		return (*held)->str;
+	}
+	entry = gc_intern_get(str, hash, len);
+	if (entry == NULL) {
+		return NULL;
+	}
+	*held = entry;
+	gc_prv_p->intern_count++;
+	GC_STAT_ADD(gc_prv_p->intern_bytes, gc_intern_copy_size(entry));
+	__atomic_add_fetch(&gc_intern_requested, gc_intern_copy_size(entry), __ATOMIC_RELAXED);
+	return entry->str;
+}
+
+/*
+ * The interned copy of str if there is one, without taking a reference.
+ * Good for comparing against strings held elsewhere, NULL means none of
+ * them can be equal.
+ */
+__attribute__ ((visibility ("default")))
+const char *gc_intern_find(const char *str)
+{
+	gc_intern_stripe_t *stripe;
+	gc_intern_t *entry;
+	const char *found = NULL;
+	uint32_t hash;
+	size_t len;
+
+	hash = gc_intern_hash(str, &len);
+	stripe = &gc_intern_tab[hash >> 28];
+
+	pthread_mutex_lock(&stripe->lock);
+	entry = gc_intern_lookup(stripe, str, hash, len);
+	if (entry != NULL) {
+		found = entry->str;
+	}
+	pthread_mutex_unlock(&stripe->lock);
+	return found;
+}
+
+/* gc_retain and gc_release of an interned string */
+void gc_intern_retain(const char *str)
+{
+	gc_intern_t *entry = gc_intern_of(str);
+	gc_intern_stripe_t *stripe = &gc_intern_tab[entry->hash >> 28];
+
+	pthread_mutex_lock(&stripe->lock);
+	entry->refs++;
+	pthread_mutex_unlock(&stripe->lock);
+	__atomic_add_fetch(&gc_intern_requested, gc_intern_copy_size(entry), __ATOMIC_RELAXED);
+}
+
+void gc_intern_release(const char *str)
+{
+	gc_intern_t *entry = gc_intern_of(str);
+
+	__atomic_sub_fetch(&gc_intern_requested, gc_intern_copy_size(entry), __ATOMIC_RELAXED);
+	gc_intern_put(entry);
+}
+
+/* Drops every string the gc interned, on reset and delete */
+void gc_intern_drop(gcobj_private_t *gc_prv_p)
+{
+	uint64_t bytes = 0;
+	uint32_t i;
+
+	for (i = 0; i < gc_prv_p->intern_cap && gc_prv_p->intern_count != 0; i++) {
+		if (gc_prv_p->intern[i] == NULL) {
+			continue;
+		}
+		bytes += gc_intern_copy_size(gc_prv_p->intern[i]);
+		gc_intern_put(gc_prv_p->intern[i]);
+		gc_prv_p->intern[i] = NULL;
+		gc_prv_p->intern_count--;
+	}
+	__atomic_sub_fetch(&gc_intern_requested, bytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&gc_prv_p->intern_bytes, 0, __ATOMIC_RELAXED);
+	gc_prv_p->intern_count = 0;
+}
+
+/* Bytes interning saved over private copies, for gc_stats */
+uint64_t gc_intern_saved(void)
+{
+	uint64_t requested = __atomic_load_n(&gc_intern_requested, __ATOMIC_RELAXED);
+	uint64_t stored = __atomic_load_n(&gc_intern_stored, __ATOMIC_RELAXED);
+
+	return (requested > stored) ? requested - stored : 0;
+}
@@ -0,0 +1,401 @@
+/*
+ *  gc_mark.c - Incremental mark and sweep for gc owned blocks
+ *
+ *  Copyright (C) 2018 Atanas Tulbenski <top4ester@gmail.com>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <time.h>
+
+#include "debug.h"
+#include "gc.h"
+#include "gc_private.h"
+
+DEBUG_CREATE_CTX(GC_MARK, DBG_QUIET);
+
+#define GC_TRACE_TYPES		64
+#define GC_TRACE_CHECK		64	/* Work items between two clock reads */
+
+typedef enum gc_trace_phase_e {
+	GC_TRACE_IDLE = 0,
+	GC_TRACE_MARK,
+	GC_TRACE_SWEEP,
+} gc_trace_phase_t;
+
+/*
+ * Collector state of one gc. Marks live in a bitmap indexed by slot,
+ * sized when the cycle starts. Slots above it were allocated during the
+ * cycle and count as marked, as do reused slots (allocate black).
+ */
+struct gc_trace_s {
+	gc_trace_phase_t	phase;
+	gc_trace_f		trace[GC_TRACE_TYPES];
+	uint32_t		type_count;
+	uint8_t			*types;		/* Per slot, 0 is a leaf */
+	uint32_t		types_len;
+	void			***roots;
+	uint32_t		root_count;
+	uint32_t		root_cap;
+	uint64_t		*mark;
+	uint32_t		mark_len;	/* Slots covered by mark */
+	uint32_t		*grey;		/* Slots to scan, mark_len entries */
+	uint32_t		grey_count;
+	uint32_t		sweep_pos;
+	gc_collect_stats_t	stats;
+};
+
+static uint64_t gc_trace_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static gc_trace_t *gc_trace_get(gcobj_t *this)
+{
+	gcobj_private_t *gc_prv_p;
+
+	if (this == NULL) {
+		return NULL;
+	}
+	gc_prv_p = (gcobj_private_t *) this->private_p;
+	if (gc_prv_p->arena != NULL) {
+		EPRN("Arena blocks can not be collected\n");
+		return NULL;
+	}
+	if (gc_prv_p->trace == NULL) {
+		gc_prv_p->trace = calloc(1, sizeof(gc_trace_t));
+	}
+	return gc_prv_p->trace;
+}
+
+/* Slot of a block of this gc, -1 for NULL, 2D and foreign blocks */
+static int64_t gc_trace_slot(gcobj_private_t *gc_prv_p, void *memptr)
+{
+	gc_mem_t *gc_mem;
+
+	if (memptr == NULL) {
+		return -1;
+	}
+	gc_mem = (gc_mem_t *)memptr - 1;
+	if (gc_mem->index >= gc_prv_p->sp_index || gc_prv_p->sp[gc_mem->index] != gc_mem ||
+	    gc_mem->mem_type == GC_MEM_2D) {
+		return -1;
+	}
+	return gc_mem->index;
+}
+
+static int gc_trace_marked(gc_trace_t *trace, uint32_t i)
+{
+	return i >= trace->mark_len || (trace->mark[i / 64] & (1ULL << (i % 64)));
+}
+
+/* A slot is pushed once per cycle at most, so grey never overflows */
+static void gc_trace_shade(gc_trace_t *trace, uint32_t i)
+{
+	if (gc_trace_marked(trace, i)) {
+		return;
+	}
+	trace->mark[i / 64] |= 1ULL << (i % 64);
+	if (i >= trace->types_len || trace->types[i] == 0) {
+		return;
+	}
+	trace->grey[trace->grey_count++] = i;
+}
+
+/*
+ * Marks a block reachable. Trace callbacks call it for every pointer
+ * they hold, and during a cycle it is the write barrier: storing a
+ * block pointer into another block must be followed by gc_mark on it.
+ */
+__attribute__ ((visibility ("default")))
+void gc_mark(gcobj_t *this, void *memptr)
+{
+	gcobj_private_t *gc_prv_p;
+	int64_t i;
+
+	if (this == NULL) {
+		return;
+	}
+	gc_prv_p = (gcobj_private_t *) this->private_p;
+	if (gc_prv_p->trace == NULL || gc_prv_p->trace->phase != GC_TRACE_MARK) {
+		return;
+	}
+	i = gc_trace_slot(gc_prv_p, memptr);
+	if (i >= 0) {
+		gc_trace_shade(gc_prv_p->trace, i);
+	}
+}
+
+/* Called by gc_slot_get, blocks born during a cycle survive it */
+void gc_trace_alloc(gcobj_private_t *gc_prv_p, uint32_t i)
+{
+	gc_trace_t *trace = gc_prv_p->trace;
+
+	if (i < trace->types_len) {
+		trace->types[i] = 0;
+	}
+	if (trace->phase != GC_TRACE_IDLE && i < trace->mark_len) {
+		trace->mark[i / 64] |= 1ULL << (i % 64);
+	}
+}
+
+/*
+ * memrealloc moved a block to slot new_i, which keeps its type. The new
+ * slot counts as marked during a cycle, so a typed block is scanned
+ * right away or its children would be swept.
+ */
+void gc_trace_move(gcobj_private_t *gc_prv_p, uint32_t old_i, uint32_t new_i)
+{
+	gc_trace_t *trace = gc_prv_p->trace;
+	uint8_t *tempmemp;
+	uint8_t type;
+
+	if (old_i >= trace->types_len || trace->types[old_i] == 0) {
+		return;
+	}
+	type = trace->types[old_i];
+	if (new_i >= trace->types_len) {
+		tempmemp = realloc(trace->types, gc_prv_p->sp_top + 1);
+		if (tempmemp == NULL) {
+			return;
+		}
+		memset(&tempmemp[trace->types_len], 0, gc_prv_p->sp_top + 1 - trace->types_len);
+		trace->types = tempmemp;
+		trace->types_len = gc_prv_p->sp_top + 1;
+	}
+	trace->types[new_i] = type;
+	if (trace->phase == GC_TRACE_MARK) {
+		trace->trace[type - 1](gc_prv_p->gc, (gc_mem_t *)gc_prv_p->sp[new_i] + 1);
+	}
+}
+
+/* Registers how blocks of a type are traced, returns the type for gc_set_type */
+__attribute__ ((visibility ("default")))
+int gc_trace_type(gcobj_t *this, gc_trace_f trace_cb)
+{
+	gc_trace_t *trace = gc_trace_get(this);
+
+	if (trace == NULL || trace_cb == NULL || trace->type_count >= GC_TRACE_TYPES) {
+		return -1;
+	}
+	trace->trace[trace->type_count++] = trace_cb;
+	return trace->type_count;
+}
+
+/* Blocks without a type are leaves, their contents are never traced */
+__attribute__ ((visibility ("default")))
+int gc_set_type(gcobj_t *this, void *memptr, int type)
+{
+	gc_trace_t *trace = gc_trace_get(this);
+	gcobj_private_t *gc_prv_p;
+	uint8_t *tempmemp;
+	int64_t i;
+
+	if (trace == NULL || type < 0 || (uint32_t)type > trace->type_count) {
+		return -1;
+	}
+	gc_prv_p = (gcobj_private_t *) this->private_p;
+	i = gc_trace_slot(gc_prv_p, memptr);
+	if (i < 0) {
+		return -1;
+	}
+	if (i >= trace->types_len) {
+		tempmemp = realloc(trace->types, gc_prv_p->sp_top + 1);
+		if (tempmemp == NULL) {
+			return -1;
+		}
+		memset(&tempmemp[trace->types_len], 0, gc_prv_p->sp_top + 1 - trace->types_len);
+		trace->types = tempmemp;
+		trace->types_len = gc_prv_p->sp_top + 1;
+	}
+	trace->types[i] = type;
+	/* A typed block may already hold pointers scanned by nobody */
+	if (trace->phase == GC_TRACE_MARK && !gc_trace_marked(trace, i)) {
+		gc_trace_shade(trace, i);
+	}
+	return 0;
+}
+
+/* root is the address of a pointer variable, read at every cycle */
+__attribute__ ((visibility ("default")))
+int gc_add_root(gcobj_t *this, void **root)
+{
+	gc_trace_t *trace = gc_trace_get(this);
+	void ***tempmemp;
+
+	if (trace == NULL || root == NULL) {
+		return -1;
+	}
+	if (trace->root_count == trace->root_cap) {
+		tempmemp = realloc(trace->roots, (trace->root_cap * 2 + 8) * sizeof(void **));
+		if (tempmemp == NULL) {
+			return -1;
+		}
+		trace->roots = tempmemp;
+		trace->root_cap = trace->root_cap * 2 + 8;
+	}
+	trace->roots[trace->root_count++] = root;
+	return 0;
+}
+
+__attribute__ ((visibility ("default")))
+void gc_del_root(gcobj_t *this, void **root)
+{
+	gcobj_private_t *gc_prv_p;
+	gc_trace_t *trace;
+	uint32_t i;
+
+	if (this == NULL) {
+		return;
+	}
+	gc_prv_p = (gcobj_private_t *) this->private_p;
+	trace = gc_prv_p->trace;
+	if (trace == NULL) {
+		return;
+	}
+	for (i = 0; i < trace->root_count; i++) {
+		if (trace->roots[i] == root) {
+			trace->roots[i] = trace->roots[--trace->root_count];
+			return;
+		}
+	}
+}
+
+static void gc_trace_roots(gcobj_private_t *gc_prv_p, gc_trace_t *trace)
+{
+	uint32_t i;
+	int64_t slot;
+
+	for (i = 0; i < trace->root_count; i++) {
+		slot = gc_trace_slot(gc_prv_p, *trace->roots[i]);
+		if (slot >= 0) {
+			gc_trace_shade(trace, slot);
+		}
+	}
+}
+
+static int gc_trace_start(gcobj_private_t *gc_prv_p, gc_trace_t *trace)
+{
+	uint32_t words = (gc_prv_p->sp_index + 63) / 64;
+
+	free(trace->mark);
+	free(trace->grey);
+	trace->mark = calloc(words ? words : 1, sizeof(uint64_t));
+	trace->grey = malloc((gc_prv_p->sp_index + 1) * sizeof(uint32_t));
+	if (trace->mark == NULL || trace->grey == NULL) {
+		free(trace->mark);
+		free(trace->grey);
+		trace->mark = NULL;
+		trace->grey = NULL;
+		trace->mark_len = 0;
+		return -1;
+	}
+	trace->mark_len = gc_prv_p->sp_index;
+	trace->grey_count = 0;
+	trace->sweep_pos = 0;
+	memset(&trace->stats, 0, sizeof(trace->stats));
+	trace->phase = GC_TRACE_MARK;
+	gc_trace_roots(gc_prv_p, trace);
+	return 0;
+}
+
+/*
+ * Runs the collector of a gc for about budget_us microseconds, 0 meaning
+ * a whole cycle. Returns 1 when a cycle completed and stats holds its
+ * result, 0 when there is work left and -1 on error.
+ */
+__attribute__ ((visibility ("default")))
+int gc_collect_step(gcobj_t *this, uint32_t budget_us, gc_collect_stats_t *stats)
+{
+	gc_trace_t *trace = gc_trace_get(this);
+	gcobj_private_t *gc_prv_p;
+	gc_mem_t *gc_mem;
+	uint64_t deadline = 0;
+	uint32_t work = 0;
+	uint32_t i;
+
+	if (trace == NULL) {
+		return -1;
+	}
+	gc_prv_p = (gcobj_private_t *) this->private_p;
+	if (budget_us != 0) {
+		deadline = gc_trace_usec() + budget_us;
+	}
+	if (trace->phase == GC_TRACE_IDLE && gc_trace_start(gc_prv_p, trace) < 0) {
+		return -1;
+	}
+	trace->stats.steps++;
+
+	while (trace->phase == GC_TRACE_MARK) {
+		if (trace->grey_count == 0) {
+			/* Roots are not barriered, they may point elsewhere by now */
+			gc_trace_roots(gc_prv_p, trace);
+			if (trace->grey_count == 0) {
+				trace->phase = GC_TRACE_SWEEP;
+				break;
+			}
+		}
+		i = trace->grey[--trace->grey_count];
+		/* Freed or even reused since it was shaded */
+		if (GC_SLOT_USED(gc_prv_p->sp[i]) && trace->types[i] != 0) {
+			trace->trace[trace->types[i] - 1](this, (gc_mem_t *)gc_prv_p->sp[i] + 1);
+		}
+		if (deadline && ++work % GC_TRACE_CHECK == 0 && gc_trace_usec() >= deadline) {
+			return 0;
+		}
+	}
+
+	while (trace->sweep_pos < trace->mark_len) {
+		i = trace->sweep_pos++;
+		if (GC_SLOT_USED(gc_prv_p->sp[i]) && !gc_trace_marked(trace, i)) {
+			gc_mem = gc_prv_p->sp[i];
+			if (gc_mem->mem_type != GC_MEM_2D) {
+				trace->stats.reclaimed_bytes += gc_mem->size;
+				trace->stats.reclaimed_blocks++;
+				/* gc_slot_drop records nothing, memfree traces its own frees */
+				GC_ATRACE(GC_ATRACE_FREE, this, gc_mem + 1, 0);
+				gc_slot_drop(gc_prv_p, i);
+			}
+		} else if (GC_SLOT_USED(gc_prv_p->sp[i])) {
+			trace->stats.live_blocks++;
+		}
+		if (deadline && ++work % GC_TRACE_CHECK == 0 && gc_trace_usec() >= deadline) {
+			return 0;
+		}
+	}
+
+	trace->phase = GC_TRACE_IDLE;
+	if (stats != NULL) {
+		*stats = trace->stats;
+	}
+	return 1;
+}
+
+/* gc_objreset dropped every block, a running cycle has nothing left */
+void gc_trace_abort(gcobj_private_t *gc_prv_p)
+{
+	gc_trace_t *trace = gc_prv_p->trace;
+
+	trace->phase = GC_TRACE_IDLE;
+	trace->grey_count = 0;
+	memset(trace->types, 0, trace->types_len);
+}
+
+void gc_trace_del(gc_trace_t *trace)
+{
+	if (trace == NULL) {
+		return;
+	}
+	free(trace->types);
+	free(trace->roots);
+	free(trace->mark);
+	free(trace->grey);
+	free(trace);
+}
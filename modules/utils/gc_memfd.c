@@ -0,0 +1,216 @@
+/*
+ *  gc_memfd.c - memfd backed shareable 2D surfaces
+ *
+ *  Copyright (C) 2018 Atanas Tulbenski <top4ester@gmail.com>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "gc.h"
+#include "gc_private.h"
+
+DEBUG_CREATE_CTX(GC_MEMFD, DBG_QUIET);
+
+#define GC_MEMFD_BUCKETS	256
+
+/*
+ * Every mapping made here is remembered by address, free2d only gets the
+ * "physical" address, which for memfd surfaces is the virtual one.
+ */
+typedef struct gc_memfd_map_s {
+	struct gc_memfd_map_s	*next;
+	void			*d_ptr;
+	size_t			size;
+	int			fd;
+} gc_memfd_map_t;
+
+static gc_memfd_map_t *gc_memfd_maps[GC_MEMFD_BUCKETS];
+static pthread_mutex_t gc_memfd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t gc_memfd_hash(void *d_ptr)
+{
+	return ((uintptr_t)d_ptr >> 12) % GC_MEMFD_BUCKETS;
+}
+
+static int gc_memfd_map_add(void *d_ptr, size_t size, int fd)
+{
+	gc_memfd_map_t *map;
+	uint32_t b = gc_memfd_hash(d_ptr);
+
+	map = malloc(sizeof(gc_memfd_map_t));
+	if (map == NULL) {
+		return -1;
+	}
+	map->d_ptr = d_ptr;
+	map->size = size;
+	map->fd = fd;
+	pthread_mutex_lock(&gc_memfd_lock);
+	map->next = gc_memfd_maps[b];
+	gc_memfd_maps[b] = map;
+	pthread_mutex_unlock(&gc_memfd_lock);
+	return 0;
+}
+
+static gc_memfd_map_t *gc_memfd_map_find(void *d_ptr, int unlink)
+{
+	gc_memfd_map_t **map_pp;
+	gc_memfd_map_t *map;
+
+	for (map_pp = &gc_memfd_maps[gc_memfd_hash(d_ptr)]; *map_pp != NULL;
+	     map_pp = &(*map_pp)->next) {
+		map = *map_pp;
+		if (map->d_ptr == d_ptr) {
+			if (unlink) {
+				*map_pp = map->next;
+			}
+			return map;
+		}
+	}
+	return NULL;
+}
+
+static int gc_memfd_map(gc_surface_desc_t *desc, int fd)
+{
+	void *d_ptr;
+
+	d_ptr = mmap(NULL, desc->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (d_ptr == MAP_FAILED) {
+		EPRN("mmap of %zu B failed: %s\n", desc->size, strerror(errno));
+		return -1;
+	}
+	if (gc_memfd_map_add(d_ptr, desc->size, fd) < 0) {
+		munmap(d_ptr, desc->size);
+		return -1;
+	}
+	desc->d_ptr = d_ptr;
+	desc->phys_ptr = d_ptr;
+	return 0;
+}
+
+__attribute__ ((visibility ("default")))
+int gc_memfd_alloc2d(gc_surface_desc_t *desc)
+{
+	int fd;
+
+	if (desc->base_align > (uint32_t)sysconf(_SC_PAGESIZE)) {
+		EPRN("memfd surfaces are only page aligned (%u requested)\n", desc->base_align);
+		return -1;
+	}
+	fd = memfd_create("gc2d", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		EPRN("memfd_create failed: %s\n", strerror(errno));
+		return -1;
+	}
+	/* Sealed size, so an importer can trust fstat */
+	if (ftruncate(fd, desc->size) < 0 ||
+	    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+		EPRN("memfd setup failed: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if (gc_memfd_map(desc, fd) < 0) {
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+__attribute__ ((visibility ("default")))
+int gc_memfd_free2d(void *physical_addr_p)
+{
+	gc_memfd_map_t *map;
+
+	pthread_mutex_lock(&gc_memfd_lock);
+	map = gc_memfd_map_find(physical_addr_p, 1);
+	pthread_mutex_unlock(&gc_memfd_lock);
+	if (map == NULL) {
+		EPRN("%p is not a memfd surface\n", physical_addr_p);
+		return -1;
+	}
+	munmap(map->d_ptr, map->size);
+	close(map->fd);
+	free(map);
+	return 0;
+}
+
+static int gc_memfd_alloc2d_legacy(int w, int h, void **physical_addr_p, void **virtual_addr_p)
+{
+	gc_surface_desc_t desc = {
+		.size = (size_t)w * h,
+	};
+
+	if (gc_memfd_alloc2d(&desc) < 0) {
+		return -1;
+	}
+	*physical_addr_p = desc.phys_ptr;
+	*virtual_addr_p = desc.d_ptr;
+	return 0;
+}
+
+/* Makes memfd the 2D backend of the process */
+__attribute__ ((visibility ("default")))
+void gc_register_memfd2d(void)
+{
+	gc_register_free2d(gc_memfd_free2d);
+	gc_register_alloc2d(gc_memfd_alloc2d_legacy);
+	gc_register_alloc2d_ex(gc_memfd_alloc2d);
+}
+
+/* Returns a new descriptor for the memfd behind d_ptr, -1 if there is none */
+int gc_memfd_export(void *d_ptr)
+{
+	gc_memfd_map_t *map;
+	int fd = -1;
+
+	pthread_mutex_lock(&gc_memfd_lock);
+	map = gc_memfd_map_find(d_ptr, 0);
+	if (map != NULL) {
+		fd = fcntl(map->fd, F_DUPFD_CLOEXEC, 0);
+	}
+	pthread_mutex_unlock(&gc_memfd_lock);
+	return fd;
+}
+
+/*
+ * Maps a received memfd, the surface is released with gc_memfd_free2d.
+ * Only fds sealed against resizing are taken, a sender shrinking one
+ * after the mapping would fault the importer.
+ */
+int gc_memfd_import(int fd, gc_surface_desc_t *desc)
+{
+	struct stat st;
+	int seals;
+	int own_fd;
+
+	seals = fcntl(fd, F_GET_SEALS);
+	if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) != (F_SEAL_SHRINK | F_SEAL_GROW)) {
+		EPRN("fd %d is not a memfd sealed against resizing\n", fd);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < desc->size) {
+		EPRN("fd %d can not back a %zu B surface\n", fd, desc->size);
+		return -1;
+	}
+	own_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (own_fd < 0) {
+		return -1;
+	}
+	if (gc_memfd_map(desc, own_fd) < 0) {
+		close(own_fd);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,183 @@
+/*
+ *  gc_mmap.c - mmap and huge page backing for large gc blocks
+ *
+ *  Copyright (C) 2018 Atanas Tulbenski <top4ester@gmail.com>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "autoconf.h"
+#include "debug.h"
+#include "gc.h"
+#include "gc_private.h"
+
+DEBUG_CREATE_CTX(GC_MMAP, DBG_QUIET);
+
+/* Defaults for builds without the module.config options */
+#ifndef CONFIG_LIBUTILS_GC_MMAP_THRESHOLD
+#define CONFIG_LIBUTILS_GC_MMAP_THRESHOLD	1024
+#endif
+#if !defined(CONFIG_LIBUTILS_GC_HUGEPAGE_NONE) && \
+    !defined(CONFIG_LIBUTILS_GC_HUGEPAGE_HUGETLB)
+#define CONFIG_LIBUTILS_GC_HUGEPAGE_MADVISE	1
+#endif
+
+#define GC_MMAP_THRESHOLD	((size_t)CONFIG_LIBUTILS_GC_MMAP_THRESHOLD * 1024)
+#define GC_MMAP_HUGE_SHIFT	21
+#define GC_MMAP_HUGE_SIZE	((size_t)1 << GC_MMAP_HUGE_SHIFT)
+#define GC_MMAP_BUCKETS		64
+
+/* 2D mappings by address, free2d only gets the address back */
+typedef struct gc_mmap_map_s {
+	struct gc_mmap_map_s	*next;
+	void			*d_ptr;
+	size_t			size;
+	uint8_t			page_shift;
+} gc_mmap_map_t;
+
+static gc_mmap_map_t *gc_mmap_maps[GC_MMAP_BUCKETS];
+static pthread_mutex_t gc_mmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint8_t gc_mmap_page_shift(void)
+{
+	return __builtin_ctzl(sysconf(_SC_PAGESIZE));
+}
+
+static size_t gc_mmap_round(size_t len, uint8_t page_shift)
+{
+	size_t mask = ((size_t)1 << page_shift) - 1;
+
+	return (len + mask) & ~mask;
+}
+
+int gc_mmap_fits(size_t blksize)
+{
+	return GC_MMAP_THRESHOLD != 0 && blksize >= GC_MMAP_THRESHOLD;
+}
+
+/*
+ * Maps len bytes of zeroed memory and reports the page size it was
+ * mapped with, gc_mmap_free needs it to unmap the whole length.
+ */
+void *gc_mmap_alloc(size_t len, uint8_t *page_shift)
+{
+	void *memres;
+
+#ifdef CONFIG_LIBUTILS_GC_HUGEPAGE_HUGETLB
+	if (len >= GC_MMAP_HUGE_SIZE) {
+		memres = mmap(NULL, gc_mmap_round(len, GC_MMAP_HUGE_SHIFT),
+			      PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (memres != MAP_FAILED) {
+			*page_shift = GC_MMAP_HUGE_SHIFT;
+			return memres;
+		}
+	}
+#endif
+	*page_shift = gc_mmap_page_shift();
+	memres = mmap(NULL, gc_mmap_round(len, *page_shift), PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memres == MAP_FAILED) {
+		EPRN("mmap of %zu B failed: %s\n", len, strerror(errno));
+		return NULL;
+	}
+#if !defined(CONFIG_LIBUTILS_GC_HUGEPAGE_NONE) && defined(MADV_HUGEPAGE)
+	if (len >= GC_MMAP_HUGE_SIZE) {
+		madvise(memres, gc_mmap_round(len, *page_shift), MADV_HUGEPAGE);
+	}
+#endif
+	return memres;
+}
+
+/* Unmapping hands the pages back, so RSS drops right away */
+void gc_mmap_free(void *memp, size_t len, uint8_t page_shift)
+{
+	munmap(memp, gc_mmap_round(len, page_shift));
+}
+
+__attribute__ ((visibility ("default")))
+int gc_mmap_alloc2d(gc_surface_desc_t *desc)
+{
+	gc_mmap_map_t *map;
+	uint32_t b;
+
+	if (desc->base_align > (uint32_t)sysconf(_SC_PAGESIZE)) {
+		EPRN("mmap surfaces are only page aligned (%u requested)\n", desc->base_align);
+		return -1;
+	}
+	map = malloc(sizeof(gc_mmap_map_t));
+	if (map == NULL) {
+		return -1;
+	}
+	map->d_ptr = gc_mmap_alloc(desc->size, &map->page_shift);
+	if (map->d_ptr == NULL) {
+		free(map);
+		return -1;
+	}
+	map->size = desc->size;
+	b = ((uintptr_t)map->d_ptr >> 12) % GC_MMAP_BUCKETS;
+	pthread_mutex_lock(&gc_mmap_lock);
+	map->next = gc_mmap_maps[b];
+	gc_mmap_maps[b] = map;
+	pthread_mutex_unlock(&gc_mmap_lock);
+
+	desc->d_ptr = map->d_ptr;
+	desc->phys_ptr = map->d_ptr;
+	return 0;
+}
+
+__attribute__ ((visibility ("default")))
+int gc_mmap_free2d(void *physical_addr_p)
+{
+	gc_mmap_map_t **map_pp;
+	gc_mmap_map_t *map = NULL;
+
+	pthread_mutex_lock(&gc_mmap_lock);
+	for (map_pp = &gc_mmap_maps[((uintptr_t)physical_addr_p >> 12) % GC_MMAP_BUCKETS];
+	     *map_pp != NULL; map_pp = &(*map_pp)->next) {
+		if ((*map_pp)->d_ptr == physical_addr_p) {
+			map = *map_pp;
+			*map_pp = map->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&gc_mmap_lock);
+	if (map == NULL) {
+		EPRN("%p is not an mmap surface\n", physical_addr_p);
+		return -1;
+	}
+	gc_mmap_free(map->d_ptr, map->size, map->page_shift);
+	free(map);
+	return 0;
+}
+
+static int gc_mmap_alloc2d_legacy(int w, int h, void **physical_addr_p, void **virtual_addr_p)
+{
+	gc_surface_desc_t desc = {
+		.size = (size_t)w * h,
+	};
+
+	if (gc_mmap_alloc2d(&desc) < 0) {
+		return -1;
+	}
+	*physical_addr_p = desc.phys_ptr;
+	*virtual_addr_p = desc.d_ptr;
+	return 0;
+}
+
+/* Makes anonymous mmap the 2D backend of the process */
+__attribute__ ((visibility ("default")))
+void gc_register_mmap2d(void)
+{
+	gc_register_free2d(gc_mmap_free2d);
+	gc_register_alloc2d(gc_mmap_alloc2d_legacy);
+	gc_register_alloc2d_ex(gc_mmap_alloc2d);
+}
@@ -0,0 +1,266 @@
+/*
+ *  gc_private.h - Simple garbage colector internals
+ *
+ *  Copyright (C) 2018 Atanas Tulbenski <top4ester@gmail.com>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#ifndef __GC_PRIVATE_H
+#define __GC_PRIVATE_H
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include "autoconf.h"
+#include "gc.h"
+
+typedef enum gc_mem_type_e {
+	GC_MEM_SYSTEM = 0,
+	GC_MEM_2D,
+	GC_MEM_SLAB,
+	GC_MEM_TCACHE,
+	GC_MEM_ALIGNED,		/* posix_memalign, header right before the payload */
+	GC_MEM_MMAP,		/* Own mapping, header at its start */
+	GC_MEM_INTERN,		/* gc_intern table entry, in no slot */
+} gc_mem_type_t;
+
+/*
+ * Header in front of every block, kept at 16 bytes so the payload keeps
+ * the malloc alignment. Surface addresses live in gc_mem2d_t.
+ */
+typedef struct gc_mem_s {
+	uint64_t	size;
+	uint32_t	index;
+	uint8_t		mem_type;	/* gc_mem_type_t */
+	uint8_t		aux;		/* GC_MEM_SYSTEM backend id, GC_MEM_TCACHE
+					   size class, GC_MEM_ALIGNED payload offset,
+					   GC_MEM_MMAP page size */
+	uint16_t	refs;		/* Atomic, the owning gc holds one */
+} __attribute__ ((aligned (16))) gc_mem_t;
+
+/* Out of line record of a 2D surface, its slot points to mem */
+#define GC_MEM2D_F_IMPORTED	(1 << 0)	/* Mapped by gc_import2d, not from the backend */
+
+typedef struct gc_mem2d_s {
+	gc_mem_t		mem;
+	gc_surface_desc_t	desc;
+	uint32_t		flags;
+	uint32_t		pins;		/* Atomic, gc_compact2d leaves pinned surfaces alone */
+} gc_mem2d_t;
+
+/*
+ * Vacated sp[] entries are chained into a free-slot list: the entry keeps
+ * the index of the next free slot shifted left and tagged with bit 0, which
+ * a gc_mem_t pointer never has. sp_free is the head of the chain.
+ */
+#define GC_SLOT_NONE		UINT32_MAX
+#define GC_SLOT_IS_FREE(__p)	((uintptr_t)(__p) & 1)
+#define GC_SLOT_USED(__p)	((__p) != NULL && !GC_SLOT_IS_FREE(__p))
+#define GC_SLOT_LINK(__next)	((void *)(((uintptr_t)(__next) << 1) | 1))
+#define GC_SLOT_NEXT(__p)	((uint32_t)((uintptr_t)(__p) >> 1))
+
+/*
+ * 2D ids are handles: the slot index in the low bits and the slot
+ * generation above it. Vacating a slot bumps its generation, so a stale
+ * handle no longer matches once the slot is reused.
+ */
+#define GC_HANDLE_SLOT_BITS	22
+#define GC_HANDLE_SLOT_MASK	((1u << GC_HANDLE_SLOT_BITS) - 1)
+#define GC_HANDLE_GEN_MASK	0x1ffu
+#define GC_HANDLE_SLOT(__h)	((uint32_t)(__h) & GC_HANDLE_SLOT_MASK)
+#define GC_HANDLE_GEN(__h)	((uint32_t)(__h) >> GC_HANDLE_SLOT_BITS)
+#define GC_HANDLE(__slot, __gen)	\
+	((int)((((uint32_t)(__gen) & GC_HANDLE_GEN_MASK) << GC_HANDLE_SLOT_BITS) | (__slot)))
+
+#define GC_SLOTS_MIN		20	/* Initial slot table size */
+
+typedef struct gc_slab_s gc_slab_t;
+typedef struct gc_arena_s gc_arena_t;
+typedef struct gc_trace_s gc_trace_t;
+typedef struct gc_intern_s gc_intern_t;
+
+typedef struct gcobj_private_s gcobj_private_t;
+
+struct gcobj_private_s {
+	void 		**sp;
+	uint16_t	*sp_gen;
+	uint32_t	*sp_tag;	/* gc_set_tag values, NULL until first used */
+	uint32_t	sp_index;
+	uint32_t	sp_top;
+	uint32_t	sp_free;
+	uint64_t	memused;	/* Atomic, see gc_budget.c */
+	uint64_t	budget;
+	uint64_t	peak;
+	uint32_t	flags;
+	uint8_t		backend;	/* System memory backend id, see gc_backend.c */
+	gc_slab_t	*slab;
+	gc_arena_t	*arena;
+	gc_trace_t	*trace;		/* Collector state, NULL until first used */
+	gc_intern_t	**intern;	/* Set of table entries this gc holds a reference on */
+	uint32_t	intern_count;
+	uint32_t	intern_cap;
+
+	/* Counters for gc_stats, see GC_STAT_ADD */
+	uint64_t	allocs;
+	uint64_t	frees;
+	uint32_t	live;
+	uint32_t	surfaces;
+	uint64_t	size_class[GC_STATS_CLASSES];
+	uint64_t	intern_bytes;
+
+	/* gc_tree links, tree_used is atomic and counts all descendants */
+	gcobj_private_t	*tree_parent;
+	gcobj_private_t	*tree_child;
+	gcobj_private_t	*tree_next;
+	gcobj_private_t	*tree_prev;
+	uint64_t	tree_used;
+
+	/* gc_pool registry links, serial is never reused unlike the address */
+	gcobj_t		*gc;
+	uint64_t	serial;
+	gcobj_private_t	*pool_next;
+	gcobj_private_t	*pool_prev;
+	uint32_t	pool_shard;
+};
+
+/*
+ * Stats counters have a single writer, the thread working on the gc,
+ * while gc_stats may read them from any thread. Relaxed loads and stores
+ * keep that race defined without a locked add on the allocation path.
+ */
+#define GC_STAT_ADD(__v, __n)	\
+	__atomic_store_n(&(__v), __atomic_load_n(&(__v), __ATOMIC_RELAXED) + (__n), __ATOMIC_RELAXED)
+
+/* Class i counts blocks of up to 16 << i bytes, the last one all larger */
+static inline uint32_t gc_stats_class(uint64_t size)
+{
+	uint32_t cls;
+
+	if (size <= 16) {
+		return 0;
+	}
+	cls = 64 - __builtin_clzll(size - 1) - 4;
+	return (cls < GC_STATS_CLASSES) ? cls : GC_STATS_CLASSES - 1;
+}
+
+static inline void gc_stats_alloc(gcobj_private_t *gc_prv_p, uint64_t size, int surface)
+{
+	GC_STAT_ADD(gc_prv_p->allocs, 1);
+	GC_STAT_ADD(gc_prv_p->live, 1);
+	GC_STAT_ADD(gc_prv_p->size_class[gc_stats_class(size)], 1);
+	if (surface) {
+		GC_STAT_ADD(gc_prv_p->surfaces, 1);
+	}
+}
+
+static inline void gc_stats_free(gcobj_private_t *gc_prv_p, int surface)
+{
+	GC_STAT_ADD(gc_prv_p->frees, 1);
+	GC_STAT_ADD(gc_prv_p->live, -1);
+	if (surface) {
+		GC_STAT_ADD(gc_prv_p->surfaces, -1);
+	}
+}
+
+/* gc.c */
+void gc_backend_free2d(void *phys_ptr);
+void gc_obj_release(gcobj_private_t *gc_prv_p);
+void gc_slot_drop(gcobj_private_t *gc_prv_p, uint32_t i);
+typedef void (*gc_pool_walk_f)(gcobj_private_t *gc_prv_p, void *arg);
+uint32_t gc_pool_walk(gc_pool_walk_f cb, void *arg);
+
+/* gc_mark.c */
+void gc_trace_alloc(gcobj_private_t *gc_prv_p, uint32_t i);
+void gc_trace_move(gcobj_private_t *gc_prv_p, uint32_t old_i, uint32_t new_i);
+void gc_trace_abort(gcobj_private_t *gc_prv_p);
+void gc_trace_del(gc_trace_t *trace);
+
+/* gc_reclaim.c */
+int gc_reclaim_wanted(gcobj_private_t *gc_prv_p);
+void gc_reclaim_push(gcobj_private_t *gc_prv_p);
+
+/* gc_budget.c */
+int gc_account_charge(gcobj_private_t *gc_prv_p, uint64_t bytes);
+void gc_account_uncharge(gcobj_private_t *gc_prv_p, uint64_t bytes);
+void gc_account_disown(gcobj_private_t *gc_prv_p, uint64_t bytes);
+void gc_budget_dump(void);
+uint64_t gc_budget_peak(void);
+
+/* gc_backend.c */
+const gc_backend_t *gc_backend_get(uint8_t id);
+int gc_backend_id(const gc_backend_t *backend);
+
+/* gc_atrace.c */
+#define GC_ATRACE_ALLOC		0
+#define GC_ATRACE_FREE		1
+#define GC_ATRACE_RESET		2	/* Every block of the gc went at once */
+
+void gc_atrace_event(uint32_t type, const void *gc, const void *ptr,
+		     uint64_t size, const void *site);
+
+/*
+ * Records an event attributed to the caller of the function using it, so
+ * it belongs in the gcobj_t entry points only. While tracing is off it
+ * costs a single, well predicted branch.
+ */
+#ifdef CONFIG_LIBUTILS_GC_ATRACE
+#define GC_ATRACE(__type, __gc, __ptr, __size)						\
+	do {										\
+		if (__builtin_expect(__atomic_load_n(&gc_atrace_enabled,		\
+						     __ATOMIC_RELAXED), 0)) {		\
+			gc_atrace_event((__type), (__gc), (__ptr), (__size),		\
+					__builtin_return_address(0));			\
+		}									\
+	} while (0)
+#else
+#define GC_ATRACE(__type, __gc, __ptr, __size)	do { } while (0)
+#endif
+
+/* gc_tree.c */
+void gc_tree_charge(gcobj_private_t *gc_prv_p, int64_t bytes);
+gcobj_private_t *gc_tree_detach(gcobj_private_t *gc_prv_p);
+
+/* gc_intern.c */
+void gc_intern_retain(const char *str);
+void gc_intern_release(const char *str);
+void gc_intern_drop(gcobj_private_t *gc_prv_p);
+uint64_t gc_intern_saved(void);
+
+/* gc_mmap.c */
+int gc_mmap_fits(size_t blksize);
+void *gc_mmap_alloc(size_t len, uint8_t *page_shift);
+void gc_mmap_free(void *memp, size_t len, uint8_t page_shift);
+
+/* gc_surface.c */
+int gc_surface_pool_get(gc_surface_desc_t *desc);
+int gc_surface_pool_put(const gc_surface_desc_t *desc);
+
+/* gc_region.c */
+void gc_region_pin(gc_mem2d_t *gc_mem2d, int delta);
+
+/* gc_memfd.c */
+int gc_memfd_export(void *d_ptr);
+int gc_memfd_import(int fd, gc_surface_desc_t *desc);
+
+/* gc_slab.c */
+gc_slab_t *gc_slab_new(void);
+void gc_slab_del(gc_slab_t *slab);
+int gc_slab_fits(size_t blksize);
+void *gc_slab_alloc(gc_slab_t *slab, size_t blksize);
+void gc_slab_free(gc_slab_t *slab, void *blk, size_t blksize);
+void gc_slab_dump(gc_slab_t *slab);
+
+/* gc_tcache.c */
+int gc_tcache_fits(size_t blksize);
+void *gc_tcache_alloc(size_t blksize);
+void gc_tcache_free(void *blk);
+
+/* gc_arena.c */
+gc_arena_t *gc_arena_new(size_t chunk_size);
+void gc_arena_del(gc_arena_t *arena);
+void *gc_arena_alloc(gc_arena_t *arena, size_t memsize);
+void gc_arena_reset(gc_arena_t *arena);
+void gc_arena_dump(gc_arena_t *arena);
+
+#endif /* __GC_PRIVATE_H */
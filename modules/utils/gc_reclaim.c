@@ -0,0 +1,133 @@
+/*
+ *  gc_reclaim.c - Background release of deleted gc objects
+ *
+ *  Copyright (C) 2018 Atanas Tulbenski <top4ester@gmail.com>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "debug.h"
+#include "gc.h"
+#include "gc_private.h"
+
+DEBUG_CREATE_CTX(GC_RECLAIM, DBG_QUIET);
+
+/*
+ * Deleted objects are pushed onto a lock-free stack, chained through
+ * pool_next as they are no longer in the registry. Only the reclaimer
+ * pops, and it takes the whole stack at once, so there is no ABA.
+ */
+typedef struct gc_reclaim_s {
+	gcobj_private_t	*head;
+	uint64_t	queued;		/* Counted before the push */
+	uint64_t	done;
+	sem_t		wake;
+	pthread_mutex_t	lock;
+	pthread_cond_t	done_cond;
+	int		running;
+} gc_reclaim_t;
+
+static gc_reclaim_t gc_reclaim = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+};
+static pthread_once_t gc_reclaim_once = PTHREAD_ONCE_INIT;
+static __thread int gc_reclaim_thread_deferred;
+
+static void *gc_reclaim_thread(void *arg)
+{
+	gcobj_private_t *list;
+	gcobj_private_t *rev;
+	gcobj_private_t *next;
+	uint64_t count;
+
+	for (;;) {
+		while (sem_wait(&gc_reclaim.wake) != 0) {
+		}
+		list = __atomic_exchange_n(&gc_reclaim.head, NULL, __ATOMIC_ACQUIRE);
+		/* Oldest first */
+		for (rev = NULL; list != NULL; list = next) {
+			next = list->pool_next;
+			list->pool_next = rev;
+			rev = list;
+		}
+		for (count = 0; rev != NULL; rev = next, count++) {
+			next = rev->pool_next;
+			gc_obj_release(rev);
+		}
+		if (count != 0) {
+			pthread_mutex_lock(&gc_reclaim.lock);
+			gc_reclaim.done += count;
+			pthread_cond_broadcast(&gc_reclaim.done_cond);
+			pthread_mutex_unlock(&gc_reclaim.lock);
+		}
+	}
+	return NULL;
+}
+
+static void gc_reclaim_init(void)
+{
+	pthread_t tid;
+
+	if (sem_init(&gc_reclaim.wake, 0, 0) != 0) {
+		EPRN("No reclaimer semaphore, deferred frees run inline\n");
+		return;
+	}
+	if (pthread_create(&tid, NULL, gc_reclaim_thread, NULL) != 0) {
+		EPRN("No reclaimer thread, deferred frees run inline\n");
+		sem_destroy(&gc_reclaim.wake);
+		return;
+	}
+	pthread_detach(tid);
+	gc_reclaim.running = 1;
+}
+
+/* gc_objdel of an object with GC_F_DEFERRED or from a deferring thread */
+int gc_reclaim_wanted(gcobj_private_t *gc_prv_p)
+{
+	return (gc_prv_p->flags & GC_F_DEFERRED) || gc_reclaim_thread_deferred;
+}
+
+/* Hands a detached object to the reclaimer, O(1) for the caller */
+void gc_reclaim_push(gcobj_private_t *gc_prv_p)
+{
+	pthread_once(&gc_reclaim_once, gc_reclaim_init);
+	if (!gc_reclaim.running) {
+		gc_obj_release(gc_prv_p);
+		return;
+	}
+	__atomic_add_fetch(&gc_reclaim.queued, 1, __ATOMIC_RELAXED);
+	gc_prv_p->pool_next = __atomic_load_n(&gc_reclaim.head, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&gc_reclaim.head, &gc_prv_p->pool_next, gc_prv_p, 1,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+	}
+	sem_post(&gc_reclaim.wake);
+}
+
+/* Makes every gc_objdel of the calling thread deferred, or inline again */
+__attribute__ ((visibility ("default")))
+void gc_set_deferred(int on)
+{
+	gc_reclaim_thread_deferred = on;
+}
+
+/*
+ * Waits until the reclaimer has caught up with every deferred delete,
+ * including ones other threads issue meanwhile. Meant for shutdown and
+ * tests, not for a steady stream of deletes.
+ */
+__attribute__ ((visibility ("default")))
+void gc_deferred_flush(void)
+{
+	pthread_mutex_lock(&gc_reclaim.lock);
+	while (gc_reclaim.done < __atomic_load_n(&gc_reclaim.queued, __ATOMIC_RELAXED)) {
+		pthread_cond_wait(&gc_reclaim.done_cond, &gc_reclaim.lock);
+	}
+	pthread_mutex_unlock(&gc_reclaim.lock);
+}
@@ -0,0 +1,492 @@
+/*
+ *  gc_region.c - Compactable region backend for 2D surfaces
+ *
+ *  Copyright (C) 2018 Atanas Tulbenski <top4ester@gmail.com>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "debug.h"
+#include "gc.h"
+#include "gc_private.h"
+
+DEBUG_CREATE_CTX(GC_REGION, DBG_QUIET);
+
+#define GC_REGION_ALIGN		64	/* Smallest surface alignment and size unit */
+#define GC_REGION_EXT_MIN	64
+
+/* A run of the region, used by one surface or free */
+typedef struct gc_region_ext_s {
+	uint64_t	off;
+	uint64_t	size;
+	uint32_t	align;
+	uint32_t	used;
+	gc_mem2d_t	*owner;		/* Set by gc_compact2d when the surface may move */
+} gc_region_ext_t;
+
+/*
+ * Extents are kept sorted by offset and cover the whole region, free
+ * neighbours are always merged. There are few surfaces, so lookups are
+ * binary searches and updates memmove the tail of the table.
+ */
+static struct {
+	pthread_mutex_t		lock;
+	uint8_t			*base;
+	uint64_t		size;
+	gc_region_ext_t		*ext;
+	uint32_t		count;
+	uint32_t		cap;
+	int			in_pass;
+	gc_compact_stats_t	pass;
+} gc_region = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t gc_region_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int gc_region_reserve(uint32_t more)
+{
+	gc_region_ext_t *ext;
+	uint32_t cap;
+
+	if (gc_region.count + more <= gc_region.cap) {
+		return 0;
+	}
+	cap = gc_region.cap ? gc_region.cap * 2 : GC_REGION_EXT_MIN;
+	ext = realloc(gc_region.ext, cap * sizeof(gc_region_ext_t));
+	if (ext == NULL) {
+		return -1;
+	}
+	gc_region.ext = ext;
+	gc_region.cap = cap;
+	return 0;
+}
+
+static void gc_region_insert(uint32_t i, uint64_t off, uint64_t size, uint32_t used)
+{
+	memmove(&gc_region.ext[i + 1], &gc_region.ext[i],
+		(gc_region.count - i) * sizeof(gc_region_ext_t));
+	gc_region.ext[i].off = off;
+	gc_region.ext[i].size = size;
+	gc_region.ext[i].align = GC_REGION_ALIGN;
+	gc_region.ext[i].used = used;
+	gc_region.ext[i].owner = NULL;
+	gc_region.count++;
+}
+
+static void gc_region_remove(uint32_t i)
+{
+	gc_region.count--;
+	memmove(&gc_region.ext[i], &gc_region.ext[i + 1],
+		(gc_region.count - i) * sizeof(gc_region_ext_t));
+}
+
+/* Merges extent i into i - 1 and i + 1 into i where both are free */
+static void gc_region_merge(uint32_t i)
+{
+	if (i + 1 < gc_region.count && !gc_region.ext[i + 1].used) {
+		gc_region.ext[i].size += gc_region.ext[i + 1].size;
+		gc_region_remove(i + 1);
+	}
+	if (i > 0 && !gc_region.ext[i - 1].used) {
+		gc_region.ext[i - 1].size += gc_region.ext[i].size;
+		gc_region_remove(i);
+	}
+}
+
+static int gc_region_find(uint64_t off)
+{
+	uint32_t lo = 0;
+	uint32_t hi = gc_region.count;
+	uint32_t mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (gc_region.ext[mid].off < off) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (lo < gc_region.count && gc_region.ext[lo].off == off) ? (int)lo : -1;
+}
+
+/* Aligned offset of size bytes inside [off, end), -1 when they do not fit */
+static int64_t gc_region_fit(uint64_t off, uint64_t end, uint64_t size, uint32_t align)
+{
+	uintptr_t addr = (uintptr_t)gc_region.base + off;
+
+	addr = (addr + align - 1) & ~((uintptr_t)align - 1);
+	off = addr - (uintptr_t)gc_region.base;
+	return (off + size <= end) ? (int64_t)off : -1;
+}
+
+/* Turns [off, off + size) of free extent i into a used one, returns its index */
+static int gc_region_carve(uint32_t i, uint64_t off, uint64_t size, uint32_t align)
+{
+	uint64_t head = off - gc_region.ext[i].off;
+	uint64_t tail = gc_region.ext[i].off + gc_region.ext[i].size - off - size;
+
+	if (gc_region_reserve(2) < 0) {
+		return -1;
+	}
+	if (head != 0) {
+		gc_region_insert(i, gc_region.ext[i].off, head, 0);
+		i++;
+	}
+	gc_region.ext[i].off = off;
+	gc_region.ext[i].size = size;
+	gc_region.ext[i].align = align;
+	gc_region.ext[i].used = 1;
+	gc_region.ext[i].owner = NULL;
+	if (tail != 0) {
+		gc_region_insert(i + 1, off + size, tail, 0);
+	}
+	return i;
+}
+
+static uint64_t gc_region_largest_free_locked(void)
+{
+	uint64_t largest = 0;
+	uint32_t i;
+
+	for (i = 0; i < gc_region.count; i++) {
+		if (!gc_region.ext[i].used && gc_region.ext[i].size > largest) {
+			largest = gc_region.ext[i].size;
+		}
+	}
+	return largest;
+}
+
+__attribute__ ((visibility ("default")))
+int gc_region_alloc2d(gc_surface_desc_t *desc)
+{
+	uint64_t size;
+	uint32_t align;
+	int64_t off = -1;
+	uint32_t i;
+
+	align = (desc->base_align > GC_REGION_ALIGN) ? desc->base_align : GC_REGION_ALIGN;
+	size = (desc->size + GC_REGION_ALIGN - 1) & ~((uint64_t)GC_REGION_ALIGN - 1);
+	pthread_mutex_lock(&gc_region.lock);
+	for (i = 0; i < gc_region.count; i++) {
+		if (!gc_region.ext[i].used) {
+			off = gc_region_fit(gc_region.ext[i].off,
+					    gc_region.ext[i].off + gc_region.ext[i].size, size, align);
+			if (off >= 0) {
+				break;
+			}
+		}
+	}
+	if (off < 0 || gc_region_carve(i, off, size, align) < 0) {
+		pthread_mutex_unlock(&gc_region.lock);
+		EPRN("No %llu B run in the 2D region, gc_compact2d may help\n",
+		     (unsigned long long)size);
+		return -1;
+	}
+	pthread_mutex_unlock(&gc_region.lock);
+	desc->d_ptr = gc_region.base + off;
+	desc->phys_ptr = desc->d_ptr;
+	return 0;
+}
+
+__attribute__ ((visibility ("default")))
+int gc_region_free2d(void *physical_addr_p)
+{
+	int i = -1;
+
+	pthread_mutex_lock(&gc_region.lock);
+	if ((uint8_t *)physical_addr_p >= gc_region.base &&
+	    (uint8_t *)physical_addr_p < gc_region.base + gc_region.size) {
+		i = gc_region_find((uint8_t *)physical_addr_p - gc_region.base);
+	}
+	if (i < 0 || !gc_region.ext[i].used) {
+		pthread_mutex_unlock(&gc_region.lock);
+		EPRN("%p is not a region surface\n", physical_addr_p);
+		return -1;
+	}
+	gc_region.ext[i].used = 0;
+	gc_region.ext[i].owner = NULL;
+	gc_region_merge(i);
+	pthread_mutex_unlock(&gc_region.lock);
+	return 0;
+}
+
+static int gc_region_alloc2d_legacy(int w, int h, void **physical_addr_p, void **virtual_addr_p)
+{
+	gc_surface_desc_t desc = {
+		.size = (size_t)w * h,
+	};
+
+	if (gc_region_alloc2d(&desc) < 0) {
+		return -1;
+	}
+	*physical_addr_p = desc.phys_ptr;
+	*virtual_addr_p = desc.d_ptr;
+	return 0;
+}
+
+/*
+ * Makes one mapping of bytes the 2D backend of the process. Its surfaces
+ * can be moved together by gc_compact2d when it fragments.
+ */
+__attribute__ ((visibility ("default")))
+int gc_register_region2d(uint64_t bytes)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	void *base;
+
+	bytes = (bytes + page - 1) & ~((uint64_t)page - 1);
+	pthread_mutex_lock(&gc_region.lock);
+	if (gc_region.base != NULL || bytes == 0 || gc_region_reserve(1) < 0) {
+		pthread_mutex_unlock(&gc_region.lock);
+		EPRN("The 2D region can be set up once\n");
+		return -1;
+	}
+	base = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) {
+		pthread_mutex_unlock(&gc_region.lock);
+		EPRN("Can not map a %llu B 2D region\n", (unsigned long long)bytes);
+		return -1;
+	}
+	__atomic_store_n(&gc_region.base, base, __ATOMIC_RELEASE);
+	gc_region.size = bytes;
+	gc_region_insert(0, 0, bytes, 0);
+	pthread_mutex_unlock(&gc_region.lock);
+
+	gc_register_free2d(gc_region_free2d);
+	gc_register_alloc2d(gc_region_alloc2d_legacy);
+	gc_register_alloc2d_ex(gc_region_alloc2d);
+	return 0;
+}
+
+/*
+ * gc_pin2d and gc_unpin2d. With a region the count changes under its
+ * lock, so a pin either lands before a step or waits for it to finish.
+ */
+void gc_region_pin(gc_mem2d_t *gc_mem2d, int delta)
+{
+	int locked = (__atomic_load_n(&gc_region.base, __ATOMIC_ACQUIRE) != NULL);
+
+	if (locked) {
+		pthread_mutex_lock(&gc_region.lock);
+	}
+	__atomic_add_fetch(&gc_mem2d->pins, delta, __ATOMIC_RELAXED);
+	if (locked) {
+		pthread_mutex_unlock(&gc_region.lock);
+	}
+}
+
+/* Largest surface gc_region_alloc2d can hand out right now */
+__attribute__ ((visibility ("default")))
+uint64_t gc_region2d_largest_free(void)
+{
+	uint64_t largest;
+
+	pthread_mutex_lock(&gc_region.lock);
+	largest = gc_region_largest_free_locked();
+	pthread_mutex_unlock(&gc_region.lock);
+	return largest;
+}
+
+/*
+ * Marks the surfaces of a gc that may move. Pinned ones, those retained
+ * elsewhere and imported ones stay, and so do cached surfaces no gc owns.
+ */
+static void gc_region_own(gcobj_private_t *gc_prv_p, void *arg)
+{
+	gc_compact_stats_t *stats = arg;
+	gc_mem2d_t *gc_mem2d;
+	gc_mem_t *gc_mem;
+	uint32_t i;
+	int e;
+
+	for (i = 0; i < gc_prv_p->sp_index; i++) {
+		gc_mem = gc_prv_p->sp[i];
+		if (!GC_SLOT_USED(gc_mem) || gc_mem->mem_type != GC_MEM_2D) {
+			continue;
+		}
+		gc_mem2d = (gc_mem2d_t *)gc_mem;
+		if ((gc_mem2d->flags & GC_MEM2D_F_IMPORTED) ||
+		    (uint8_t *)gc_mem2d->desc.d_ptr < gc_region.base ||
+		    (uint8_t *)gc_mem2d->desc.d_ptr >= gc_region.base + gc_region.size) {
+			continue;
+		}
+		e = gc_region_find((uint8_t *)gc_mem2d->desc.d_ptr - gc_region.base);
+		if (e < 0) {
+			continue;
+		}
+		if (__atomic_load_n(&gc_mem2d->pins, __ATOMIC_RELAXED) != 0 ||
+		    __atomic_load_n(&gc_mem->refs, __ATOMIC_RELAXED) > 1) {
+			stats->pinned++;
+			continue;
+		}
+		gc_region.ext[e].owner = gc_mem2d;
+	}
+}
+
+/*
+ * Moves the surface of extent u to off, which is below it. Returns 1 when
+ * it moved, 0 when it got pinned since the step started.
+ */
+static int gc_region_move(uint32_t f, uint32_t u, uint64_t off)
+{
+	gc_region_ext_t old = gc_region.ext[u];
+	uint8_t *dst = gc_region.base + off;
+	int i;
+
+	if (__atomic_load_n(&old.owner->pins, __ATOMIC_RELAXED) != 0) {
+		gc_region.ext[u].owner = NULL;
+		gc_region.pass.pinned++;
+		return 0;
+	}
+
+	if (off + old.size <= gc_region.ext[f].off + gc_region.ext[f].size) {
+		/* Into a hole of its own, the old run is freed afterwards */
+		i = gc_region_carve(f, off, old.size, old.align);
+		if (i < 0) {
+			return -1;
+		}
+		memcpy(dst, gc_region.base + old.off, old.size);
+		gc_region.ext[i].owner = old.owner;
+		u = gc_region_find(old.off);
+		gc_region.ext[u].used = 0;
+		gc_region.ext[u].owner = NULL;
+		gc_region_merge(u);
+	} else {
+		/* Slides down into the hole right before it */
+		if (gc_region_reserve(2) < 0) {
+			return -1;
+		}
+		memmove(dst, gc_region.base + old.off, old.size);
+		gc_region.ext[f].size += old.size;
+		gc_region_remove(u);
+		i = gc_region_carve(f, off, old.size, old.align);
+		gc_region.ext[i].owner = old.owner;
+		if (i + 1 < (int)gc_region.count && !gc_region.ext[i + 1].used) {
+			gc_region_merge(i + 1);
+		}
+	}
+	old.owner->desc.d_ptr = dst;
+	old.owner->desc.phys_ptr = dst;
+	gc_region.pass.bytes_moved += old.size;
+	gc_region.pass.surfaces_moved++;
+	return 1;
+}
+
+/*
+ * One move: the lowest hole is filled with the highest surface that fits
+ * in it, or else the surface right after it slides down. Every move
+ * lowers a surface, so the free space gathers at the top of the region.
+ * Returns 0 when nothing can move any more.
+ */
+static int gc_region_compact_one(void)
+{
+	gc_region_ext_t *ext;
+	uint32_t f, u;
+	int64_t off;
+
+	for (f = 0; f < gc_region.count; f++) {
+		if (gc_region.ext[f].used) {
+			continue;
+		}
+		for (u = gc_region.count - 1; u > f; u--) {
+			ext = &gc_region.ext[u];
+			if (!ext->used || ext->owner == NULL) {
+				continue;
+			}
+			off = gc_region_fit(gc_region.ext[f].off,
+					    gc_region.ext[f].off + gc_region.ext[f].size,
+					    ext->size, ext->align);
+			if (off >= 0) {
+				return (gc_region_move(f, u, off) < 0) ? -1 : 1;
+			}
+		}
+		u = f + 1;
+		if (u < gc_region.count && gc_region.ext[u].owner != NULL) {
+			ext = &gc_region.ext[u];
+			off = gc_region_fit(gc_region.ext[f].off, ext->off + ext->size,
+					    ext->size, ext->align);
+			if (off >= 0 && (uint64_t)off < ext->off) {
+				return (gc_region_move(f, u, off) < 0) ? -1 : 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Compacts the 2D region for about budget_us microseconds, 0 meaning a
+ * whole pass. Returns 1 when the pass completed and stats holds its
+ * result, 0 when there is work left and -1 on error.
+ *
+ * Surfaces are addressed by id, so moving them only updates d_ptr and
+ * phys_ptr of their descriptor. Addresses taken from lookup2d are stale
+ * after a step, a surface in use has to be held with gc_pin2d, which
+ * waits for a running step. No gc may allocate or free surfaces on
+ * another thread while a step runs.
+ */
+__attribute__ ((visibility ("default")))
+int gc_compact2d(uint32_t budget_us, gc_compact_stats_t *stats)
+{
+	uint64_t deadline = 0;
+	uint32_t i;
+	int ret;
+
+	if (gc_region.base == NULL) {
+		EPRN("No 2D region, see gc_register_region2d\n");
+		return -1;
+	}
+	if (budget_us != 0) {
+		deadline = gc_region_usec() + budget_us;
+	}
+	if (!gc_region.in_pass) {
+		/* Cached surfaces can not move, give their space back first */
+		gc_surface_pool_trim(0);
+	}
+
+	pthread_mutex_lock(&gc_region.lock);
+	if (!gc_region.in_pass) {
+		memset(&gc_region.pass, 0, sizeof(gc_region.pass));
+		gc_region.pass.largest_free_before = gc_region_largest_free_locked();
+		gc_region.in_pass = 1;
+	}
+	gc_region.pass.steps++;
+	gc_region.pass.pinned = 0;
+	for (i = 0; i < gc_region.count; i++) {
+		gc_region.ext[i].owner = NULL;
+	}
+	gc_pool_walk(gc_region_own, &gc_region.pass);
+
+	do {
+		ret = gc_region_compact_one();
+	} while (ret > 0 && (deadline == 0 || gc_region_usec() < deadline));
+
+	gc_region.pass.largest_free_after = gc_region_largest_free_locked();
+	if (stats != NULL) {
+		*stats = gc_region.pass;
+	}
+	if (ret == 0) {
+		gc_region.in_pass = 0;
+	}
+	pthread_mutex_unlock(&gc_region.lock);
+	if (ret < 0) {
+		return -1;
+	}
+	return (ret == 0) ? 1 : 0;
+}
@@ -0,0 +1,156 @@
+/*
+ *  gc_slab.c - Size-class slab backend for the garbage colector
+ *
+ *  Copyright (C) 2018 Atanas Tulbenski <top4ester@gmail.com>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <memory.h>
+
+#include "debug.h"
+#include "gc_private.h"
+
+DEBUG_CREATE_CTX(GC_SLAB, DBG_QUIET);
+
+#define GC_SLAB_SIZE		4096
+#define GC_SLAB_ALIGN		16
+
+/* Block sizes include the gc_mem_t header */
+static const uint32_t gc_slab_classes[] = {
+	32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024,
+};
+
+#define GC_SLAB_CLASS_COUNT	(sizeof(gc_slab_classes) / sizeof(gc_slab_classes[0]))
+#define GC_SLAB_MAX_BLK		1024
+
+/* Page header, the blocks follow it */
+typedef struct gc_slab_page_s {
+	struct gc_slab_page_s	*next;
+	uint32_t		blksize;
+} __attribute__ ((aligned (GC_SLAB_ALIGN))) gc_slab_page_t;
+
+/* Free blocks are chained through their first word */
+typedef struct gc_slab_blk_s {
+	struct gc_slab_blk_s	*next;
+} gc_slab_blk_t;
+
+struct gc_slab_s {
+	gc_slab_blk_t	*free_list[GC_SLAB_CLASS_COUNT];
+	gc_slab_page_t	*pages;
+	uint32_t	page_count;
+	uint32_t	blk_used[GC_SLAB_CLASS_COUNT];
+};
+
+static int gc_slab_class(size_t blksize)
+{
+	unsigned int i;
+
+	for (i = 0; i < GC_SLAB_CLASS_COUNT; i++) {
+		if (blksize <= gc_slab_classes[i]) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int gc_slab_grow(gc_slab_t *slab, int cls)
+{
+	gc_slab_page_t *page;
+	uint8_t *blk_p;
+	uint8_t *end_p;
+	uint32_t blksize = gc_slab_classes[cls];
+
+	if (posix_memalign((void **)&page, GC_SLAB_SIZE, GC_SLAB_SIZE) != 0) {
+		return -1;
+	}
+	page->blksize = blksize;
+	page->next = slab->pages;
+	slab->pages = page;
+	slab->page_count++;
+
+	blk_p = (uint8_t *)(page + 1);
+	end_p = (uint8_t *)page + GC_SLAB_SIZE;
+	while (blk_p + blksize <= end_p) {
+		((gc_slab_blk_t *)blk_p)->next = slab->free_list[cls];
+		slab->free_list[cls] = (gc_slab_blk_t *)blk_p;
+		blk_p += blksize;
+	}
+	return 0;
+}
+
+gc_slab_t *gc_slab_new(void)
+{
+	return calloc(1, sizeof(gc_slab_t));
+}
+
+void gc_slab_del(gc_slab_t *slab)
+{
+	gc_slab_page_t *page;
+
+	if (slab == NULL) {
+		return;
+	}
+	while (slab->pages) {
+		page = slab->pages;
+		slab->pages = page->next;
+		free(page);
+	}
+	free(slab);
+}
+
+int gc_slab_fits(size_t blksize)
+{
+	return blksize <= GC_SLAB_MAX_BLK;
+}
+
+void *gc_slab_alloc(gc_slab_t *slab, size_t blksize)
+{
+	gc_slab_blk_t *blk;
+	int cls;
+
+	cls = gc_slab_class(blksize);
+	if (cls < 0) {
+		return NULL;
+	}
+	if (slab->free_list[cls] == NULL) {
+		if (gc_slab_grow(slab, cls) < 0) {
+			return NULL;
+		}
+	}
+	blk = slab->free_list[cls];
+	slab->free_list[cls] = blk->next;
+	slab->blk_used[cls]++;
+	return blk;
+}
+
+void gc_slab_free(gc_slab_t *slab, void *blk, size_t blksize)
+{
+	int cls;
+
+	cls = gc_slab_class(blksize);
+	if (cls < 0) {
+		EPRN("Block %p of %zu B is not a slab block\n", blk, blksize);
+		return;
+	}
+	((gc_slab_blk_t *)blk)->next = slab->free_list[cls];
+	slab->free_list[cls] = blk;
+	slab->blk_used[cls]--;
+}
+
+void gc_slab_dump(gc_slab_t *slab)
+{
+	unsigned int i;
+
+	IPRN("\tslab pages  = %u (%u B)\n", slab->page_count,
+	     slab->page_count * GC_SLAB_SIZE);
+	for (i = 0; i < GC_SLAB_CLASS_COUNT; i++) {
+		if (slab->blk_used[i]) {
+			IPRN("\tslab %4u B = %u blocks\n",
+			     gc_slab_classes[i], slab->blk_used[i]);
+		}
+	}
+}
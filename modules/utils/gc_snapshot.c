@@ -0,0 +1,344 @@
+/*
+ *  gc_snapshot.c - Live block snapshots and leak diffs
+ *
+ *  Copyright (C) 2018 Atanas Tulbenski <top4ester@gmail.com>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <errno.h>
+
+#include "debug.h"
+#include "gc.h"
+#include "gc_private.h"
+
+DEBUG_CREATE_CTX(GC_SNAPSHOT, DBG_QUIET);
+
+#define GC_SNAP_MAGIC		0x4e534347	/* "GCSN" */
+#define GC_SNAP_VERSION		1
+
+typedef struct gc_snap_hdr_s {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	count;
+	uint32_t	record_size;
+} gc_snap_hdr_t;
+
+/* Blocks are kept sorted by (serial, slot, gen) so diffs are a merge */
+struct gc_snapshot_s {
+	gc_snap_block_t	*blocks;
+	uint32_t	count;
+	uint32_t	cap;
+	uint64_t	bytes;
+	int		oom;
+};
+
+static gc_snapshot_t *gc_snapshot_new(void)
+{
+	return calloc(1, sizeof(gc_snapshot_t));
+}
+
+static gc_snap_block_t *gc_snapshot_add(gc_snapshot_t *snap)
+{
+	gc_snap_block_t *blocks;
+	uint32_t cap;
+
+	if (snap->count == snap->cap) {
+		cap = snap->cap ? snap->cap * 2 : 256;
+		blocks = realloc(snap->blocks, (size_t)cap * sizeof(gc_snap_block_t));
+		if (blocks == NULL) {
+			snap->oom = 1;
+			return NULL;
+		}
+		snap->blocks = blocks;
+		snap->cap = cap;
+	}
+	return &snap->blocks[snap->count++];
+}
+
+static int gc_snap_block_cmp(const void *a, const void *b)
+{
+	const gc_snap_block_t *ba = a;
+	const gc_snap_block_t *bb = b;
+
+	if (ba->serial != bb->serial) {
+		return (ba->serial > bb->serial) - (ba->serial < bb->serial);
+	}
+	if (ba->slot != bb->slot) {
+		return (ba->slot > bb->slot) - (ba->slot < bb->slot);
+	}
+	return (ba->gen > bb->gen) - (ba->gen < bb->gen);
+}
+
+static int gc_snap_tag_cmp(const void *a, const void *b)
+{
+	const gc_snap_block_t *ba = a;
+	const gc_snap_block_t *bb = b;
+
+	return (ba->tag > bb->tag) - (ba->tag < bb->tag);
+}
+
+/* Arena blocks have no slot and are not in snapshots */
+static void gc_snapshot_add_gc(gcobj_private_t *gc_prv_p, void *arg)
+{
+	gc_snapshot_t *snap = arg;
+	gc_snap_block_t *blk;
+	gc_mem_t *gc_mem;
+	uint32_t i;
+
+	for (i = 0; i < gc_prv_p->sp_index; i++) {
+		if (!GC_SLOT_USED(gc_prv_p->sp[i])) {
+			continue;
+		}
+		blk = gc_snapshot_add(snap);
+		if (blk == NULL) {
+			return;
+		}
+		gc_mem = gc_prv_p->sp[i];
+		memset(blk, 0, sizeof(*blk));
+		blk->gc = (uintptr_t)gc_prv_p->gc;
+		blk->serial = gc_prv_p->serial;
+		if (gc_mem->mem_type == GC_MEM_2D) {
+			blk->addr = (uintptr_t)((gc_mem2d_t *)gc_mem)->desc.d_ptr;
+		} else {
+			blk->addr = (uintptr_t)(gc_mem + 1);
+		}
+		blk->size = gc_mem->size;
+		blk->slot = i;
+		blk->gen = gc_prv_p->sp_gen[i];
+		blk->tag = (gc_prv_p->sp_tag != NULL) ? gc_prv_p->sp_tag[i] : 0;
+		blk->mem_type = gc_mem->mem_type;
+		snap->bytes += gc_mem->size;
+	}
+}
+
+/* Tags a block for gc_snapshot_dump, 0 clears the tag */
+__attribute__ ((visibility ("default")))
+int gc_set_tag(gcobj_t *this, void *memptr, uint32_t tag)
+{
+	gcobj_private_t *gc_prv_p;
+	gc_mem_t *gc_mem;
+	uint32_t i;
+
+	if (this == NULL || memptr == NULL) {
+		return -1;
+	}
+	gc_prv_p = (gcobj_private_t *) this->private_p;
+	gc_mem = (gc_mem_t *)memptr - 1;
+	i = gc_mem->index;
+	if (i >= gc_prv_p->sp_index || gc_prv_p->sp[i] != gc_mem) {
+		EPRN("%p is not owned by gc %p\n", memptr, this);
+		return -1;
+	}
+	if (gc_prv_p->sp_tag == NULL) {
+		gc_prv_p->sp_tag = calloc(gc_prv_p->sp_top + 1, sizeof(uint32_t));
+		if (gc_prv_p->sp_tag == NULL) {
+			return -1;
+		}
+	}
+	gc_prv_p->sp_tag[i] = tag;
+	return 0;
+}
+
+/*
+ * Records the live blocks of one gc object, or of all of them for NULL.
+ * It reads the slot tables, so no gc may be used by another thread
+ * while it runs. Take it between frames of a soak test, say.
+ */
+__attribute__ ((visibility ("default")))
+gc_snapshot_t *gc_snapshot_take(gcobj_t *this)
+{
+	gc_snapshot_t *snap;
+
+	snap = gc_snapshot_new();
+	if (snap == NULL) {
+		return NULL;
+	}
+	if (this != NULL) {
+		gc_snapshot_add_gc((gcobj_private_t *) this->private_p, snap);
+	} else {
+		gc_pool_walk(gc_snapshot_add_gc, snap);
+	}
+	if (snap->oom) {
+		gc_snapshot_free(snap);
+		return NULL;
+	}
+	qsort(snap->blocks, snap->count, sizeof(gc_snap_block_t), gc_snap_block_cmp);
+	return snap;
+}
+
+/*
+ * Blocks of after that are not in before, i.e. allocated in between and
+ * still alive. A slot reused 65536 times in between looks unchanged.
+ */
+__attribute__ ((visibility ("default")))
+gc_snapshot_t *gc_snapshot_diff(const gc_snapshot_t *before, const gc_snapshot_t *after)
+{
+	gc_snapshot_t *diff;
+	gc_snap_block_t *blk;
+	uint32_t i, j = 0;
+	int cmp;
+
+	if (before == NULL || after == NULL) {
+		return NULL;
+	}
+	diff = gc_snapshot_new();
+	if (diff == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < after->count; i++) {
+		cmp = -1;
+		while (j < before->count &&
+		       (cmp = gc_snap_block_cmp(&before->blocks[j], &after->blocks[i])) < 0) {
+			j++;
+		}
+		if (j < before->count && cmp == 0) {
+			continue;
+		}
+		blk = gc_snapshot_add(diff);
+		if (blk == NULL) {
+			gc_snapshot_free(diff);
+			return NULL;
+		}
+		*blk = after->blocks[i];
+		diff->bytes += blk->size;
+	}
+	return diff;
+}
+
+/* Number of blocks in snap, blocks may be NULL */
+__attribute__ ((visibility ("default")))
+uint32_t gc_snapshot_blocks(const gc_snapshot_t *snap, const gc_snap_block_t **blocks)
+{
+	if (blocks != NULL) {
+		*blocks = snap->blocks;
+	}
+	return snap->count;
+}
+
+__attribute__ ((visibility ("default")))
+uint64_t gc_snapshot_bytes(const gc_snapshot_t *snap)
+{
+	return snap->bytes;
+}
+
+/* Prints the totals per tag and the first max_blocks blocks */
+__attribute__ ((visibility ("default")))
+void gc_snapshot_dump(const gc_snapshot_t *snap, uint32_t max_blocks)
+{
+	gc_snap_block_t *by_tag;
+	const gc_snap_block_t *blk;
+	uint64_t bytes;
+	uint32_t i, j;
+
+	IPRN("------------------------- GC snapshot start -------------------------\n");
+	IPRN("BLOCKS = %u\n", snap->count);
+	IPRN("BYTES = %llu\n", (unsigned long long)snap->bytes);
+	by_tag = malloc((size_t)snap->count * sizeof(gc_snap_block_t));
+	if (by_tag != NULL && snap->count != 0) {
+		memcpy(by_tag, snap->blocks, (size_t)snap->count * sizeof(gc_snap_block_t));
+		qsort(by_tag, snap->count, sizeof(gc_snap_block_t), gc_snap_tag_cmp);
+		for (i = 0; i < snap->count; i = j) {
+			bytes = 0;
+			for (j = i; j < snap->count && by_tag[j].tag == by_tag[i].tag; j++) {
+				bytes += by_tag[j].size;
+			}
+			IPRN("\ttag %-10u %8u blocks %12llu B\n", by_tag[i].tag, j - i,
+			     (unsigned long long)bytes);
+		}
+	}
+	free(by_tag);
+	for (i = 0; i < snap->count && i < max_blocks; i++) {
+		blk = &snap->blocks[i];
+		IPRN("\tgc %#llx slot %u gen %u: %llu B at %#llx, tag %u\n",
+		     (unsigned long long)blk->gc, blk->slot, blk->gen,
+		     (unsigned long long)blk->size, (unsigned long long)blk->addr, blk->tag);
+	}
+	IPRN("------------------------- GC snapshot end ---------------------------\n");
+}
+
+/* Host byte order, for gctool on the same machine */
+__attribute__ ((visibility ("default")))
+int gc_snapshot_save(const gc_snapshot_t *snap, const char *path)
+{
+	gc_snap_hdr_t hdr = {
+		.magic = GC_SNAP_MAGIC,
+		.version = GC_SNAP_VERSION,
+		.count = snap->count,
+		.record_size = sizeof(gc_snap_block_t),
+	};
+	FILE *fp;
+	int ret = 0;
+
+	fp = fopen(path, "wb");
+	if (fp == NULL) {
+		EPRN("Can not create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fwrite(snap->blocks, sizeof(gc_snap_block_t), snap->count, fp) != snap->count) {
+		ret = -1;
+	}
+	if (fclose(fp) != 0) {
+		ret = -1;
+	}
+	if (ret < 0) {
+		EPRN("Writing %s failed\n", path);
+	}
+	return ret;
+}
+
+__attribute__ ((visibility ("default")))
+gc_snapshot_t *gc_snapshot_load(const char *path)
+{
+	gc_snapshot_t *snap;
+	gc_snap_hdr_t hdr;
+	FILE *fp;
+	uint32_t i;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		EPRN("Can not open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != GC_SNAP_MAGIC ||
+	    hdr.version != GC_SNAP_VERSION || hdr.record_size != sizeof(gc_snap_block_t)) {
+		EPRN("%s is not a gc snapshot\n", path);
+		fclose(fp);
+		return NULL;
+	}
+	snap = gc_snapshot_new();
+	if (snap == NULL) {
+		fclose(fp);
+		return NULL;
+	}
+	snap->blocks = malloc((size_t)hdr.count * sizeof(gc_snap_block_t));
+	if (hdr.count != 0 && (snap->blocks == NULL ||
+	    fread(snap->blocks, sizeof(gc_snap_block_t), hdr.count, fp) != hdr.count)) {
+		EPRN("%s is truncated\n", path);
+		fclose(fp);
+		gc_snapshot_free(snap);
+		return NULL;
+	}
+	fclose(fp);
+	snap->count = snap->cap = hdr.count;
+	for (i = 0; i < snap->count; i++) {
+		snap->bytes += snap->blocks[i].size;
+	}
+	qsort(snap->blocks, snap->count, sizeof(gc_snap_block_t), gc_snap_block_cmp);
+	return snap;
+}
+
+__attribute__ ((visibility ("default")))
+void gc_snapshot_free(gc_snapshot_t *snap)
+{
+	if (snap == NULL) {
+		return;
+	}
+	free(snap->blocks);
+	free(snap);
+}
@@ -0,0 +1,273 @@
+/*
+ *  gc_stats.c - Allocation statistics of the garbage colector
+ *
+ *  Copyright (C) 2018 Atanas Tulbenski <top4ester@gmail.com>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "gc.h"
+#include "gc_private.h"
+
+DEBUG_CREATE_CTX(GC_STATS, DBG_QUIET);
+
+typedef struct gc_stats_set_s {
+	gc_stats_t	*tab;
+	uint32_t	count;
+	uint32_t	cap;
+	int		oom;
+} gc_stats_set_t;
+
+/* Counters are read while the owner keeps allocating, see GC_STAT_ADD */
+static void gc_stats_fill(gcobj_private_t *gc_prv_p, gc_stats_t *stats)
+{
+	uint32_t c;
+
+	stats->gc = gc_prv_p->gc;
+	stats->live_bytes = __atomic_load_n(&gc_prv_p->memused, __ATOMIC_RELAXED);
+	stats->peak_bytes = __atomic_load_n(&gc_prv_p->peak, __ATOMIC_RELAXED);
+	stats->allocs = __atomic_load_n(&gc_prv_p->allocs, __ATOMIC_RELAXED);
+	stats->frees = __atomic_load_n(&gc_prv_p->frees, __ATOMIC_RELAXED);
+	stats->live_blocks = __atomic_load_n(&gc_prv_p->live, __ATOMIC_RELAXED);
+	stats->surfaces = __atomic_load_n(&gc_prv_p->surfaces, __ATOMIC_RELAXED);
+	stats->slot_capacity = __atomic_load_n(&gc_prv_p->sp_top, __ATOMIC_RELAXED) + 1;
+	stats->reserved = 0;
+	for (c = 0; c < GC_STATS_CLASSES; c++) {
+		stats->size_class[c] = __atomic_load_n(&gc_prv_p->size_class[c], __ATOMIC_RELAXED);
+	}
+	stats->intern_bytes = __atomic_load_n(&gc_prv_p->intern_bytes, __ATOMIC_RELAXED);
+	stats->intern_saved = 0;
+}
+
+/* Runs under the registry lock, so it only appends */
+static void gc_stats_collect_one(gcobj_private_t *gc_prv_p, void *arg)
+{
+	gc_stats_set_t *set = arg;
+	gc_stats_t *tab;
+	uint32_t cap;
+
+	if (set->count == set->cap) {
+		cap = set->cap ? set->cap * 2 : 64;
+		tab = realloc(set->tab, cap * sizeof(gc_stats_t));
+		if (tab == NULL) {
+			set->oom = 1;
+			return;
+		}
+		set->tab = tab;
+		set->cap = cap;
+	}
+	gc_stats_fill(gc_prv_p, &set->tab[set->count++]);
+}
+
+/*
+ * Snapshots every gc into set->tab and sums them up into total. Global
+ * live and peak bytes also cover shared blocks whose gc is gone.
+ */
+static int gc_stats_collect(gc_stats_set_t *set, gc_stats_t *total)
+{
+	uint32_t i, c;
+
+	memset(set, 0, sizeof(*set));
+	gc_pool_walk(gc_stats_collect_one, set);
+	if (set->oom) {
+		free(set->tab);
+		return -1;
+	}
+	memset(total, 0, sizeof(*total));
+	for (i = 0; i < set->count; i++) {
+		total->allocs += set->tab[i].allocs;
+		total->frees += set->tab[i].frees;
+		total->live_blocks += set->tab[i].live_blocks;
+		total->surfaces += set->tab[i].surfaces;
+		total->slot_capacity += set->tab[i].slot_capacity;
+		for (c = 0; c < GC_STATS_CLASSES; c++) {
+			total->size_class[c] += set->tab[i].size_class[c];
+		}
+		total->intern_bytes += set->tab[i].intern_bytes;
+	}
+	total->live_bytes = gc_memused(NULL);
+	total->peak_bytes = gc_budget_peak();
+	total->intern_saved = gc_intern_saved();
+	return 0;
+}
+
+/* Stats of one gc object, or the totals of all of them for NULL */
+__attribute__ ((visibility ("default")))
+int gc_stats(gcobj_t *this, gc_stats_t *stats)
+{
+	gc_stats_set_t set;
+
+	if (stats == NULL) {
+		return -1;
+	}
+	if (this != NULL) {
+		gc_stats_fill((gcobj_private_t *) this->private_p, stats);
+		return 0;
+	}
+	if (gc_stats_collect(&set, stats) < 0) {
+		return -1;
+	}
+	free(set.tab);
+	return 0;
+}
+
+/*
+ * Calls cb with the stats of every gc object. They are snapshot first,
+ * so cb runs without locks and may create or delete gc objects.
+ */
+__attribute__ ((visibility ("default")))
+int gc_stats_foreach(gc_stats_f cb, void *arg)
+{
+	gc_stats_set_t set;
+	gc_stats_t total;
+	uint32_t i;
+
+	if (cb == NULL || gc_stats_collect(&set, &total) < 0) {
+		return -1;
+	}
+	for (i = 0; i < set.count; i++) {
+		if (cb(&set.tab[i], arg) != 0) {
+			break;
+		}
+	}
+	free(set.tab);
+	return 0;
+}
+
+static void gc_stats_json_one(FILE *fp, const gc_stats_t *stats)
+{
+	uint32_t c;
+
+	if (stats->gc != NULL) {
+		fprintf(fp, "{\"gc\":\"%p\",", (void *)stats->gc);
+	} else {
+		fputs("{\"gc\":null,", fp);
+	}
+	fprintf(fp, "\"live_bytes\":%llu,\"peak_bytes\":%llu,"
+		"\"allocs\":%llu,\"frees\":%llu,\"live_blocks\":%u,\"surfaces\":%u,"
+		"\"slot_capacity\":%u,\"size_class\":[",
+		(unsigned long long)stats->live_bytes, (unsigned long long)stats->peak_bytes,
+		(unsigned long long)stats->allocs, (unsigned long long)stats->frees,
+		stats->live_blocks, stats->surfaces, stats->slot_capacity);
+	for (c = 0; c < GC_STATS_CLASSES; c++) {
+		fprintf(fp, c ? ",%llu" : "%llu", (unsigned long long)stats->size_class[c]);
+	}
+	fprintf(fp, "],\"intern_bytes\":%llu,\"intern_saved\":%llu}",
+		(unsigned long long)stats->intern_bytes, (unsigned long long)stats->intern_saved);
+}
+
+static int gc_stats_write(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t n;
+
+	while (len != 0) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			EPRN("Writing stats failed: %s\n", strerror(errno));
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Writes the totals and every gc object to fd. The whole document is
+ * formatted in memory first and goes out in one write where possible,
+ * so a reader on a pipe never sees half a sample.
+ */
+__attribute__ ((visibility ("default")))
+int gc_stats_export(int fd, int format)
+{
+	gc_stats_set_t set;
+	gc_stats_t total;
+	gc_stats_hdr_t hdr;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *fp;
+	uint32_t i;
+	int ret;
+
+	if (format != GC_STATS_JSON && format != GC_STATS_BINARY) {
+		return -1;
+	}
+	if (gc_stats_collect(&set, &total) < 0) {
+		return -1;
+	}
+	fp = open_memstream(&buf, &len);
+	if (fp == NULL) {
+		free(set.tab);
+		return -1;
+	}
+	if (format == GC_STATS_JSON) {
+		fprintf(fp, "{\"objects\":%u,\"total\":", set.count);
+		gc_stats_json_one(fp, &total);
+		fputs(",\"gcs\":[", fp);
+		for (i = 0; i < set.count; i++) {
+			if (i != 0) {
+				fputc(',', fp);
+			}
+			gc_stats_json_one(fp, &set.tab[i]);
+		}
+		fputs("]}\n", fp);
+	} else {
+		hdr.magic = GC_STATS_MAGIC;
+		hdr.version = GC_STATS_VERSION;
+		hdr.count = set.count;
+		hdr.record_size = sizeof(gc_stats_t);
+		fwrite(&hdr, sizeof(hdr), 1, fp);
+		fwrite(&total, sizeof(total), 1, fp);
+		fwrite(set.tab, sizeof(gc_stats_t), set.count, fp);
+	}
+	free(set.tab);
+	if (fclose(fp) != 0) {
+		free(buf);
+		return -1;
+	}
+	ret = gc_stats_write(fd, buf, len);
+	free(buf);
+	return ret;
+}
+
+/* gc_stats_export into a file, replaced as a whole */
+__attribute__ ((visibility ("default")))
+int gc_stats_save(const char *path, int format)
+{
+	char tmp[256];
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+		return -1;
+	}
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		EPRN("Can not create %s: %s\n", tmp, strerror(errno));
+		return -1;
+	}
+	if (gc_stats_export(fd, format) < 0) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+	if (rename(tmp, path) < 0) {
+		EPRN("Can not rename %s: %s\n", tmp, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,322 @@
+/*
+ *  gc_surface.c - Reusable 2D surface pool for the garbage colector
+ *
+ *  Copyright (C) 2018 Atanas Tulbenski <top4ester@gmail.com>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <pthread.h>
+
+#include "debug.h"
+#include "gc.h"
+#include "gc_private.h"
+
+DEBUG_CREATE_CTX(GC_SURFACE, DBG_QUIET);
+
+#define GC_SURFACE_BUCKETS	64
+#define GC_SURFACE_PRESSURE	80	/* Percent of the global gc budget */
+
+typedef struct gc_surface_class_s gc_surface_class_t;
+
+/* A freed surface parked in the pool */
+typedef struct gc_surface_entry_s {
+	gc_surface_class_t		*cls;
+	struct gc_surface_entry_s	*cls_prev;
+	struct gc_surface_entry_s	*cls_next;
+	struct gc_surface_entry_s	*lru_prev;
+	struct gc_surface_entry_s	*lru_next;
+	size_t				size;
+	uint32_t			stride;
+	void				*phys_ptr;
+	void				*d_ptr;
+} gc_surface_entry_t;
+
+/* All cached surfaces of one (w, h, fmt) key, most recently freed first */
+struct gc_surface_class_s {
+	gc_surface_class_t	*next;
+	int			w;
+	int			h;
+	int			fmt;
+	uint32_t		cap;
+	uint32_t		count;
+	gc_surface_entry_t	*head;
+};
+
+typedef struct gc_surface_pool_s {
+	pthread_mutex_t		lock;
+	gc_surface_class_t	*bucket[GC_SURFACE_BUCKETS];
+	/* lru_head is the most recently freed surface */
+	gc_surface_entry_t	*lru_head;
+	gc_surface_entry_t	*lru_tail;
+	uint32_t		default_cap;
+	uint64_t		budget;
+	gc_surface_pool_stats_t	stats;
+} gc_surface_pool_t;
+
+static gc_surface_pool_t gc_surface_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint32_t gc_surface_hash(int w, int h, int fmt)
+{
+	uint32_t key;
+
+	key = (uint32_t)w * 0x9e3779b1u ^ (uint32_t)h * 0x85ebca6bu ^ (uint32_t)fmt;
+	return (key ^ (key >> 16)) % GC_SURFACE_BUCKETS;
+}
+
+static gc_surface_class_t *gc_surface_class(int w, int h, int fmt, int create)
+{
+	gc_surface_class_t *cls;
+	uint32_t b;
+
+	b = gc_surface_hash(w, h, fmt);
+	for (cls = gc_surface_pool.bucket[b]; cls != NULL; cls = cls->next) {
+		if (cls->w == w && cls->h == h && cls->fmt == fmt) {
+			return cls;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+	cls = calloc(1, sizeof(gc_surface_class_t));
+	if (cls == NULL) {
+		return NULL;
+	}
+	cls->w = w;
+	cls->h = h;
+	cls->fmt = fmt;
+	cls->cap = gc_surface_pool.default_cap;
+	cls->next = gc_surface_pool.bucket[b];
+	gc_surface_pool.bucket[b] = cls;
+	return cls;
+}
+
+static void gc_surface_unlink(gc_surface_entry_t *ent)
+{
+	gc_surface_class_t *cls = ent->cls;
+
+	if (ent->cls_prev != NULL) {
+		ent->cls_prev->cls_next = ent->cls_next;
+	} else {
+		cls->head = ent->cls_next;
+	}
+	if (ent->cls_next != NULL) {
+		ent->cls_next->cls_prev = ent->cls_prev;
+	}
+	cls->count--;
+
+	if (ent->lru_prev != NULL) {
+		ent->lru_prev->lru_next = ent->lru_next;
+	} else {
+		gc_surface_pool.lru_head = ent->lru_next;
+	}
+	if (ent->lru_next != NULL) {
+		ent->lru_next->lru_prev = ent->lru_prev;
+	} else {
+		gc_surface_pool.lru_tail = ent->lru_prev;
+	}
+
+	gc_surface_pool.stats.cached_bytes -= ent->size;
+	gc_surface_pool.stats.cached_count--;
+}
+
+/* Called with the lock held, returns the least recently used surfaces */
+static void gc_surface_trim_locked(uint64_t target_bytes)
+{
+	gc_surface_entry_t *ent;
+
+	while (gc_surface_pool.stats.cached_bytes > target_bytes) {
+		ent = gc_surface_pool.lru_tail;
+		gc_surface_unlink(ent);
+		gc_backend_free2d(ent->phys_ptr);
+		gc_surface_pool.stats.trimmed++;
+		free(ent);
+	}
+}
+
+/* A cached surface fits when it has the same pitch and enough alignment */
+static int gc_surface_match(gc_surface_entry_t *ent, const gc_surface_desc_t *desc)
+{
+	uintptr_t mask = desc->base_align ? desc->base_align - 1 : 0;
+
+	return ent->stride == desc->stride && ent->size == desc->size &&
+	       ((uintptr_t)ent->d_ptr & mask) == 0 &&
+	       ((uintptr_t)ent->phys_ptr & mask) == 0;
+}
+
+int gc_surface_pool_get(gc_surface_desc_t *desc)
+{
+	gc_surface_class_t *cls;
+	gc_surface_entry_t *ent = NULL;
+
+	pthread_mutex_lock(&gc_surface_pool.lock);
+	if (gc_surface_pool.budget == 0) {
+		pthread_mutex_unlock(&gc_surface_pool.lock);
+		return -1;
+	}
+	cls = gc_surface_class(desc->w, desc->h, desc->fmt, 0);
+	if (cls != NULL) {
+		for (ent = cls->head; ent != NULL; ent = ent->cls_next) {
+			if (gc_surface_match(ent, desc)) {
+				break;
+			}
+		}
+	}
+	if (ent != NULL) {
+		gc_surface_unlink(ent);
+		gc_surface_pool.stats.hits++;
+	} else {
+		gc_surface_pool.stats.misses++;
+	}
+	pthread_mutex_unlock(&gc_surface_pool.lock);
+
+	if (ent == NULL) {
+		return -1;
+	}
+	desc->phys_ptr = ent->phys_ptr;
+	desc->d_ptr = ent->d_ptr;
+	free(ent);
+	return 0;
+}
+
+int gc_surface_pool_put(const gc_surface_desc_t *desc)
+{
+	gc_surface_class_t *cls;
+	gc_surface_entry_t *ent;
+
+	pthread_mutex_lock(&gc_surface_pool.lock);
+	if (desc->size > gc_surface_pool.budget) {
+		pthread_mutex_unlock(&gc_surface_pool.lock);
+		return -1;
+	}
+	cls = gc_surface_class(desc->w, desc->h, desc->fmt, 1);
+	if (cls == NULL || cls->count >= cls->cap) {
+		pthread_mutex_unlock(&gc_surface_pool.lock);
+		return -1;
+	}
+	ent = malloc(sizeof(gc_surface_entry_t));
+	if (ent == NULL) {
+		pthread_mutex_unlock(&gc_surface_pool.lock);
+		return -1;
+	}
+	ent->cls = cls;
+	ent->size = desc->size;
+	ent->stride = desc->stride;
+	ent->phys_ptr = desc->phys_ptr;
+	ent->d_ptr = desc->d_ptr;
+
+	ent->cls_prev = NULL;
+	ent->cls_next = cls->head;
+	if (cls->head != NULL) {
+		cls->head->cls_prev = ent;
+	}
+	cls->head = ent;
+	cls->count++;
+
+	ent->lru_prev = NULL;
+	ent->lru_next = gc_surface_pool.lru_head;
+	if (gc_surface_pool.lru_head != NULL) {
+		gc_surface_pool.lru_head->lru_prev = ent;
+	} else {
+		gc_surface_pool.lru_tail = ent;
+	}
+	gc_surface_pool.lru_head = ent;
+
+	gc_surface_pool.stats.cached_bytes += desc->size;
+	gc_surface_pool.stats.cached_count++;
+	gc_surface_trim_locked(gc_surface_pool.budget);
+	pthread_mutex_unlock(&gc_surface_pool.lock);
+	return 0;
+}
+
+/* Cached surfaces are not charged to any gc, drop them all on pressure */
+static void gc_surface_pool_pressure(uint32_t level, uint64_t used, uint64_t budget, void *arg)
+{
+	gc_surface_pool_trim(0);
+}
+
+static void gc_surface_pool_pressure_init(void)
+{
+	gc_register_pressure(GC_SURFACE_PRESSURE, gc_surface_pool_pressure, NULL);
+}
+
+/*
+ * default_cap is the number of surfaces kept per (w, h, fmt) and
+ * byte_budget bounds the whole pool. A zero budget disables the pool.
+ */
+__attribute__ ((visibility ("default")))
+void gc_surface_pool_setup(uint32_t default_cap, uint64_t byte_budget)
+{
+	static pthread_once_t pressure_once = PTHREAD_ONCE_INIT;
+	gc_surface_class_t *cls;
+	int i;
+
+	pthread_once(&pressure_once, gc_surface_pool_pressure_init);
+	pthread_mutex_lock(&gc_surface_pool.lock);
+	for (i = 0; i < GC_SURFACE_BUCKETS; i++) {
+		for (cls = gc_surface_pool.bucket[i]; cls != NULL; cls = cls->next) {
+			if (cls->cap == gc_surface_pool.default_cap) {
+				cls->cap = default_cap;
+			}
+		}
+	}
+	gc_surface_pool.default_cap = default_cap;
+	gc_surface_pool.budget = byte_budget;
+	gc_surface_trim_locked(byte_budget);
+	pthread_mutex_unlock(&gc_surface_pool.lock);
+}
+
+__attribute__ ((visibility ("default")))
+void gc_surface_pool_set_cap(int w, int h, int fmt, uint32_t cap)
+{
+	gc_surface_class_t *cls;
+
+	pthread_mutex_lock(&gc_surface_pool.lock);
+	cls = gc_surface_class(w, h, fmt, 1);
+	if (cls != NULL) {
+		cls->cap = cap;
+		while (cls->count > cap) {
+			gc_surface_entry_t *ent = cls->head;
+
+			gc_surface_unlink(ent);
+			gc_backend_free2d(ent->phys_ptr);
+			gc_surface_pool.stats.trimmed++;
+			free(ent);
+		}
+	}
+	pthread_mutex_unlock(&gc_surface_pool.lock);
+}
+
+__attribute__ ((visibility ("default")))
+void gc_surface_pool_trim(uint64_t target_bytes)
+{
+	pthread_mutex_lock(&gc_surface_pool.lock);
+	gc_surface_trim_locked(target_bytes);
+	pthread_mutex_unlock(&gc_surface_pool.lock);
+}
+
+__attribute__ ((visibility ("default")))
+void gc_surface_pool_stats(gc_surface_pool_stats_t *stats)
+{
+	pthread_mutex_lock(&gc_surface_pool.lock);
+	*stats = gc_surface_pool.stats;
+	pthread_mutex_unlock(&gc_surface_pool.lock);
+}
+
+__attribute__ ((visibility ("default")))
+void gc_surface_pool_dump(void)
+{
+	gc_surface_pool_stats_t stats;
+
+	gc_surface_pool_stats(&stats);
+	IPRN("surface pool: %u cached (%llu B), hits %llu, misses %llu, trimmed %llu\n",
+	     stats.cached_count, (unsigned long long)stats.cached_bytes,
+	     (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+	     (unsigned long long)stats.trimmed);
+}
@@ -0,0 +1,247 @@
+/*
+ *  gc_tcache.c - Per-thread block caches for the garbage colector
+ *
+ *  Copyright (C) 2018 Atanas Tulbenski <top4ester@gmail.com>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <pthread.h>
+
+#include "gc_private.h"
+
+/* Block sizes include the gc_mem_t header, steps as in gc_slab.c */
+static const uint32_t gc_tcache_classes[] = {
+	32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048,
+};
+
+#define GC_TCACHE_CLASS_COUNT	(sizeof(gc_tcache_classes) / sizeof(gc_tcache_classes[0]))
+#define GC_TCACHE_MAX_BLK	2048
+#define GC_TCACHE_MAG		256	/* Cached blocks per class and thread */
+
+typedef struct gc_tcache_s gc_tcache_t;
+
+/* Prefix in front of the gc_mem_t of every cached block */
+typedef struct gc_tcache_hdr_s {
+	gc_tcache_t		*owner;
+} __attribute__ ((aligned (16))) gc_tcache_hdr_t;
+
+/*
+ * A block in a cache is chained through the space of its gc_mem_t. In
+ * use, the size class is kept in gc_mem_t.aux instead.
+ */
+typedef struct gc_tcache_link_s {
+	gc_tcache_hdr_t		*next;
+	uint32_t		cls;
+} gc_tcache_link_t;
+
+#define GC_TCACHE_LINK(__hdr)	((gc_tcache_link_t *)((__hdr) + 1))
+
+/*
+ * Only the owning thread touches the magazines. Other threads push the
+ * blocks they free onto the remote stack, the owner takes the whole
+ * stack at once so the push side never sees ABA. An idle or parked
+ * owner never drains it, so past GC_TCACHE_MAG blocks remote frees go
+ * straight back to libc.
+ */
+struct gc_tcache_s {
+	gc_tcache_hdr_t	*mag[GC_TCACHE_CLASS_COUNT];
+	uint32_t	mag_count[GC_TCACHE_CLASS_COUNT];
+	gc_tcache_hdr_t	*remote __attribute__ ((aligned (64)));
+	uint32_t	remote_count;	/* At least the blocks on remote */
+	gc_tcache_t	*abandoned_next;
+};
+
+static __thread gc_tcache_t *gc_tcache_self;
+static __thread int gc_tcache_exited;
+
+/*
+ * Caches are never freed: a remote free may still be in flight when the
+ * owner exits. Exited threads park their cache here and new threads
+ * adopt it.
+ */
+static gc_tcache_t *gc_tcache_abandoned;
+static pthread_mutex_t gc_tcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t gc_tcache_key;
+static pthread_once_t gc_tcache_once = PTHREAD_ONCE_INIT;
+
+static int gc_tcache_class(size_t blksize)
+{
+	unsigned int i;
+
+	for (i = 0; i < GC_TCACHE_CLASS_COUNT; i++) {
+		if (blksize <= gc_tcache_classes[i]) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void gc_tcache_put(gc_tcache_t *tc, gc_tcache_hdr_t *hdr)
+{
+	uint32_t cls = GC_TCACHE_LINK(hdr)->cls;
+
+	if (tc->mag_count[cls] >= GC_TCACHE_MAG) {
+		free(hdr);
+		return;
+	}
+	GC_TCACHE_LINK(hdr)->next = tc->mag[cls];
+	tc->mag[cls] = hdr;
+	tc->mag_count[cls]++;
+}
+
+static void gc_tcache_drain_remote(gc_tcache_t *tc)
+{
+	gc_tcache_hdr_t *hdr;
+	gc_tcache_hdr_t *next;
+	uint32_t n = 0;
+
+	hdr = __atomic_exchange_n(&tc->remote, NULL, __ATOMIC_ACQUIRE);
+	while (hdr != NULL) {
+		next = GC_TCACHE_LINK(hdr)->next;
+		gc_tcache_put(tc, hdr);
+		hdr = next;
+		n++;
+	}
+	__atomic_sub_fetch(&tc->remote_count, n, __ATOMIC_RELAXED);
+}
+
+static void gc_tcache_flush(gc_tcache_t *tc)
+{
+	gc_tcache_hdr_t *hdr;
+	unsigned int i;
+
+	gc_tcache_drain_remote(tc);
+	for (i = 0; i < GC_TCACHE_CLASS_COUNT; i++) {
+		while (tc->mag[i] != NULL) {
+			hdr = tc->mag[i];
+			tc->mag[i] = GC_TCACHE_LINK(hdr)->next;
+			free(hdr);
+		}
+		tc->mag_count[i] = 0;
+	}
+}
+
+/*
+ * Once the cache is parked another thread may adopt it, so later TSD
+ * destructors of this thread get uncached blocks and free theirs
+ * through the remote stack.
+ */
+static void gc_tcache_thread_exit(void *arg)
+{
+	gc_tcache_t *tc = arg;
+
+	gc_tcache_self = NULL;
+	gc_tcache_exited = 1;
+	gc_tcache_flush(tc);
+	pthread_mutex_lock(&gc_tcache_lock);
+	tc->abandoned_next = gc_tcache_abandoned;
+	gc_tcache_abandoned = tc;
+	pthread_mutex_unlock(&gc_tcache_lock);
+}
+
+static void gc_tcache_key_init(void)
+{
+	pthread_key_create(&gc_tcache_key, gc_tcache_thread_exit);
+}
+
+static gc_tcache_t *gc_tcache_get(void)
+{
+	gc_tcache_t *tc;
+
+	if (gc_tcache_self != NULL) {
+		return gc_tcache_self;
+	}
+	if (gc_tcache_exited) {
+		return NULL;
+	}
+	pthread_once(&gc_tcache_once, gc_tcache_key_init);
+
+	pthread_mutex_lock(&gc_tcache_lock);
+	tc = gc_tcache_abandoned;
+	if (tc != NULL) {
+		gc_tcache_abandoned = tc->abandoned_next;
+	}
+	pthread_mutex_unlock(&gc_tcache_lock);
+
+	if (tc == NULL) {
+		if (posix_memalign((void **)&tc, 64, sizeof(gc_tcache_t)) != 0) {
+			return NULL;
+		}
+		memset(tc, 0, sizeof(gc_tcache_t));
+	} else {
+		/* Frees that arrived while it was parked */
+		gc_tcache_drain_remote(tc);
+	}
+	tc->abandoned_next = NULL;
+	gc_tcache_self = tc;
+	pthread_setspecific(gc_tcache_key, tc);
+	return tc;
+}
+
+int gc_tcache_fits(size_t blksize)
+{
+	return blksize <= GC_TCACHE_MAX_BLK;
+}
+
+void *gc_tcache_alloc(size_t blksize)
+{
+	gc_tcache_t *tc;
+	gc_tcache_hdr_t *hdr;
+	int cls;
+
+	cls = gc_tcache_class(blksize);
+	if (cls < 0) {
+		return NULL;
+	}
+	tc = gc_tcache_get();
+	if (tc != NULL && tc->mag[cls] == NULL &&
+	    __atomic_load_n(&tc->remote, __ATOMIC_RELAXED) != NULL) {
+		gc_tcache_drain_remote(tc);
+	}
+	/* Past thread exit there is no cache, the block is an uncached one */
+	hdr = (tc != NULL) ? tc->mag[cls] : NULL;
+	if (hdr != NULL) {
+		tc->mag[cls] = GC_TCACHE_LINK(hdr)->next;
+		tc->mag_count[cls]--;
+	} else {
+		hdr = malloc(sizeof(gc_tcache_hdr_t) + gc_tcache_classes[cls]);
+		if (hdr == NULL) {
+			return NULL;
+		}
+	}
+	hdr->owner = tc;
+	((gc_mem_t *)(hdr + 1))->aux = cls;
+	return hdr + 1;
+}
+
+void gc_tcache_free(void *blk)
+{
+	gc_tcache_hdr_t *hdr = (gc_tcache_hdr_t *)blk - 1;
+	gc_tcache_t *tc = hdr->owner;
+	gc_tcache_link_t *link = GC_TCACHE_LINK(hdr);
+
+	if (tc == NULL) {
+		free(hdr);
+		return;
+	}
+	link->cls = ((gc_mem_t *)blk)->aux;
+	if (tc == gc_tcache_self) {
+		gc_tcache_put(tc, hdr);
+		return;
+	}
+
+	if (__atomic_add_fetch(&tc->remote_count, 1, __ATOMIC_RELAXED) > GC_TCACHE_MAG) {
+		__atomic_sub_fetch(&tc->remote_count, 1, __ATOMIC_RELAXED);
+		free(hdr);
+		return;
+	}
+	link->next = __atomic_load_n(&tc->remote, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&tc->remote, &link->next, hdr, 1,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+	}
+}
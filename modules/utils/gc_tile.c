@@ -0,0 +1,161 @@
+/*
+ *  gc_tile.c - Conversion between tiled and linear 2D surfaces
+ *
+ *  Copyright (C) 2018 Atanas Tulbenski <top4ester@gmail.com>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <memory.h>
+
+#include "debug.h"
+#include "gc.h"
+#include "gc_private.h"
+
+DEBUG_CREATE_CTX(GC_TILE, DBG_QUIET);
+
+#define GC_TILE_TO_LINEAR	0
+#define GC_TILE_FROM_LINEAR	1
+
+/*
+ * Every row of a tile is a run of t pixels, so a tile moves as t copies.
+ * A full row has a size known at compile time for each (t, bpp), which
+ * lets the compiler turn it into a few vector loads and stores instead
+ * of a memcpy call.
+ */
+static inline __attribute__ ((always_inline))
+void gc_tile_rows(uint8_t *lin, uint32_t lin_stride, uint8_t *tile, uint32_t tile_row,
+		  uint32_t bytes, uint32_t rows, int dir)
+{
+	uint32_t r;
+
+	for (r = 0; r < rows; r++) {
+		if (dir == GC_TILE_TO_LINEAR) {
+			memcpy(lin + (size_t)r * lin_stride, tile + r * tile_row, bytes);
+		} else {
+			memcpy(tile + r * tile_row, lin + (size_t)r * lin_stride, bytes);
+		}
+	}
+}
+
+/* Same for Z order: every 4 pixels are a 2x2 quad, two runs of 2 */
+static inline __attribute__ ((always_inline))
+void gc_tile_quads(uint8_t *lin, uint32_t lin_stride, uint8_t *tile, uint32_t bpp, int dir)
+{
+	uint8_t *row;
+	uint32_t k;
+	uint32_t x, y;
+
+	for (k = 0; k < 64; k++) {
+		/* Quad k starts at the even bits of k for x and the odd ones for y */
+		x = ((k & 1) | ((k >> 1) & 2) | ((k >> 2) & 4)) << 1;
+		y = (((k >> 1) & 1) | ((k >> 2) & 2) | ((k >> 3) & 4)) << 1;
+		row = lin + (size_t)y * lin_stride + x * bpp;
+		if (dir == GC_TILE_TO_LINEAR) {
+			memcpy(row, tile + k * 4 * bpp, 2 * bpp);
+			memcpy(row + lin_stride, tile + (k * 4 + 2) * bpp, 2 * bpp);
+		} else {
+			memcpy(tile + k * 4 * bpp, row, 2 * bpp);
+			memcpy(tile + (k * 4 + 2) * bpp, row + lin_stride, 2 * bpp);
+		}
+	}
+}
+
+/* One tile, cols x rows of it are inside the surface */
+static void gc_tile_one(const gc_surface_desc_t *desc, uint8_t *lin, uint32_t lin_stride,
+			uint32_t tx, uint32_t ty, uint32_t cols, uint32_t rows, int dir)
+{
+	uint8_t *tile = gc_surface_tile(desc, tx, ty);
+	uint32_t t = gc_layout_tile(desc->layout);
+	uint32_t bpp = desc->bpp;
+	uint32_t x, y;
+
+	if (desc->layout == GC_LAYOUT_ZORDER) {
+		if (cols == t && rows == t) {
+			switch (bpp) {
+			case 1: gc_tile_quads(lin, lin_stride, tile, 1, dir); return;
+			case 2: gc_tile_quads(lin, lin_stride, tile, 2, dir); return;
+			case 4: gc_tile_quads(lin, lin_stride, tile, 4, dir); return;
+			default: gc_tile_quads(lin, lin_stride, tile, bpp, dir); return;
+			}
+		}
+		/* Edge tile, pixel by pixel */
+		for (y = 0; y < rows; y++) {
+			for (x = 0; x < cols; x++) {
+				if (dir == GC_TILE_TO_LINEAR) {
+					memcpy(lin + (size_t)y * lin_stride + x * bpp,
+					       tile + gc_morton16(x, y) * bpp, bpp);
+				} else {
+					memcpy(tile + gc_morton16(x, y) * bpp,
+					       lin + (size_t)y * lin_stride + x * bpp, bpp);
+				}
+			}
+		}
+		return;
+	}
+	if (cols == t) {
+		switch (t * bpp) {
+		case 16: gc_tile_rows(lin, lin_stride, tile, 16, 16, rows, dir); return;
+		case 32: gc_tile_rows(lin, lin_stride, tile, 32, 32, rows, dir); return;
+		case 64: gc_tile_rows(lin, lin_stride, tile, 64, 64, rows, dir); return;
+		case 128: gc_tile_rows(lin, lin_stride, tile, 128, 128, rows, dir); return;
+		case 256: gc_tile_rows(lin, lin_stride, tile, 256, 256, rows, dir); return;
+		}
+	}
+	gc_tile_rows(lin, lin_stride, tile, t * bpp, cols * bpp, rows, dir);
+}
+
+static int gc_tile_convert(const gc_surface_desc_t *desc, uint8_t *lin, uint32_t lin_stride,
+			   int dir)
+{
+	uint32_t t, tx, ty;
+	uint32_t cols, rows;
+
+	if (desc == NULL || lin == NULL || desc->d_ptr == NULL || desc->bpp <= 0 ||
+	    desc->layout >= GC_LAYOUT_COUNT || lin_stride < (uint32_t)desc->w * desc->bpp) {
+		EPRN("Bad surface or linear stride %u\n", lin_stride);
+		return -1;
+	}
+	if (desc->layout == GC_LAYOUT_LINEAR) {
+		for (ty = 0; ty < (uint32_t)desc->h; ty++) {
+			if (dir == GC_TILE_TO_LINEAR) {
+				memcpy(lin + (size_t)ty * lin_stride,
+				       gc_surface_pixel(desc, 0, ty), desc->w * desc->bpp);
+			} else {
+				memcpy(gc_surface_pixel(desc, 0, ty),
+				       lin + (size_t)ty * lin_stride, desc->w * desc->bpp);
+			}
+		}
+		return 0;
+	}
+	/* Tile by tile, a tile and its t linear rows stay in the cache */
+	t = gc_layout_tile(desc->layout);
+	for (ty = 0; ty * t < (uint32_t)desc->h; ty++) {
+		rows = desc->h - ty * t;
+		rows = (rows < t) ? rows : t;
+		for (tx = 0; tx * t < (uint32_t)desc->w; tx++) {
+			cols = desc->w - tx * t;
+			cols = (cols < t) ? cols : t;
+			gc_tile_one(desc, lin + (size_t)ty * t * lin_stride + (size_t)tx * t * desc->bpp,
+				    lin_stride, tx, ty, cols, rows, dir);
+		}
+	}
+	return 0;
+}
+
+/* Copies the w x h pixels of src into a linear buffer with dst_stride bytes per row */
+__attribute__ ((visibility ("default")))
+int gc_surface_to_linear(const gc_surface_desc_t *src, void *dst, uint32_t dst_stride)
+{
+	return gc_tile_convert(src, dst, dst_stride, GC_TILE_TO_LINEAR);
+}
+
+/* Fills dst from a linear buffer, the padding of edge tiles is left as it is */
+__attribute__ ((visibility ("default")))
+int gc_surface_from_linear(const gc_surface_desc_t *dst, const void *src, uint32_t src_stride)
+{
+	return gc_tile_convert(dst, (uint8_t *)src, src_stride, GC_TILE_FROM_LINEAR);
+}
@@ -0,0 +1,181 @@
+/*
+ *  gc_tree.c - Parent and child gc objects with subtree accounting
+ *
+ *  Copyright (C) 2018 Atanas Tulbenski <top4ester@gmail.com>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "debug.h"
+#include "gc.h"
+#include "gc_private.h"
+
+DEBUG_CREATE_CTX(GC_TREE, DBG_QUIET);
+
+/*
+ * Guards the tree links. The charge path only follows tree_parent and
+ * takes no lock, so a gc may only move while its subtree is idle.
+ */
+static pthread_mutex_t gc_tree_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Adds bytes, negative ones too, to tree_used of every ancestor */
+void gc_tree_charge(gcobj_private_t *gc_prv_p, int64_t bytes)
+{
+	gcobj_private_t *p;
+
+	for (p = __atomic_load_n(&gc_prv_p->tree_parent, __ATOMIC_RELAXED); p != NULL;
+	     p = __atomic_load_n(&p->tree_parent, __ATOMIC_RELAXED)) {
+		__atomic_add_fetch(&p->tree_used, (uint64_t)bytes, __ATOMIC_RELAXED);
+	}
+}
+
+static uint64_t gc_tree_bytes(gcobj_private_t *gc_prv_p)
+{
+	return __atomic_load_n(&gc_prv_p->memused, __ATOMIC_RELAXED) +
+	       __atomic_load_n(&gc_prv_p->tree_used, __ATOMIC_RELAXED);
+}
+
+/* Under gc_tree_lock */
+static void gc_tree_unlink(gcobj_private_t *gc_prv_p)
+{
+	gcobj_private_t *parent = gc_prv_p->tree_parent;
+
+	if (parent == NULL) {
+		return;
+	}
+	gc_tree_charge(gc_prv_p, -(int64_t)gc_tree_bytes(gc_prv_p));
+	if (gc_prv_p->tree_prev != NULL) {
+		gc_prv_p->tree_prev->tree_next = gc_prv_p->tree_next;
+	} else {
+		parent->tree_child = gc_prv_p->tree_next;
+	}
+	if (gc_prv_p->tree_next != NULL) {
+		gc_prv_p->tree_next->tree_prev = gc_prv_p->tree_prev;
+	}
+	gc_prv_p->tree_next = NULL;
+	gc_prv_p->tree_prev = NULL;
+	__atomic_store_n(&gc_prv_p->tree_parent, NULL, __ATOMIC_RELAXED);
+}
+
+/* Under gc_tree_lock */
+static void gc_tree_link(gcobj_private_t *gc_prv_p, gcobj_private_t *parent)
+{
+	gc_prv_p->tree_prev = NULL;
+	gc_prv_p->tree_next = parent->tree_child;
+	if (parent->tree_child != NULL) {
+		parent->tree_child->tree_prev = gc_prv_p;
+	}
+	parent->tree_child = gc_prv_p;
+	__atomic_store_n(&gc_prv_p->tree_parent, parent, __ATOMIC_RELAXED);
+	gc_tree_charge(gc_prv_p, gc_tree_bytes(gc_prv_p));
+}
+
+/*
+ * Moves a gc with its whole subtree under parent, or makes it a root for
+ * NULL. The usage of the subtree moves along with it. Deleting parent
+ * deletes this gc as well.
+ */
+__attribute__ ((visibility ("default")))
+int gc_set_parent(gcobj_t *this, gcobj_t *parent)
+{
+	gcobj_private_t *gc_prv_p;
+	gcobj_private_t *parent_prv_p = NULL;
+	gcobj_private_t *p;
+
+	if (this == NULL) {
+		return -1;
+	}
+	gc_prv_p = (gcobj_private_t *) this->private_p;
+	if (parent != NULL) {
+		parent_prv_p = (gcobj_private_t *) parent->private_p;
+	}
+	pthread_mutex_lock(&gc_tree_lock);
+	if (gc_prv_p->tree_parent == parent_prv_p) {
+		pthread_mutex_unlock(&gc_tree_lock);
+		return 0;
+	}
+	for (p = parent_prv_p; p != NULL; p = p->tree_parent) {
+		if (p == gc_prv_p) {
+			pthread_mutex_unlock(&gc_tree_lock);
+			EPRN("gc %p can not go under its own descendant %p\n", this, parent);
+			return -1;
+		}
+	}
+	gc_tree_unlink(gc_prv_p);
+	if (parent_prv_p != NULL) {
+		gc_tree_link(gc_prv_p, parent_prv_p);
+	}
+	pthread_mutex_unlock(&gc_tree_lock);
+	return 0;
+}
+
+__attribute__ ((visibility ("default")))
+gcobj_t *gc_get_parent(gcobj_t *this)
+{
+	gcobj_private_t *gc_prv_p;
+	gcobj_t *parent = NULL;
+
+	if (this == NULL) {
+		return NULL;
+	}
+	gc_prv_p = (gcobj_private_t *) this->private_p;
+	pthread_mutex_lock(&gc_tree_lock);
+	if (gc_prv_p->tree_parent != NULL) {
+		parent = gc_prv_p->tree_parent->gc;
+	}
+	pthread_mutex_unlock(&gc_tree_lock);
+	return parent;
+}
+
+/* Bytes held by a gc and all of its descendants, NULL is the same as gc_memused */
+__attribute__ ((visibility ("default")))
+uint64_t gc_subtree_used(gcobj_t *this)
+{
+	if (this == NULL) {
+		return gc_memused(NULL);
+	}
+	return gc_tree_bytes((gcobj_private_t *) this->private_p);
+}
+
+/*
+ * Takes a gc that is going away out of the tree and returns its
+ * descendants chained through tree_next. They are cut loose from each
+ * other too, so they can be released in any order or on any thread.
+ */
+gcobj_private_t *gc_tree_detach(gcobj_private_t *gc_prv_p)
+{
+	gcobj_private_t *head;
+	gcobj_private_t *tail;
+	gcobj_private_t *p;
+
+	if (gc_prv_p->tree_parent == NULL && gc_prv_p->tree_child == NULL) {
+		return NULL;
+	}
+	pthread_mutex_lock(&gc_tree_lock);
+	gc_tree_unlink(gc_prv_p);
+	head = gc_prv_p->tree_child;
+	for (tail = head; tail != NULL && tail->tree_next != NULL; tail = tail->tree_next) {
+	}
+	/* Breadth first, every child chain goes to the end of the list */
+	for (p = head; p != NULL; p = p->tree_next) {
+		__atomic_store_n(&p->tree_parent, NULL, __ATOMIC_RELAXED);
+		__atomic_store_n(&p->tree_used, 0, __ATOMIC_RELAXED);
+		if (p->tree_child != NULL) {
+			tail->tree_next = p->tree_child;
+			p->tree_child->tree_prev = tail;
+			p->tree_child = NULL;
+			while (tail->tree_next != NULL) {
+				tail = tail->tree_next;
+			}
+		}
+	}
+	gc_prv_p->tree_child = NULL;
+	__atomic_store_n(&gc_prv_p->tree_used, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&gc_tree_lock);
+	return head;
+}
@@ -65,13 +65,19 @@ void *sobj_malloc(SObj_t *sobj_p, int memsize)
 __attribute__ ((visibility ("default")))
 void *sobj_calloc(SObj_t *sobj_p, int count, int memsize)
 {
-	void *ptr = NULL;
+	gcobj_t	*gc_p;
+
+	if (sobj_p == NULL) {
+		return NULL;
+	}
 
-	ptr = sobj_malloc(sobj_p, count * memsize);
-	if (ptr) {
-		memset(ptr, 0, count * memsize);
+	if (sobj_p->gc == NULL || count < 0 || memsize < 0) {
+		return NULL;
 	}
-	return ptr;
+
+	gc_p = sobj_p->gc;
+
+	return gc_p->memcalloc(gc_p, count, memsize);
 }
 
 __attribute__ ((visibility ("default")))
@@ -95,6 +101,37 @@ char *sobj_strdup(SObj_t *sobj_p, const char *str_p)
 	return (char *)gc_p->stringdup(gc_p, str_p);
 }
 
+/* Read-only copy of str shared with every other node, see gc_intern */
+__attribute__ ((visibility ("default")))
+const char *sobj_intern(SObj_t *sobj_p, const char *str_p)
+{
+	if (sobj_p == NULL || sobj_p->gc == NULL) {
+		return NULL;
+	}
+	return gc_intern(sobj_p->gc, str_p);
+}
+
+/* First child named name, compared by pointer thanks to interning */
+__attribute__ ((visibility ("default")))
+SObj_t *sobj_find_child(SObj_t *parent, const char *name)
+{
+	SObj_t *child;
+
+	if (parent == NULL || name == NULL) {
+		return NULL;
+	}
+	name = gc_intern_find(name);
+	if (name == NULL) {
+		return NULL;
+	}
+	for (child = parent->child; child != NULL; child = child->next) {
+		if (child->name == name) {
+			return child;
+		}
+	}
+	return NULL;
+}
+
 __attribute__ ((visibility ("default")))
 void sobj_free(SObj_t *sobj_p, void *ptr)
 {
@@ -177,6 +214,7 @@ void sobj_add_child(SObj_t *parent, SObj_t *child)
 			}
 		}
 		parent->child_last = child;
+		gc_set_parent(child->gc, parent->gc);
 #ifdef SOBJ_DBG_VERBOSE
 		sobj_print("[sobj_add_child]: parent", parent, NULL);
 		sobj_print("[sobj_add_child]:  child", child, NULL);
@@ -190,9 +228,14 @@ SObj_t *sobj_create(SObj_t *parent, const char *name)
 	SObj_t	*sobj = NULL;
 	gcobj_t	*gc_p;
 
-	gc_p = gc_objnew();
+	/* The node gc hangs under the parent one, see sobj_memused */
+	gc_p = gc_objnew_ex(&(gc_attr_t){ .parent = (parent != NULL) ? parent->gc : NULL });
+	if (gc_p == NULL) {
+		return NULL;
+	}
 	sobj = gc_p->memalloc(gc_p, sizeof(SObj_t));
 	if (sobj == NULL) {
+		gc_objdel(gc_p);
 		return NULL;
 	}
 
@@ -204,10 +247,11 @@ SObj_t *sobj_create(SObj_t *parent, const char *name)
 	sobj->previous = NULL;
 	sobj->private_data = NULL;
 	sobj->gc = gc_p;
+	/* Interned, so equal names are stored once and compare by pointer */
 	if (name != NULL) {
-		sobj->name = gc_p->stringdup(gc_p, name);
+		sobj->name = gc_intern(gc_p, name);
 	} else {
-		sobj->name = gc_p->stringdup(gc_p, "undefined");
+		sobj->name = gc_intern(gc_p, "undefined");
 	}
 
 	sobj_add_child(parent, sobj);
@@ -268,6 +312,7 @@ void sobj_remove_child(SObj_t *child)
 
 	child->parent = NULL;
 	child->parent_dbg = parent;
+	gc_set_parent(child->gc, NULL);
 #ifdef SOBJ_DBG_VERBOSE
 	//sobj_print("A parent", parent);
 	//sobj_print("A child", child);
@@ -304,6 +349,7 @@ void sobj_add_child_before(SObj_t *base, SObj_t *new)
 
 	if (new->parent != NULL) {
 		new->parent->child_count++;
+		gc_set_parent(new->gc, new->parent->gc);
 	}
 #ifdef SOBJ_DBG_VERBOSE
 	sobj_print(__func__, new, NULL);
@@ -337,6 +383,7 @@ void sobj_add_child_after(SObj_t *base, SObj_t *new)
 
 	if (new->parent != NULL) {
 		new->parent->child_count++;
+		gc_set_parent(new->gc, new->parent->gc);
 	}
 #ifdef SOBJ_DBG_VERBOSE
 	sobj_print(__func__, new, NULL);
@@ -385,28 +432,24 @@ void sobj_swap_previous(SObj_t *sobj)
 #endif
 }
 
+/* Every node lives in its own gc, deleting a child gc takes its subtree along */
 __attribute__ ((visibility ("default")))
 void sobj_destroy_childs(SObj_t *sobj)
 {
 	SObj_t	*tsobj = NULL;
 	SObj_t	*next_sobj = NULL;
-	gcobj_t	*gc_p;
 #ifdef SOBJ_DBG_VERBOSE
 	IPRN("[%s] Trace <%s>\n", __FUNCTION__, sobj->name);
 #endif
 	tsobj = sobj->child;
 	while (tsobj) {
 		next_sobj = tsobj->next;
-		if (tsobj->child != NULL) {
-			sobj_destroy_childs(tsobj);
-		}
-		sobj_remove_child(tsobj);
-		gc_p = tsobj->gc;
-		gc_p->memfree(gc_p, tsobj);
-		gc_objdel(gc_p);
+		gc_objdel(tsobj->gc);
 		tsobj = next_sobj;
 	}
 	sobj->child = NULL;
+	sobj->child_last = NULL;
+	sobj->child_count = 0;
 }
 
 __attribute__ ((visibility ("default")))
@@ -420,18 +463,24 @@ void sobj_destroy(SObj_t *sobj)
 #ifdef SOBJ_DBG_VERBOSE
 	IPRN("[%s] Trace [%p]<%s>\n", __FUNCTION__, sobj, sobj->name);
 #endif
-	if (sobj->child != NULL) {
-		sobj_destroy_childs(sobj);
-	}
-
 	sobj_remove_child(sobj);
 
+	/* Frees the whole subtree, sobj included */
 	gc_p = sobj->gc;
 	sobj->gc = NULL;
-	gc_p->memfree(gc_p, sobj);
 	gc_objdel(gc_p);
 }
 
+/* Bytes held by a node and everything below it, without walking the tree */
+__attribute__ ((visibility ("default")))
+uint64_t sobj_memused(SObj_t *sobj)
+{
+	if (sobj == NULL || sobj->gc == NULL) {
+		return 0;
+	}
+	return gc_subtree_used(sobj->gc);
+}
+
 __attribute__ ((visibility ("default")))
 bool sobj_valid(SObj_t *sobj)
 {
@@ -543,6 +592,15 @@ int test_sobj(void)
 	sobj_add_child_after(t_node, child_node);
 	sobj_print("Final      : ", master_node, NULL);
 
+	if (sobj_find_child(master_node, "child 3") == NULL ||
+	    sobj_find_child(master_node, "new node") != child_node) {
+		printf("Failed to find child node\n");
+	}
+	if (sobj_memused(master_node) <= sobj_memused(child_node) ||
+	    sobj_memused(child_node) != 6 * sizeof(SObj_t)) {
+		printf("Subtree memory does not add up\n");
+	}
+
 	sobj_destroy(master_node);
 
 	return (0);
@@ -13,7 +13,7 @@
 #include <stdbool.h>
 
 typedef struct SObj_s {
-	char		*name;
+	const char	*name;		/* Interned, read-only */
 	uint32_t	child_count;
 	struct SObj_s	*parent;
 	struct SObj_s	*parent_dbg;
@@ -52,9 +52,12 @@ void *sobj_get_private(SObj_t *sobj);
 void *sobj_malloc(SObj_t *sobj_p, int memsize);
 void *sobj_calloc(SObj_t *sobj_p, int count, int memsize);
 char *sobj_strdup(SObj_t *sobj_p, const char *str_p);
+const char *sobj_intern(SObj_t *sobj_p, const char *str_p);
+SObj_t *sobj_find_child(SObj_t *parent, const char *name);
 void sobj_free(SObj_t *sobj_p, void *ptr);
 void sobj_print_mem(SObj_t *sobj_p);
 void sobj_print_mem_full(SObj_t *sobj_p);
+uint64_t sobj_memused(SObj_t *sobj);
 
 void sobj_print(const char *tag, SObj_t *sobj, int (*cb)(void*));
 
@@ -0,0 +1,20 @@
+/*
+ * Automatically generated C config: don't edit
+ * version: 
+ */
+#define AUTOCONF_TIMESTAMP "2026-10-17 07:09:47 UTC"
+
+#define CONFIG_TARGET_NATIVE 1
+
+/*
+ * VEngine framework
+ */
+#define CONFIG_LIBUTILS 1
+#define CONFIG_LIBUTILS_GC_MMAP_THRESHOLD 1024
+#define CONFIG_LIBUTILS_GC_HUGEPAGE_MADVISE 1
+#define CONFIG_LIBUTILS_GC_ATRACE 1
+#define CONFIG_GCTOOL 1
+
+/*
+ * TODO: Application part here
+ */